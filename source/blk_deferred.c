@@ -19,6 +19,7 @@ struct bio_set g_BlkDeferredBioset = { 0 };
 
 typedef struct dio_bio_complete_s{
     blk_deferred_request_t* dio_req;
+    blk_deferred_t* dio;
     sector_t bio_sect_len;
 }dio_bio_complete_t;
 
@@ -33,12 +34,32 @@ static container_sl_t DioDeadlocked;
 atomic64_t dio_alloc_count;
 atomic64_t dio_free_count;
 
-void blk_deferred_init( void )
+// the reserve allows to continue copy-on-write when the memory is low
+#define BLK_DEFERRED_POOL_MIN 64
+
+static struct kmem_cache* g_blk_deferred_cache = NULL;
+static mempool_t* g_blk_deferred_pool = NULL;
+
+int blk_deferred_init( void )
 {
     atomic64_set( &dio_alloc_count, 0 );
     atomic64_set( &dio_free_count, 0 );
 
     container_sl_init( &DioDeadlocked, sizeof( dio_deadlocked_t ) );
+
+    g_blk_deferred_cache = kmem_cache_create( "veeamsnap_blk_deferred", sizeof( blk_deferred_t ), 0, 0, NULL );
+    if (g_blk_deferred_cache == NULL){
+        log_err( "Unable to create kmem_cache for defer IO" );
+        return -ENOMEM;
+    }
+    g_blk_deferred_pool = mempool_create_slab_pool( BLK_DEFERRED_POOL_MIN, g_blk_deferred_cache );
+    if (g_blk_deferred_pool == NULL){
+        log_err( "Unable to create mempool for defer IO" );
+        kmem_cache_destroy( g_blk_deferred_cache );
+        g_blk_deferred_cache = NULL;
+        return -ENOMEM;
+    }
+    return SUCCESS;
 }
 void blk_deferred_done( void )
 {
@@ -56,6 +77,15 @@ void blk_deferred_done( void )
     }
 
     container_sl_done( &DioDeadlocked );
+
+    if (g_blk_deferred_pool != NULL){
+        mempool_destroy( g_blk_deferred_pool );
+        g_blk_deferred_pool = NULL;
+    }
+    if (g_blk_deferred_cache != NULL){
+        kmem_cache_destroy( g_blk_deferred_cache );
+        g_blk_deferred_cache = NULL;
+    }
 }
 
 void blk_deferred_print_state( void )
@@ -76,21 +106,133 @@ void blk_deferred_request_deadlocked( blk_deferred_request_t* dio_req )
     log_warn( "Deadlock with defer IO" );
 }
 
+static void _blk_deferred_pool_destroy_cb( void* this_resource )
+{
+    blk_deferred_pool_t* pool = (blk_deferred_pool_t*)this_resource;
+
+    if (pool->buffs != NULL){
+        size_t inx;
+
+        for (inx = 0; inx < pool->free_count; ++inx){
+            page_array_t* buff = NULL;
+
+            if ((SUCCESS == page_array_ptr_get( pool->buffs, inx, (void**)&buff )) && (buff != NULL))
+                page_array_free( buff );
+        }
+        if (pool->free_count != pool->capacity)
+            log_err_sz( "Defer IO buffers were lost: ", pool->capacity - pool->free_count );
+
+        page_array_free( pool->buffs );
+    }
+    dbg_kfree( pool );
+}
+
+blk_deferred_pool_t* blk_deferred_pool_create( size_t capacity, size_t page_count )
+{
+    blk_deferred_pool_t* pool = dbg_kzalloc( sizeof( blk_deferred_pool_t ), GFP_KERNEL );
+    if (pool == NULL)
+        return NULL;
+
+    shared_resource_init( &pool->shared, pool, _blk_deferred_pool_destroy_cb );
+    spin_lock_init( &pool->lock );
+    init_waitqueue_head( &pool->waiter );
+    pool->page_count = page_count;
+    pool->capacity = 0;
+    pool->free_count = 0;
+    atomic64_set( &pool->state_hit, 0 );
+    atomic64_set( &pool->state_miss, 0 );
+    atomic64_set( &pool->state_wait, 0 );
+
+    blk_deferred_pool_get_resource( pool );
+
+    pool->buffs = page_array_alloc( page_count_calc( capacity * sizeof( page_array_t* ) ), GFP_KERNEL );
+    if (pool->buffs == NULL){
+        blk_deferred_pool_put_resource( pool );
+        return NULL;
+    }
+
+    while (pool->capacity < capacity){
+        page_array_t* buff = page_array_alloc( page_count, GFP_KERNEL );
+        if (buff == NULL){
+            blk_deferred_pool_put_resource( pool );
+            return NULL;
+        }
+        page_array_ptr_set( pool->buffs, pool->capacity, buff );
+        ++pool->capacity;
+        ++pool->free_count;
+    }
+
+    log_tr_format( "Defer IO buffers pool of %lu blocks created", pool->capacity );
+    return pool;
+}
+
+static page_array_t* _blk_deferred_pool_take( blk_deferred_pool_t* pool, size_t page_count )
+{
+    page_array_t* buff = NULL;
+
+    // the block size was changed after the pool was created
+    if (page_count != pool->page_count){
+        atomic64_inc( &pool->state_miss );
+        return NULL;
+    }
+
+    spin_lock( &pool->lock );
+    if (pool->free_count > 0){
+        --pool->free_count;
+        page_array_ptr_get( pool->buffs, pool->free_count, (void**)&buff );
+    }
+    spin_unlock( &pool->lock );
+
+    if (buff == NULL){
+        atomic64_inc( &pool->state_miss );
+        return NULL;
+    }
+    atomic64_inc( &pool->state_hit );
+    blk_deferred_pool_get_resource( pool );
+    return buff;
+}
+
+static void _blk_deferred_pool_give( blk_deferred_pool_t* pool, page_array_t* buff )
+{
+    spin_lock( &pool->lock );
+    page_array_ptr_set( pool->buffs, pool->free_count, buff );
+    ++pool->free_count;
+    spin_unlock( &pool->lock );
+
+    wake_up( &pool->waiter );
+    blk_deferred_pool_put_resource( pool );
+}
+
+void blk_deferred_pool_print_state( blk_deferred_pool_t* pool )
+{
+    log_tr_format( "Defer IO buffers pool: capacity=%lu free=%lu hit=%lld miss=%lld wait=%lld",
+        pool->capacity, pool->free_count,
+        (long long int)atomic64_read( &pool->state_hit ),
+        (long long int)atomic64_read( &pool->state_miss ),
+        (long long int)atomic64_read( &pool->state_wait ) );
+}
+
 void blk_deferred_free( blk_deferred_t* dio )
 {
     if (dio->buff != NULL){
-        page_array_free( dio->buff );
+        if (dio->pool != NULL)
+            _blk_deferred_pool_give( dio->pool, dio->buff );
+        else
+            page_array_free( dio->buff );
         dio->buff = NULL;
     }
-    dbg_kfree( dio );
+    mempool_free( dio, g_blk_deferred_pool );
+    atomic64_inc( &dio_free_count );
 }
 
-blk_deferred_t* blk_deferred_alloc( blk_descr_array_index_t block_index, blk_descr_unify_t* blk_descr )
+// The buffer is taken from the pool, if it has any, otherwise the pages are allocated.
+blk_deferred_t* blk_deferred_alloc( blk_descr_array_index_t block_index, blk_descr_unify_t* blk_descr, blk_deferred_pool_t* pool )
 {
     bool success = false;
-    blk_deferred_t* dio = dbg_kmalloc( sizeof( blk_deferred_t ), GFP_NOIO );
+    blk_deferred_t* dio = mempool_alloc( g_blk_deferred_pool, GFP_NOIO );
     if (dio == NULL)
         return NULL;
+    atomic64_inc( &dio_alloc_count );
 
 #ifdef BLK_DEFER_LIST
     INIT_LIST_HEAD( &dio->link );
@@ -101,10 +243,21 @@ blk_deferred_t* blk_deferred_alloc( blk_descr_array_index_t block_index, blk_des
 
     dio->sect.ofs = block_index << SNAPSTORE_BLK_SHIFT;
     dio->sect.cnt = SNAPSTORE_BLK_SIZE;
+    atomic64_set( &dio->sect_processed, 0 );
+    dio->pool = NULL;
 
     do{
         int page_count = SNAPSTORE_BLK_SIZE / SECTORS_IN_PAGE;
 
+        if (pool != NULL){
+            dio->buff = _blk_deferred_pool_take( pool, page_count );
+            if (dio->buff != NULL){
+                dio->pool = pool;
+                success = true;
+                break;
+            }
+        }
+
         dio->buff = page_array_alloc( page_count, GFP_NOIO );
         if (dio->buff == NULL)
             break;
@@ -177,16 +330,17 @@ struct bio* _blk_deferred_bio_alloc( int nr_iovecs )
 
 void blk_deferred_complete( blk_deferred_request_t* dio_req, sector_t portion_sect_cnt, int result )
 {
-    atomic64_add( portion_sect_cnt, &dio_req->sect_processed );
-
-    if (dio_req->sect_len == atomic64_read( &dio_req->sect_processed )){
-        complete( &dio_req->complete );
-    }
-
     if (result != SUCCESS){
         dio_req->result = result;
         log_err_d( "Failed to process defer IO request. errno=", result );
     }
+
+    wake_up( &dio_req->dio_waiter );
+
+    //the request can be freed right after completion
+    if (dio_req->sect_len == atomic64_add_return( portion_sect_cnt, &dio_req->sect_processed )){
+        complete( &dio_req->complete );
+    }
 }
 
 
@@ -216,6 +370,8 @@ void blk_deferred_bio_endio( struct bio *bio )
 #endif
 
 #endif
+        if (complete_param->dio)
+            atomic64_add( complete_param->bio_sect_len, &complete_param->dio->sect_processed );
         blk_deferred_complete( complete_param->dio_req, complete_param->bio_sect_len, local_err );
         bio->bi_private = NULL;
     }
@@ -227,14 +383,15 @@ void blk_deferred_bio_endio( struct bio *bio )
 sector_t _blk_deferred_submit_pages(
     struct block_device* blk_dev,
     blk_deferred_request_t* dio_req,
+    blk_deferred_t* dio,
     int direction,
     sector_t arr_ofs,
-    page_array_t* arr,
     sector_t ofs_sector,
     sector_t size_sector
 ){
 
     struct bio *bio = NULL;
+    page_array_t* arr = dio->buff;
     int nr_iovecs;
     int page_inx = arr_ofs >> (PAGE_SHIFT - SECTOR512_SHIFT);
     sector_t process_sect = 0;
@@ -299,6 +456,7 @@ sector_t _blk_deferred_submit_pages(
 
 
     ((dio_bio_complete_t*)bio->bi_private)->dio_req = dio_req;
+    ((dio_bio_complete_t*)bio->bi_private)->dio = dio;
     ((dio_bio_complete_t*)bio->bi_private)->bio_sect_len = process_sect;
 
 #ifndef REQ_OP_BITS //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
@@ -314,16 +472,16 @@ sector_t _blk_deferred_submit_pages(
 sector_t blk_deferred_submit_pages(
     struct block_device* blk_dev,
     blk_deferred_request_t* dio_req,
+    blk_deferred_t* dio,
     int direction,
     sector_t arr_ofs,
-    page_array_t* arr,
     sector_t ofs_sector,
     sector_t size_sector
 ){
     sector_t process_sect = 0;
 
     do{
-        sector_t portion_sect = _blk_deferred_submit_pages( blk_dev, dio_req, direction, arr_ofs + process_sect, arr, ofs_sector + process_sect, size_sector - process_sect );
+        sector_t portion_sect = _blk_deferred_submit_pages( blk_dev, dio_req, dio, direction, arr_ofs + process_sect, ofs_sector + process_sect, size_sector - process_sect );
         if (portion_sect == 0){
             log_err_format( "Failed to submit defer IO pages. Only [%lld] sectors processed", process_sect );
             break;
@@ -362,6 +520,7 @@ blk_deferred_request_t* blk_deferred_request_new( void )
     atomic64_set( &dio_req->sect_processed, 0 );
     dio_req->sect_len = 0;
     init_completion( &dio_req->complete );
+    init_waitqueue_head( &dio_req->dio_waiter );
 
     return dio_req;
 }
@@ -398,6 +557,70 @@ bool blk_deferred_request_already_added( blk_deferred_request_t* dio_req, blk_de
 }
 #endif//BLK_DEFER_LIST
 
+// returns the length of the request up to the end of the block, or zero if the block was not added
+#ifdef BLK_DEFER_LIST
+sector_t blk_deferred_request_position( blk_deferred_request_t* dio_req, blk_descr_array_index_t block_index )
+{
+    sector_t position = 0;
+    struct list_head* _list_head;
+
+    list_for_each( _list_head, &dio_req->dios ){
+        blk_deferred_t* dio = list_entry( _list_head, blk_deferred_t, link );
+
+        position += dio->sect.cnt;
+        if (dio->blk_index == block_index)
+            return position;
+    }
+    return 0;
+}
+#else //BLK_DEFER_LIST
+sector_t blk_deferred_request_position( blk_deferred_request_t* dio_req, blk_descr_array_index_t block_index )
+{
+    sector_t position = 0;
+    int dios_index;
+
+    for (dios_index = 0; dios_index < dio_req->dios_cnt; ++dios_index){
+        blk_deferred_t* dio = dio_req->dios[dios_index];
+
+        position += dio->sect.cnt;
+        if (dio->blk_index == block_index)
+            return position;
+    }
+    return 0;
+}
+#endif//BLK_DEFER_LIST
+
+// fills the buffer of the block with zeros, if the block was added
+#ifdef BLK_DEFER_LIST
+void blk_deferred_request_zero_block( blk_deferred_request_t* dio_req, blk_descr_array_index_t block_index )
+{
+    struct list_head* _list_head;
+
+    list_for_each( _list_head, &dio_req->dios ){
+        blk_deferred_t* dio = list_entry( _list_head, blk_deferred_t, link );
+
+        if (dio->blk_index == block_index){
+            page_array_memset( dio->buff, 0 );
+            return;
+        }
+    }
+}
+#else //BLK_DEFER_LIST
+void blk_deferred_request_zero_block( blk_deferred_request_t* dio_req, blk_descr_array_index_t block_index )
+{
+    int dios_index;
+
+    for (dios_index = 0; dios_index < dio_req->dios_cnt; ++dios_index){
+        blk_deferred_t* dio = dio_req->dios[dios_index];
+
+        if (dio->blk_index == block_index){
+            page_array_memset( dio->buff, 0 );
+            return;
+        }
+    }
+}
+#endif//BLK_DEFER_LIST
+
 
 #ifdef BLK_DEFER_LIST
 int blk_deferred_request_add( blk_deferred_request_t* dio_req, blk_deferred_t* dio )
@@ -453,11 +676,32 @@ void blk_deferred_request_free( blk_deferred_request_t* dio_req )
 }
 #endif //BLK_DEFER_LIST
 
+#ifdef BLK_DEFER_LIST
 void blk_deferred_request_waiting_skip( blk_deferred_request_t* dio_req )
 {
+    struct list_head* _list_head;
+
     init_completion( &dio_req->complete );
     atomic64_set( &dio_req->sect_processed, 0 );
+
+    list_for_each( _list_head, &dio_req->dios ){
+        blk_deferred_t* dio = list_entry( _list_head, blk_deferred_t, link );
+
+        atomic64_set( &dio->sect_processed, 0 );
+    }
 }
+#else //BLK_DEFER_LIST
+void blk_deferred_request_waiting_skip( blk_deferred_request_t* dio_req )
+{
+    int inx;
+
+    init_completion( &dio_req->complete );
+    atomic64_set( &dio_req->sect_processed, 0 );
+
+    for (inx = 0; inx < dio_req->dios_cnt; ++inx)
+        atomic64_set( &dio_req->dios[inx]->sect_processed, 0 );
+}
+#endif //BLK_DEFER_LIST
 
 int blk_deferred_request_wait( blk_deferred_request_t* dio_req )
 {
@@ -484,7 +728,116 @@ int blk_deferred_request_wait( blk_deferred_request_t* dio_req )
     return dio_req->result;
 }
 
-int blk_deferred_request_read_original( struct block_device* original_blk_dev, blk_deferred_request_t* dio_copy_req )
+static inline bool _blk_deferred_is_processed( blk_deferred_t* dio )
+{
+    return (dio->sect.cnt == atomic64_read( &dio->sect_processed ));
+}
+
+static int _blk_deferred_wait( blk_deferred_request_t* dio_req, blk_deferred_t* dio )
+{
+    u64 start_jiffies = get_jiffies_64( );
+
+    while (0 == wait_event_timeout( dio_req->dio_waiter, _blk_deferred_is_processed( dio ), (HZ * 1) )){
+        if (jiffies_to_msecs( get_jiffies_64( ) - start_jiffies ) > 60 * 1000){
+            log_warn( "Defer IO timeout" );
+            return -EDEADLK;
+        }
+    }
+    return SUCCESS;
+}
+
+// wait until the first sect_cnt sectors of the request are processed.
+// The request can still be in progress, so it should be waited with blk_deferred_request_wait() before free.
+#ifdef BLK_DEFER_LIST
+int blk_deferred_request_wait_part( blk_deferred_request_t* dio_req, sector_t sect_cnt )
+{
+    int res = SUCCESS;
+    sector_t position = 0;
+    struct list_head* _list_head;
+
+    list_for_each( _list_head, &dio_req->dios ){
+        blk_deferred_t* dio = list_entry( _list_head, blk_deferred_t, link );
+
+        if (position >= sect_cnt)
+            break;
+
+        res = _blk_deferred_wait( dio_req, dio );
+        if (res != SUCCESS)
+            return res;
+
+        position += dio->sect.cnt;
+    }
+    return dio_req->result;
+}
+#else //BLK_DEFER_LIST
+int blk_deferred_request_wait_part( blk_deferred_request_t* dio_req, sector_t sect_cnt )
+{
+    int res = SUCCESS;
+    sector_t position = 0;
+    int inx;
+
+    for (inx = 0; (inx < dio_req->dios_cnt) && (position < sect_cnt); ++inx){
+        blk_deferred_t* dio = dio_req->dios[inx];
+
+        res = _blk_deferred_wait( dio_req, dio );
+        if (res != SUCCESS)
+            return res;
+
+        position += dio->sect.cnt;
+    }
+    return dio_req->result;
+}
+#endif //BLK_DEFER_LIST
+
+#ifdef BLK_DEFER_LIST
+void blk_deferred_request_preserve( blk_deferred_request_t* dio_req, blk_descr_array_t* store_block_map )
+{
+    struct list_head* _list_head;
+
+    list_for_each( _list_head, &dio_req->dios ){
+        blk_deferred_t* dio = list_entry( _list_head, blk_deferred_t, link );
+
+        blk_descr_array_set_preserved( store_block_map, dio->blk_index );
+    }
+}
+
+void blk_deferred_request_preserve_part( blk_deferred_request_t* dio_req, sector_t sect_cnt, blk_descr_array_t* store_block_map )
+{
+    sector_t position = 0;
+    struct list_head* _list_head;
+
+    list_for_each( _list_head, &dio_req->dios ){
+        blk_deferred_t* dio = list_entry( _list_head, blk_deferred_t, link );
+
+        if (position >= sect_cnt)
+            break;
+
+        blk_descr_array_set_preserved( store_block_map, dio->blk_index );
+        position += dio->sect.cnt;
+    }
+}
+#else //BLK_DEFER_LIST
+void blk_deferred_request_preserve( blk_deferred_request_t* dio_req, blk_descr_array_t* store_block_map )
+{
+    int inx;
+
+    for (inx = 0; inx < dio_req->dios_cnt; ++inx)
+        blk_descr_array_set_preserved( store_block_map, dio_req->dios[inx]->blk_index );
+}
+
+void blk_deferred_request_preserve_part( blk_deferred_request_t* dio_req, sector_t sect_cnt, blk_descr_array_t* store_block_map )
+{
+    sector_t position = 0;
+    int inx;
+
+    for (inx = 0; (inx < dio_req->dios_cnt) && (position < sect_cnt); ++inx){
+        blk_descr_array_set_preserved( store_block_map, dio_req->dios[inx]->blk_index );
+        position += dio_req->dios[inx]->sect.cnt;
+    }
+}
+#endif //BLK_DEFER_LIST
+
+int blk_deferred_request_read_original_submit( struct block_device* original_blk_dev, blk_deferred_request_t* dio_copy_req )
 {
     int res = -ENODATA;
 #ifndef BLK_DEFER_LIST
@@ -508,7 +861,7 @@ int blk_deferred_request_read_original( struct block_device* original_blk_dev, b
             sector_t ofs = dio->sect.ofs;
             sector_t cnt = dio->sect.cnt;
 
-            if (cnt != blk_deferred_submit_pages( original_blk_dev, dio_copy_req, READ, page_array_ofs, dio->buff, ofs, cnt )){
+            if (cnt != blk_deferred_submit_pages( original_blk_dev, dio_copy_req, dio, READ, page_array_ofs, ofs, cnt )){
                 log_err_sect( "Failed to submit reading defer IO request. ofs=", dio->sect.ofs );
                 res = -EIO;
                 break;
@@ -520,13 +873,20 @@ int blk_deferred_request_read_original( struct block_device* original_blk_dev, b
         }
     }
 
+    return res;
+}
+
+int blk_deferred_request_read_original( struct block_device* original_blk_dev, blk_deferred_request_t* dio_copy_req )
+{
+    int res = blk_deferred_request_read_original_submit( original_blk_dev, dio_copy_req );
+
     if (res == SUCCESS)
         res = blk_deferred_request_wait( dio_copy_req );
 
     return res;
 }
 
-int blk_deferred_request_store_file( struct block_device* blk_dev, blk_deferred_request_t* dio_copy_req )
+int blk_deferred_request_store_file_submit( struct block_device* blk_dev, blk_deferred_request_t* dio_copy_req )
 {
     int res = SUCCESS;
 #ifndef BLK_DEFER_LIST
@@ -561,7 +921,7 @@ int blk_deferred_request_store_file( struct block_device* blk_dev, blk_deferred_
 
                 //log_err_range( "rg=", (*rg) );
 
-                process_sect = blk_deferred_submit_pages( blk_dev, dio_copy_req, WRITE, page_array_ofs, dio->buff, rg->ofs, rg->cnt );
+                process_sect = blk_deferred_submit_pages( blk_dev, dio_copy_req, dio, WRITE, page_array_ofs, rg->ofs, rg->cnt );
                 BUG_ON( rg->cnt != process_sect );
 
                 if (rg->cnt != process_sect){
@@ -578,15 +938,21 @@ int blk_deferred_request_store_file( struct block_device* blk_dev, blk_deferred_
         }
     }
 
-    if (res != SUCCESS)
-        return res;
-    
-    res = blk_deferred_request_wait( dio_copy_req );
+    return res;
+}
+
+int blk_deferred_request_store_file( struct block_device* blk_dev, blk_deferred_request_t* dio_copy_req )
+{
+    int res = blk_deferred_request_store_file_submit( blk_dev, dio_copy_req );
+
+    if (res == SUCCESS)
+        res = blk_deferred_request_wait( dio_copy_req );
+
     return res;
 }
 
 #ifdef SNAPSTORE_MULTIDEV
-int blk_deferred_request_store_multidev( blk_deferred_request_t* dio_copy_req )
+int blk_deferred_request_store_multidev_submit( blk_deferred_request_t* dio_copy_req )
 {
     int res = SUCCESS;
 #ifndef BLK_DEFER_LIST
@@ -623,7 +989,7 @@ int blk_deferred_request_store_multidev( blk_deferred_request_t* dio_copy_req )
 
                 //log_err_range( "rg=", (*rg) );
 
-                process_sect = blk_deferred_submit_pages( blk_dev, dio_copy_req, WRITE, page_array_ofs, dio->buff, rg->ofs, rg->cnt );
+                process_sect = blk_deferred_submit_pages( blk_dev, dio_copy_req, dio, WRITE, page_array_ofs, rg->ofs, rg->cnt );
                 BUG_ON( rg->cnt != process_sect );
 
                 if (rg->cnt != process_sect){
@@ -640,10 +1006,16 @@ int blk_deferred_request_store_multidev( blk_deferred_request_t* dio_copy_req )
         }
     }
 
-    if (res != SUCCESS)
-        return res;
+    return res;
+}
+
+int blk_deferred_request_store_multidev( blk_deferred_request_t* dio_copy_req )
+{
+    int res = blk_deferred_request_store_multidev_submit( dio_copy_req );
+
+    if (res == SUCCESS)
+        res = blk_deferred_request_wait( dio_copy_req );
 
-    res = blk_deferred_request_wait( dio_copy_req );
     return res;
 }
 #endif
@@ -656,6 +1028,8 @@ int blk_deffered_request_store_mem( blk_deferred_request_t* dio_copy_req )
 #endif
     sector_t processed = 0;
 
+    blk_deferred_request_waiting_skip( dio_copy_req );
+
 #ifdef BLK_DEFER_LIST
     if (!list_empty( &dio_copy_req->dios )){
         struct list_head* _list_head;
@@ -675,6 +1049,7 @@ int blk_deffered_request_store_mem( blk_deferred_request_t* dio_copy_req )
                 break;
             }
             processed += sector_from_size( portion );
+            atomic64_set( &dio->sect_processed, dio->sect.cnt );
         }
     }
 
@@ -2,6 +2,7 @@
 #include "page_array.h"
 #include "range.h"
 #include "container.h"
+#include "shared_resource.h"
 #include "blk_descr_file.h"
 #include "blk_descr_mem.h"
 #include "blk_descr_multidev.h"
@@ -10,6 +11,41 @@
 
 #define BLK_DEFER_LIST
 
+// Recyclable buffers for the blocks to copy, so the pages are not allocated in the IO path.
+// Each buffer in use holds a reference, so the pool lives until all of them are returned.
+typedef struct blk_deferred_pool_s
+{
+    shared_resource_t shared;
+    spinlock_t lock;
+    size_t page_count; // pages in each buffer
+    size_t capacity;
+    size_t free_count;
+    page_array_t* buffs; // stack of the free buffers
+    wait_queue_head_t waiter; // woken when a buffer is returned
+
+    atomic64_t state_hit;
+    atomic64_t state_miss;
+    atomic64_t state_wait;
+}blk_deferred_pool_t;
+
+blk_deferred_pool_t* blk_deferred_pool_create( size_t capacity, size_t page_count );
+void blk_deferred_pool_print_state( blk_deferred_pool_t* pool );
+
+static inline blk_deferred_pool_t* blk_deferred_pool_get_resource( blk_deferred_pool_t* pool )
+{
+    return (blk_deferred_pool_t*)shared_resource_get( &pool->shared );
+}
+static inline void blk_deferred_pool_put_resource( blk_deferred_pool_t* pool )
+{
+    shared_resource_put( &pool->shared );
+}
+
+// the pool has free buffers for the given count of blocks, or for all of its buffers if it is smaller
+static inline bool blk_deferred_pool_has_room( blk_deferred_pool_t* pool, size_t blocks_count )
+{
+    return pool->free_count >= min_t( size_t, blocks_count, pool->capacity );
+}
+
 typedef struct blk_deferred_s
 {
 #ifdef BLK_DEFER_LIST
@@ -20,8 +56,10 @@ typedef struct blk_deferred_s
     blk_descr_unify_t* blk_descr;    //for writing to snapstore - blk_descr_file_t or blk_descr_mem_t
 
     range_t sect;
+    atomic64_t sect_processed; // the block is processed separately from the whole request
 
     page_array_t* buff;
+    blk_deferred_pool_t* pool; // the buffer is returned to the pool, or is freed if NULL
 }blk_deferred_t;
 
 typedef struct blk_deferred_request_s
@@ -30,6 +68,7 @@ typedef struct blk_deferred_request_s
     sector_t sect_len;
     atomic64_t sect_processed;
     int result;
+    wait_queue_head_t dio_waiter; // woken on each portion of the processed blocks
 
 #ifdef BLK_DEFER_LIST
     struct list_head dios;
@@ -41,11 +80,11 @@ typedef struct blk_deferred_request_s
 }blk_deferred_request_t;
 
 
-void blk_deferred_init( void );
+int blk_deferred_init( void );
 void blk_deferred_done( void );
 void blk_deferred_print_state( void );
 
-blk_deferred_t* blk_deferred_alloc( blk_descr_array_index_t block_index, blk_descr_unify_t* blk_descr );
+blk_deferred_t* blk_deferred_alloc( blk_descr_array_index_t block_index, blk_descr_unify_t* blk_descr, blk_deferred_pool_t* pool );
 void blk_deferred_free( blk_deferred_t* dio );
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
@@ -56,7 +95,7 @@ void blk_deferred_bio_endio( struct bio *bio );
 
 void blk_deferred_complete( blk_deferred_request_t* dio_req, sector_t portion_sect_cnt, int result );
 
-sector_t blk_deferred_submit_pages( struct block_device* blk_dev, blk_deferred_request_t* dio_req, int direction, sector_t arr_ofs, page_array_t* arr, sector_t ofs_sector, sector_t size_sector );
+sector_t blk_deferred_submit_pages( struct block_device* blk_dev, blk_deferred_request_t* dio_req, blk_deferred_t* dio, int direction, sector_t arr_ofs, sector_t ofs_sector, sector_t size_sector );
 
 void blk_deferred_memcpy_read( char* databuff, blk_deferred_request_t* dio_req, page_array_t* arr, sector_t arr_ofs, sector_t size_sector );
 
@@ -64,6 +103,8 @@ void blk_deferred_memcpy_read( char* databuff, blk_deferred_request_t* dio_req,
 blk_deferred_request_t* blk_deferred_request_new( void );
 
 bool blk_deferred_request_already_added( blk_deferred_request_t* dio_req, blk_descr_array_index_t block_index );
+sector_t blk_deferred_request_position( blk_deferred_request_t* dio_req, blk_descr_array_index_t block_index );
+void blk_deferred_request_zero_block( blk_deferred_request_t* dio_req, blk_descr_array_index_t block_index );
 
 int  blk_deferred_request_add( blk_deferred_request_t* dio_req, blk_deferred_t* dio );
 void blk_deferred_request_free( blk_deferred_request_t* dio_req );
@@ -71,14 +112,21 @@ void blk_deferred_request_deadlocked( blk_deferred_request_t* dio_req );
 
 void blk_deferred_request_waiting_skip( blk_deferred_request_t* dio_req );
 int blk_deferred_request_wait( blk_deferred_request_t* dio_req );
+int blk_deferred_request_wait_part( blk_deferred_request_t* dio_req, sector_t sect_cnt );
+
+void blk_deferred_request_preserve( blk_deferred_request_t* dio_req, blk_descr_array_t* store_block_map );
+void blk_deferred_request_preserve_part( blk_deferred_request_t* dio_req, sector_t sect_cnt, blk_descr_array_t* store_block_map );
 
 int blk_deferred_bioset_create( void );
 void blk_deferred_bioset_free( void );
 
+int blk_deferred_request_read_original_submit( struct block_device*  original_blk_dev, blk_deferred_request_t* dio_copy_req );
 int blk_deferred_request_read_original( struct block_device*  original_blk_dev, blk_deferred_request_t* dio_copy_req );
 
+int blk_deferred_request_store_file_submit( struct block_device*  blk_dev, blk_deferred_request_t* dio_copy_req );
 int blk_deferred_request_store_file( struct block_device*  blk_dev, blk_deferred_request_t* dio_copy_req );
 #ifdef SNAPSTORE_MULTIDEV
+int blk_deferred_request_store_multidev_submit( blk_deferred_request_t* dio_copy_req );
 int blk_deferred_request_store_multidev( blk_deferred_request_t* dio_copy_req );
 #endif
 int blk_deffered_request_store_mem( blk_deferred_request_t* dio_copy_req );
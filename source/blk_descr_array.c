@@ -8,7 +8,7 @@
 int blk_descr_array_init( blk_descr_array_t* header, blk_descr_array_index_t first, blk_descr_array_index_t last )
 {
     size_t page_count = 0;
-    init_rwsem( &header->rw_lock );
+    mutex_init( &header->locker );
 
     header->first = first;
     header->last = last;
@@ -62,7 +62,7 @@ int blk_descr_array_set( blk_descr_array_t* header, blk_descr_array_index_t inx,
 {
     int res = SUCCESS;
 
-    down_write( &header->rw_lock );
+    mutex_lock( &header->locker );
     do{
         size_t gr_idx;
         size_t val_idx;
@@ -86,6 +86,7 @@ int blk_descr_array_set( blk_descr_array_t* header, blk_descr_array_index_t inx,
                 res = -ENOMEM;
                 break;
             }
+            smp_wmb( ); // the group is read without lock
             if (SUCCESS != page_array_ptr_set(header->groups, gr_idx, group)){
                 res = -EINVAL;
                 break;
@@ -94,27 +95,26 @@ int blk_descr_array_set( blk_descr_array_t* header, blk_descr_array_index_t inx,
         val_idx = (size_t)((inx - header->first) & BLK_DESCR_GROUP_LENGTH_MASK);
 
         bits = (1 << (val_idx & 0x7));
+        WRITE_ONCE( group->values[val_idx], value );
         if (group->bitmap[val_idx >> 3] & bits){
             // rewrite
         }
         else{
-            group->bitmap[val_idx >> 3] |= bits;
+            smp_wmb( ); // the value is published before the bit
+            WRITE_ONCE( group->bitmap[val_idx >> 3], group->bitmap[val_idx >> 3] | bits );
             ++group->cnt;
         }
-        group->values[val_idx] = value;
-
-
     } while (false);
-    up_write( &header->rw_lock );
+    mutex_unlock( &header->locker );
 
     return res;
 }
 
+// Groups and values are never released until the array is reset, so the lookup takes no lock
 int blk_descr_array_get( blk_descr_array_t* header, blk_descr_array_index_t inx, blk_descr_array_el_t* p_value )
 {
     int res = SUCCESS;
 
-    down_read(&header->rw_lock);
     do{
         size_t gr_idx;
         size_t val_idx;
@@ -139,15 +139,55 @@ int blk_descr_array_get( blk_descr_array_t* header, blk_descr_array_index_t inx,
 
         val_idx = (size_t)((inx - header->first) & BLK_DESCR_GROUP_LENGTH_MASK);
         bits = (1 << (val_idx & 0x7));
-        if (group->bitmap[val_idx >> 3] & bits)
-            *p_value = group->values[val_idx];
+        if (READ_ONCE( group->bitmap[val_idx >> 3] ) & bits){
+            smp_rmb( );
+            *p_value = READ_ONCE( group->values[val_idx] );
+        }
         else{
             res = -ENODATA;
             break;
         }
     } while (false);
-    up_read(&header->rw_lock);
 
     return res;
 }
 
+static inline blk_descr_array_group_t* _blk_descr_array_group_nolock( blk_descr_array_t* header, blk_descr_array_index_t inx )
+{
+    blk_descr_array_group_t* group = NULL;
+
+    if ((inx < header->first) || (header->last < inx))
+        return NULL;
+
+    // groups are not released until the array is reset, so the pointer can be read without lock
+    if (SUCCESS != page_array_ptr_get( header->groups, (size_t)((inx - header->first) >> BLK_DESCR_GROUP_LENGTH_SHIFT), (void**)&group ))
+        return NULL;
+
+    return group;
+}
+
+void blk_descr_array_set_preserved( blk_descr_array_t* header, blk_descr_array_index_t inx )
+{
+    blk_descr_array_group_t* group = _blk_descr_array_group_nolock( header, inx );
+
+    if (group == NULL){
+        log_err_sz( "Unable to mark block as preserved: block description is absent for block #", inx );
+        return;
+    }
+    smp_mb__before_atomic( ); // the block data and its description are visible before the bit
+    set_bit( (int)((inx - header->first) & BLK_DESCR_GROUP_LENGTH_MASK), group->preserved );
+}
+
+bool blk_descr_array_is_preserved( blk_descr_array_t* header, blk_descr_array_index_t inx )
+{
+    blk_descr_array_group_t* group = _blk_descr_array_group_nolock( header, inx );
+
+    if (group == NULL)
+        return false;
+
+    if (!test_bit( (int)((inx - header->first) & BLK_DESCR_GROUP_LENGTH_MASK), group->preserved ))
+        return false;
+
+    smp_rmb( );
+    return true;
+}
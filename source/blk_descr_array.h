@@ -14,6 +14,7 @@ typedef struct blk_descr_array_group_s
 {
     size_t cnt;
     unsigned char bitmap[BLK_DESCR_GROUP_LENGTH >> 3];
+    unsigned long preserved[BLK_DESCR_GROUP_LENGTH / BITS_PER_LONG]; // the block data is stored, accessed without lock
     blk_descr_array_el_t values[BLK_DESCR_GROUP_LENGTH];
 }blk_descr_array_group_t;
 
@@ -24,7 +25,7 @@ typedef struct blk_descr_array_s
     page_array_t* groups;
     size_t group_count;
 
-    struct rw_semaphore rw_lock;
+    struct mutex locker; // serializes the insertion only, the lookup is lock-free
 }blk_descr_array_t;
 
 int blk_descr_array_init( blk_descr_array_t* header, blk_descr_array_index_t first, blk_descr_array_index_t last );
@@ -36,3 +37,6 @@ void blk_descr_array_reset( blk_descr_array_t* header );
 int blk_descr_array_set( blk_descr_array_t* header, blk_descr_array_index_t inx, blk_descr_array_el_t value );
 
 int blk_descr_array_get( blk_descr_array_t* header, blk_descr_array_index_t inx, blk_descr_array_el_t* p_value );
+
+void blk_descr_array_set_preserved( blk_descr_array_t* header, blk_descr_array_index_t inx );
+bool blk_descr_array_is_preserved( blk_descr_array_t* header, blk_descr_array_index_t inx );
@@ -96,42 +96,11 @@ struct bio* _blk_dev_redirect_bio_alloc( int nr_iovecs, void* bi_private )
     return new_bio;
 }
 
-blk_redirect_bio_endio_list_t* _bio_endio_alloc_list( struct bio* new_bio )
+// The created bios are linked through bi_next, so no memory is allocated to track them
+static inline void _bio_endio_list_push( blk_redirect_bio_endio_t* rq_endio, struct bio* new_bio )
 {
-    blk_redirect_bio_endio_list_t* next = dbg_kzalloc( sizeof( blk_redirect_bio_endio_list_t ), GFP_NOIO );
-    if (next){
-        next->next = NULL;
-        next->this = new_bio;
-    }
-    return next;
-}
-
-int  bio_endio_list_push( blk_redirect_bio_endio_t* rq_endio, struct bio* new_bio )
-{
-    blk_redirect_bio_endio_list_t* head;
-
-    if (rq_endio->bio_endio_head_rec == NULL){
-        if (NULL == (rq_endio->bio_endio_head_rec = _bio_endio_alloc_list( new_bio )))
-            return -ENOMEM;
-        return SUCCESS;
-    }
-
-    head = rq_endio->bio_endio_head_rec;
-    while (head->next != NULL)
-        head = head->next;
-
-    if (NULL == (head->next = _bio_endio_alloc_list( new_bio )))
-        return -ENOMEM;
-    return SUCCESS;
-}
-
-void bio_endio_list_cleanup( blk_redirect_bio_endio_list_t* curr )
-{
-    while (curr != NULL){
-        blk_redirect_bio_endio_list_t* next = curr->next;
-        dbg_kfree( curr );
-        curr = next;
-    }
+    bio_list_add( &rq_endio->bio_endio_list, new_bio );
+    atomic64_inc( &rq_endio->bio_endio_count );
 }
 
 int _blk_dev_redirect_part_read_fast( blk_redirect_bio_endio_t* rq_endio, int direction, struct block_device*  blk_dev, sector_t target_pos, sector_t rq_ofs, sector_t rq_count )
@@ -155,7 +124,7 @@ int _blk_dev_redirect_part_read_fast( blk_redirect_bio_endio_t* rq_endio, int di
     sector_t processed_sectors = 0;
     int nr_iovecs;
     unsigned int max_sect;
-    blk_redirect_bio_endio_list_t* bio_endio_rec;
+    struct bio* bio;
 
     {
         struct request_queue *q = bdev_get_queue( blk_dev );
@@ -234,13 +203,7 @@ __reprocess_bv:
                 goto __fail_out;
             }
 
-            res = bio_endio_list_push( rq_endio, new_bio );
-            if (res != SUCCESS){
-                log_tr( "Failed to add bio into bio_endio_list" );
-                goto __fail_out;
-            }
-
-            atomic64_inc( &rq_endio->bio_endio_count );
+            _bio_endio_list_push( rq_endio, new_bio );
             new_bio = NULL;
 
             goto __reprocess_bv;
@@ -251,30 +214,21 @@ __reprocess_bv:
     }
 
     if (new_bio != NULL){
-        res = bio_endio_list_push( rq_endio, new_bio );
-        if (res != SUCCESS){
-            log_tr( "Failed to add bio into bio_endio_list" );
-            goto __fail_out;
-        }
-
-        atomic64_inc( &rq_endio->bio_endio_count );
+        _bio_endio_list_push( rq_endio, new_bio );
         new_bio = NULL;
     }
 
     return SUCCESS;
 
 __fail_out:
-    bio_endio_rec = rq_endio->bio_endio_head_rec;
-    while (bio_endio_rec != NULL){
+    if (new_bio != NULL)
+        bio_put( new_bio );
 
-        if (bio_endio_rec->this != NULL)
-            bio_put( bio_endio_rec->this );
-
-        bio_endio_rec = bio_endio_rec->next;
+    while (NULL != (bio = bio_list_pop( &rq_endio->bio_endio_list ))){
+        atomic64_dec( &rq_endio->bio_endio_count );
+        bio_put( bio );
     }
 
-    bio_endio_list_cleanup( bio_endio_rec );
-
     log_err_format( "Failed to process part of redirect IO request. rq_ofs=%lld, rq_count=%lld", rq_ofs, rq_count );
     return res;
 }
@@ -401,24 +355,27 @@ int blk_dev_redirect_part( blk_redirect_bio_endio_t* rq_endio, int direction, st
 }
 
 
+// The request may be completed and freed by the last submitted bio,
+// so the bios list is detached and rq_endio is not used after the first submit.
 void blk_dev_redirect_submit( blk_redirect_bio_endio_t* rq_endio )
 {
-    blk_redirect_bio_endio_list_t* head;
-    blk_redirect_bio_endio_list_t* curr;
+    struct bio* bio;
+    struct bio_list bio_list;
+#ifndef REQ_OP_BITS //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+    int direction = bio_data_dir( rq_endio->bio );
+#endif
 
-    head = curr = rq_endio->bio_endio_head_rec;
-    rq_endio->bio_endio_head_rec = NULL;
+    bio_list_init( &bio_list );
+    bio_list_merge( &bio_list, &rq_endio->bio_endio_list );
+    bio_list_init( &rq_endio->bio_endio_list );
 
-    while (curr != NULL){
+    while (NULL != (bio = bio_list_pop( &bio_list ))){
 #ifndef REQ_OP_BITS //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
-        submit_bio( bio_data_dir( rq_endio->bio ), curr->this );
+        submit_bio( direction, bio );
 #else
-        submit_bio( curr->this );
+        submit_bio( bio );
 #endif
-        curr = curr->next;
     }
-
-    bio_endio_list_cleanup( head );
 }
 
 
@@ -533,6 +490,39 @@ int blk_dev_redirect_zeroed_part( blk_redirect_bio_endio_t* rq_endio, sector_t r
 }
 
 
+// The bio is not submitted, it is the destination of the redirected read into the module buffer.
+// The device limits the pages count on the old kernels, so the bio may be shorter than requested.
+struct bio* blk_redirect_page_array_bio( struct block_device* blk_dev, sector_t ofs, page_array_t* pages, sector_t cnt )
+{
+    struct bio* bio;
+    size_t pg_cnt = page_count_calc( sector_to_size( cnt ) );
+    size_t inx;
+
+    bio = bio_alloc( GFP_NOIO, pg_cnt );
+    if (bio == NULL)
+        return NULL;
+
+#ifdef bio_set_dev
+    bio_set_dev( bio, blk_dev );
+#else
+    bio->bi_bdev = blk_dev;
+#endif
+    bio_bi_sector( bio ) = ofs;
+
+    for (inx = 0; inx < pg_cnt; ++inx){
+        unsigned int len = min_t( unsigned int, PAGE_SIZE, sector_to_size( cnt ) - inx * PAGE_SIZE );
+
+        if (0 == bio_add_page( bio, pages->pg[inx].page, len, 0 ))
+            break;
+    }
+    if (bio_bi_size( bio ) == 0){
+        bio_put( bio );
+        return NULL;
+    }
+    return bio;
+}
+
+
 #ifdef SNAPDATA_ZEROED
 
 int blk_dev_redirect_read_zeroed( blk_redirect_bio_endio_t* rq_endio, struct block_device*  blk_dev, sector_t rq_pos, sector_t blk_ofs_start, sector_t blk_ofs_count, rangevector_t* zero_sectors )
@@ -607,10 +597,15 @@ int blk_dev_redirect_read_zeroed( blk_redirect_bio_endio_t* rq_endio, struct blo
     return res;
 }
 
+// The request is freed before the callback, so the owner of the requests queue may be freed right after the completion.
 void blk_redirect_complete( blk_redirect_bio_endio_t* rq_endio, int res )
 {
-    rq_endio->complete_cb( rq_endio->complete_param, rq_endio->bio, res );
+    redirect_bio_endio_complete_cb* complete_cb = rq_endio->complete_cb;
+    void* complete_param = rq_endio->complete_param;
+    struct bio* bio = rq_endio->bio;
+
     queue_content_sl_free( &rq_endio->content );
+    complete_cb( complete_param, bio, res );
 }
 
 #endif //SNAPDATA_ZEROED
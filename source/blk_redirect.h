@@ -1,6 +1,7 @@
 #pragma once
 #include "queue_spinlocking.h"
 #include "rangevector.h"
+#include "page_array.h"
 #include "blk_descr_unify.h"
 
 int  blk_redirect_bioset_create( void );
@@ -13,11 +14,6 @@ void blk_redirect_bio_endio( struct bio *bb, int err );
 void blk_redirect_bio_endio( struct bio *bb );
 #endif
 
-typedef struct blk_redirect_bio_endio_list_s{
-    struct blk_redirect_bio_endio_list_s* next;
-    struct bio* this;
-}blk_redirect_bio_endio_list_t;
-
 typedef void (redirect_bio_endio_complete_cb)( void* complete_param, struct bio* rq, int err );
 
 typedef struct redirect_bio_endio_s{
@@ -25,7 +21,7 @@ typedef struct redirect_bio_endio_s{
 
     struct bio *bio;
     int err;
-    blk_redirect_bio_endio_list_t* bio_endio_head_rec; //list of created bios
+    struct bio_list bio_endio_list; //created bios, linked by bi_next
     atomic64_t bio_endio_count;
 
     void* complete_param;
@@ -44,3 +40,5 @@ int blk_dev_redirect_read_zeroed( blk_redirect_bio_endio_t* rq_endio, struct blo
 #endif
 
 void blk_redirect_complete( blk_redirect_bio_endio_t* rq_endio, int res );
+
+struct bio* blk_redirect_page_array_bio( struct block_device* blk_dev, sector_t ofs, page_array_t* pages, sector_t cnt );
@@ -139,3 +139,14 @@ struct super_block* blk_thaw_bdev( dev_t dev_id, struct block_device* device, st
     }
     return superblock;
 }
+
+int blk_dev_flush( struct block_device* blk_dev )
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 5, 8, 0 )
+    return blkdev_issue_flush( blk_dev, GFP_KERNEL, NULL );
+#elif LINUX_VERSION_CODE < KERNEL_VERSION( 5, 12, 0 )
+    return blkdev_issue_flush( blk_dev, GFP_KERNEL );
+#else
+    return blkdev_issue_flush( blk_dev );
+#endif
+}
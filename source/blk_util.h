@@ -27,6 +27,8 @@ int _blk_dev_get_info( struct block_device* blk_dev, blk_dev_info_t* pdev_info )
 int blk_freeze_bdev( dev_t dev_id, struct block_device* device, struct super_block** psuperblock );
 struct super_block* blk_thaw_bdev( dev_t dev_id, struct block_device* device, struct super_block* superblock );
 
+int blk_dev_flush( struct block_device* blk_dev );
+
 static __inline sector_t blk_dev_get_capacity( struct block_device* blk_dev )
 {
     return blk_dev->bd_part->nr_sects;
@@ -85,6 +87,34 @@ static __inline void blk_bio_end( struct bio *bio, int err )
 #endif
 
 
+// discard and write-zeroes change the data of the device, but have no data pages
+static inline bool blk_bio_is_discard( struct bio* bio )
+{
+#ifndef REQ_OP_BITS //#if LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+    return (bio->bi_rw & REQ_DISCARD) ? true : false;
+#else
+    switch (bio_op( bio )){
+    case REQ_OP_DISCARD:
+    case REQ_OP_SECURE_ERASE:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+    case REQ_OP_WRITE_ZEROES:
+#endif
+        return true;
+    default:
+        return false;
+    }
+#endif
+}
+
+// the bio changes the data of the device, so it needs copy-on-write and is tracked by CBT
+static inline bool blk_bio_is_write( struct bio* bio )
+{
+    if (bio_data_dir( bio ) && bio_has_data( bio ))
+        return true;
+
+    return blk_bio_is_discard( bio ) && (bio_bi_size( bio ) != 0);
+}
+
 static inline
 sector_t blk_bio_io_vec_sectors( struct bio* bio )
 {
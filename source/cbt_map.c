@@ -1,32 +1,225 @@
 #include "stdafx.h"
 #include "cbt_map.h"
 
+#include <linux/mm.h>
+
 #define SECTION "cbt_map   "
 #include "log_format.h"
 
-static inline void _cbt_map_init_lock( cbt_map_t* cbt_map )
+static inline page_array_t* _get_writable( cbt_map_t* cbt_map )
 {
-    spin_lock_init( &cbt_map->locker );
+    return cbt_map->write_map;
 }
 
-static inline void _cbt_map_lock( cbt_map_t* cbt_map )
+static inline page_array_t* _get_readable( cbt_map_t* cbt_map )
 {
-    spin_lock( &cbt_map->locker );
+    return cbt_map->read_map;
 }
 
-static inline void _cbt_map_unlock( cbt_map_t* cbt_map )
+// degree of the entries count in the page of the map
+static inline unsigned int _cbt_map_page_shift( cbt_map_t* cbt_map )
 {
-    spin_unlock( &cbt_map->locker );
+    return PAGE_SHIFT - cbt_map->entry_shift;
 }
 
-static inline page_array_t* _get_writable( cbt_map_t* cbt_map )
+// degree of the blocks count in the page of the discard map
+#define CBT_DISCARD_PAGE_SHIFT (PAGE_SHIFT + 3)
+
+static inline unsigned long* _cbt_bitmap_word( page_array_t* bitmap, size_t bit_inx )
 {
-    return cbt_map->write_map;
+    return (unsigned long*)page_get_element( bitmap, bit_inx / BITS_PER_LONG, sizeof( unsigned long ) );
 }
 
-static inline page_array_t* _get_readable( cbt_map_t* cbt_map )
+static inline bool _cbt_bitmap_test( page_array_t* bitmap, size_t bit_inx )
 {
-    return cbt_map->read_map;
+    return test_bit( (int)(bit_inx % BITS_PER_LONG), _cbt_bitmap_word( bitmap, bit_inx ) );
+}
+
+static inline void _cbt_bitmap_mark( page_array_t* bitmap, size_t bit_inx )
+{
+    //the bit is usually set already, so the cache line is not dirtied
+    if (!_cbt_bitmap_test( bitmap, bit_inx ))
+        set_bit( (int)(bit_inx % BITS_PER_LONG), _cbt_bitmap_word( bitmap, bit_inx ) );
+}
+
+static inline void _cbt_summary_mark( cbt_summary_t* summary, size_t cbt_block )
+{
+    _cbt_bitmap_mark( summary->level1, cbt_block >> CBT_SUMMARY_SHIFT );
+    _cbt_bitmap_mark( summary->level2, cbt_block >> (CBT_SUMMARY_SHIFT + summary->level2_shift) );
+}
+
+static int _cbt_summary_alloc( cbt_summary_t* summary, size_t map_page_cnt, unsigned int page_shift )
+{
+    size_t level1_bits = DIV_ROUND_UP( map_page_cnt << page_shift, 1 << CBT_SUMMARY_SHIFT );
+    size_t level2_bits;
+
+    // the second level bit should not cover more than one page of the map
+    summary->level2_shift = min_t( unsigned int, CBT_SUMMARY_SHIFT, page_shift - CBT_SUMMARY_SHIFT );
+    level2_bits = DIV_ROUND_UP( level1_bits, 1 << summary->level2_shift );
+
+    summary->level1 = page_array_alloc( page_count_calc( BITS_TO_LONGS( level1_bits ) * sizeof( unsigned long ) ), GFP_KERNEL );
+    if (summary->level1 == NULL)
+        return -ENOMEM;
+    page_array_memset( summary->level1, 0 );
+
+    summary->level2 = page_array_alloc( page_count_calc( BITS_TO_LONGS( level2_bits ) * sizeof( unsigned long ) ), GFP_KERNEL );
+    if (summary->level2 == NULL)
+        return -ENOMEM;
+    page_array_memset( summary->level2, 0 );
+
+    return SUCCESS;
+}
+
+static void _cbt_summary_free( cbt_summary_t* summary )
+{
+    if (summary->level1 != NULL){
+        page_array_free( summary->level1 );
+        summary->level1 = NULL;
+    }
+    if (summary->level2 != NULL){
+        page_array_free( summary->level2 );
+        summary->level2 = NULL;
+    }
+}
+
+static inline void _cbt_summary_bits_sync( page_array_t* dst, page_array_t* src, size_t bit_first, size_t bit_last )
+{
+    size_t inx;
+
+    for (inx = bit_first; inx < bit_last; ++inx){
+        if (src && _cbt_bitmap_test( src, inx ))
+            set_bit( (int)(inx % BITS_PER_LONG), _cbt_bitmap_word( dst, inx ) );
+        else
+            clear_bit( (int)(inx % BITS_PER_LONG), _cbt_bitmap_word( dst, inx ) );
+    }
+}
+
+// the summary of the map page is replaced, nobody changes the page at this time
+static void _cbt_summary_page_sync( cbt_summary_t* dst, cbt_summary_t* src, size_t page_inx, unsigned int page_shift )
+{
+    size_t level1_first = (page_inx << page_shift) >> CBT_SUMMARY_SHIFT;
+    size_t level1_last = ((page_inx + 1) << page_shift) >> CBT_SUMMARY_SHIFT;
+    size_t level2_first = level1_first >> dst->level2_shift;
+    size_t level2_last = level1_last >> dst->level2_shift;
+
+    if ((page_shift - CBT_SUMMARY_SHIFT) >= ilog2( BITS_PER_LONG )){
+        size_t inx;
+
+        // a page covers the whole words of the first level
+        for (inx = level1_first; inx < level1_last; inx += BITS_PER_LONG)
+            *_cbt_bitmap_word( dst->level1, inx ) = src ? *_cbt_bitmap_word( src->level1, inx ) : 0;
+    }
+    else // the pages of the wide entries share the words of the first level
+        _cbt_summary_bits_sync( dst->level1, src ? src->level1 : NULL, level1_first, level1_last );
+
+    // and the bits of the second level share the words with other pages
+    _cbt_summary_bits_sync( dst->level2, src ? src->level2 : NULL, level2_first, level2_last );
+}
+
+static bool _cbt_summary_page_is_dirty( cbt_summary_t* summary, size_t page_inx, unsigned int page_shift )
+{
+    size_t inx;
+    size_t level2_first = (page_inx << page_shift) >> (CBT_SUMMARY_SHIFT + summary->level2_shift);
+    size_t level2_last = ((page_inx + 1) << page_shift) >> (CBT_SUMMARY_SHIFT + summary->level2_shift);
+
+    for (inx = level2_first; inx < level2_last; ++inx)
+        if (_cbt_bitmap_test( summary->level2, inx ))
+            return true;
+    return false;
+}
+
+static inline u32* _cbt_map_page_generation( cbt_map_t* cbt_map, size_t page_inx )
+{
+    return (u32*)page_get_element( cbt_map->page_generation, page_inx, sizeof( u32 ) );
+}
+
+static inline bool _cbt_map_page_is_synced( cbt_map_t* cbt_map, size_t page_inx )
+{
+    if (*(volatile u32*)_cbt_map_page_generation( cbt_map, page_inx ) != cbt_map->generation)
+        return false;
+
+    smp_rmb( ); //the page content is synced before the generation is set
+    return true;
+}
+
+// Make the page of the write map actual after the switch: it should contain
+// the same as the read map, or zeros if the map was reset.
+static void _cbt_map_page_sync( cbt_map_t* cbt_map, size_t page_inx )
+{
+    if (_cbt_map_page_is_synced( cbt_map, page_inx ))
+        return;
+
+    spin_lock( &cbt_map->sync_locker );
+    if (!_cbt_map_page_is_synced( cbt_map, page_inx )){
+        void* dst = _get_writable( cbt_map )->pg[page_inx].addr;
+        // only the dirty pages need to be cleared or copied
+        unsigned int page_shift = _cbt_map_page_shift( cbt_map );
+        bool dst_dirty = _cbt_summary_page_is_dirty( &cbt_map->write_summary, page_inx, page_shift );
+
+        if (cbt_map->sync_reset){
+            if (dst_dirty)
+                memset( dst, 0, PAGE_SIZE );
+            _cbt_summary_page_sync( &cbt_map->write_summary, NULL, page_inx, page_shift );
+        }
+        else{
+            if (dst_dirty || _cbt_summary_page_is_dirty( &cbt_map->read_summary, page_inx, page_shift ))
+                memcpy( dst, _get_readable( cbt_map )->pg[page_inx].addr, PAGE_SIZE );
+            _cbt_summary_page_sync( &cbt_map->write_summary, &cbt_map->read_summary, page_inx, page_shift );
+        }
+
+        smp_wmb( );
+        *(volatile u32*)_cbt_map_page_generation( cbt_map, page_inx ) = cbt_map->generation;
+    }
+    spin_unlock( &cbt_map->sync_locker );
+}
+
+static inline u32* _cbt_map_discard_generation( cbt_map_t* cbt_map, size_t page_inx )
+{
+    return (u32*)page_get_element( cbt_map->discard_generation, page_inx, sizeof( u32 ) );
+}
+
+// Make the page of the discard_write actual after the switch, as the page of the write map.
+static void _cbt_map_discard_page_sync( cbt_map_t* cbt_map, size_t page_inx )
+{
+    if (*(volatile u32*)_cbt_map_discard_generation( cbt_map, page_inx ) == cbt_map->generation){
+        smp_rmb( );
+        return;
+    }
+
+    spin_lock( &cbt_map->sync_locker );
+    if (*(volatile u32*)_cbt_map_discard_generation( cbt_map, page_inx ) != cbt_map->generation){
+        void* dst = cbt_map->discard_write->pg[page_inx].addr;
+
+        if (cbt_map->sync_reset)
+            memset( dst, 0, PAGE_SIZE );
+        else
+            memcpy( dst, cbt_map->discard_read->pg[page_inx].addr, PAGE_SIZE );
+
+        smp_wmb( );
+        *(volatile u32*)_cbt_map_discard_generation( cbt_map, page_inx ) = cbt_map->generation;
+    }
+    spin_unlock( &cbt_map->sync_locker );
+}
+
+static void _cbt_map_sync( cbt_map_t* cbt_map )
+{
+    size_t page_inx;
+    u32 generation = cbt_map->generation;
+
+    if (cbt_map->synced_generation == generation)
+        return;
+
+    for (page_inx = 0; page_inx < _get_writable( cbt_map )->pg_cnt; ++page_inx){
+        _cbt_map_page_sync( cbt_map, page_inx );
+        cond_resched( );
+    }
+    if (cbt_map->discard_write != NULL){
+        for (page_inx = 0; page_inx < cbt_map->discard_write->pg_cnt; ++page_inx){
+            _cbt_map_discard_page_sync( cbt_map, page_inx );
+            cond_resched( );
+        }
+    }
+    cbt_map->synced_generation = generation;
 }
 
 void cbt_map_destroy( cbt_map_t* cbt_map );
@@ -37,11 +230,12 @@ void cbt_map_destroy_cb( void* this_resource )
     cbt_map_destroy( cbt_map );
 }
 
-int cbt_map_allocate( cbt_map_t* cbt_map, unsigned int cbt_sect_in_block_degree, sector_t blk_dev_sect_count )
+int cbt_map_allocate( cbt_map_t* cbt_map, unsigned int cbt_sect_in_block_degree, sector_t blk_dev_sect_count, unsigned int entry_size )
 {
     size_t page_cnt;
     sector_t size_mod;
     cbt_map->sect_in_block_degree = cbt_sect_in_block_degree;
+    cbt_map->entry_shift = (entry_size == 2) ? 1 : 0;
 
     cbt_map->map_size = (blk_dev_sect_count >> (sector_t)cbt_sect_in_block_degree);
 
@@ -49,10 +243,7 @@ int cbt_map_allocate( cbt_map_t* cbt_map, unsigned int cbt_sect_in_block_degree,
     if (size_mod)
         cbt_map->map_size++;
 
-    
-    page_cnt = cbt_map->map_size >> PAGE_SHIFT;
-    if (cbt_map->map_size & (PAGE_SIZE - 1))
-        ++page_cnt;
+    page_cnt = page_count_calc( cbt_map_size_in_bytes( cbt_map ) );
 
     cbt_map->read_map = page_array_alloc( page_cnt, GFP_KERNEL );
     if (cbt_map->read_map != NULL)
@@ -61,12 +252,40 @@ int cbt_map_allocate( cbt_map_t* cbt_map, unsigned int cbt_sect_in_block_degree,
     cbt_map->write_map = page_array_alloc( page_cnt, GFP_KERNEL );
     if (cbt_map->write_map != NULL)
         page_array_memset( cbt_map->write_map, 0 );
-    
-    if ((cbt_map->read_map == NULL) || (cbt_map->write_map == NULL)){
+
+    if ((SUCCESS != _cbt_summary_alloc( &cbt_map->read_summary, page_cnt, _cbt_map_page_shift( cbt_map ) )) ||
+        (SUCCESS != _cbt_summary_alloc( &cbt_map->write_summary, page_cnt, _cbt_map_page_shift( cbt_map ) ))){
+        log_err( "Cannot allocate CBT map summary" );
+        return -ENOMEM;
+    }
+
+    cbt_map->page_generation = page_array_alloc( page_count_calc( page_cnt * sizeof( u32 ) ), GFP_KERNEL );
+    if (cbt_map->page_generation != NULL)
+        page_array_memset( cbt_map->page_generation, 0 );
+    cbt_map->generation = 0;
+    cbt_map->synced_generation = 0;
+    cbt_map->sync_reset = false;
+
+    if ((cbt_map->read_map == NULL) || (cbt_map->write_map == NULL) || (cbt_map->page_generation == NULL)){
         log_err_sz( "Cannot allocate CBT map. map_size=", cbt_map->map_size );
         return -ENOMEM;
     }
 
+    if (get_cbt_discard_zero( )){
+        size_t discard_page_cnt = page_count_calc( BITS_TO_LONGS( cbt_map->map_size ) * sizeof( unsigned long ) );
+
+        cbt_map->discard_write = page_array_alloc( discard_page_cnt, GFP_KERNEL );
+        cbt_map->discard_read = page_array_alloc( discard_page_cnt, GFP_KERNEL );
+        cbt_map->discard_generation = page_array_alloc( page_count_calc( discard_page_cnt * sizeof( u32 ) ), GFP_KERNEL );
+        if ((cbt_map->discard_write == NULL) || (cbt_map->discard_read == NULL) || (cbt_map->discard_generation == NULL)){
+            log_err( "Cannot allocate CBT discard map" );
+            return -ENOMEM;
+        }
+        page_array_memset( cbt_map->discard_write, 0 );
+        page_array_memset( cbt_map->discard_read, 0 );
+        page_array_memset( cbt_map->discard_generation, 0 );
+    }
+
     cbt_map->snap_number_previous = 0;
     cbt_map->snap_number_active = 1;
     veeam_generate_random_uuid( cbt_map->generationId.b );
@@ -87,22 +306,47 @@ void cbt_map_deallocate( cbt_map_t* cbt_map )
         cbt_map->write_map = NULL;
     }
 
+    if (cbt_map->page_generation != NULL){
+        page_array_free( cbt_map->page_generation );
+        cbt_map->page_generation = NULL;
+    }
+
+    _cbt_summary_free( &cbt_map->read_summary );
+    _cbt_summary_free( &cbt_map->write_summary );
+
+    if (cbt_map->discard_write != NULL){
+        page_array_free( cbt_map->discard_write );
+        cbt_map->discard_write = NULL;
+    }
+    if (cbt_map->discard_read != NULL){
+        page_array_free( cbt_map->discard_read );
+        cbt_map->discard_read = NULL;
+    }
+    if (cbt_map->discard_generation != NULL){
+        page_array_free( cbt_map->discard_generation );
+        cbt_map->discard_generation = NULL;
+    }
+
+    if (cbt_map->mmap_inode != NULL){
+        iput( cbt_map->mmap_inode );
+        cbt_map->mmap_inode = NULL;
+    }
+
     cbt_map->active = false;
 }
 
-cbt_map_t* cbt_map_create( unsigned int cbt_sect_in_block_degree, sector_t blk_dev_sect_count )
+cbt_map_t* cbt_map_create( unsigned int cbt_sect_in_block_degree, sector_t blk_dev_sect_count, unsigned int entry_size )
 {
     cbt_map_t* cbt_map = NULL;
 
-    log_tr( "CBT map create" );
+    log_tr_d( "CBT map create. Entry size ", entry_size );
 
     cbt_map = (cbt_map_t*)dbg_kzalloc( sizeof( cbt_map_t ), GFP_KERNEL );
     if (cbt_map == NULL)
         return NULL;
 
-    if (SUCCESS == cbt_map_allocate( cbt_map, cbt_sect_in_block_degree, blk_dev_sect_count )){
-        _cbt_map_init_lock( cbt_map );
-
+    if (SUCCESS == cbt_map_allocate( cbt_map, cbt_sect_in_block_degree, blk_dev_sect_count, entry_size )){
+        spin_lock_init( &cbt_map->sync_locker );
         init_rwsem( &cbt_map->rw_lock );
 
         shared_resource_init( &cbt_map->sharing_header, cbt_map, cbt_map_destroy_cb );
@@ -123,93 +367,305 @@ void cbt_map_destroy( cbt_map_t* cbt_map )
     }
 }
 
+// The caller should hold the write lock, so that no one is changing the map.
+// The maps are swapped, and the write map is synced with the read map page by page later,
+// by cbt_map_sync() or by the writer which is the first to touch the page.
 void cbt_map_switch( cbt_map_t* cbt_map )
 {
+    page_array_t* map;
+    cbt_summary_t summary;
+
     log_tr( "CBT map switch" );
-    _cbt_map_lock( cbt_map );
 
-    page_array_memcpy( _get_readable( cbt_map ), _get_writable( cbt_map ) );
+    //normally the previous switch is already synced, so it costs nothing
+    _cbt_map_sync( cbt_map );
+
+    map = cbt_map->read_map;
+    cbt_map->read_map = cbt_map->write_map;
+    cbt_map->write_map = map;
+
+    summary = cbt_map->read_summary;
+    cbt_map->read_summary = cbt_map->write_summary;
+    cbt_map->write_summary = summary;
+
+    cbt_map->sync_reset = false;
+
+    if (cbt_map->discard_write != NULL){
+        map = cbt_map->discard_read;
+        cbt_map->discard_read = cbt_map->discard_write;
+        cbt_map->discard_write = map;
+    }
 
     cbt_map->snap_number_previous = cbt_map->snap_number_active;
     ++cbt_map->snap_number_active;
-    if (256 == cbt_map->snap_number_active){
+    // the snapshot number should fit the entry
+    if ((cbt_map->snap_number_active >> (BITS_PER_BYTE << cbt_map->entry_shift)) != 0){
 
         cbt_map->snap_number_active = 1;
 
-        page_array_memset( _get_writable( cbt_map ), 0 );
+        cbt_map->sync_reset = true;
 
         veeam_generate_random_uuid( cbt_map->generationId.b );
 
         log_tr( "CBT reset" );
     }
-    _cbt_map_unlock( cbt_map );
+
+    ++cbt_map->generation;
+
+    //the user space should not see the old read map, which becomes the write map
+    if (cbt_map->mmap_inode != NULL)
+        unmap_mapping_range( cbt_map->mmap_inode->i_mapping, 0, 0, 1 );
+}
+
+void cbt_map_sync( cbt_map_t* cbt_map )
+{
+    cbt_map_read_lock( cbt_map );
+    _cbt_map_sync( cbt_map );
+    cbt_map_read_unlock( cbt_map );
+}
+
+static void _cbt_summary_rebuild( cbt_map_t* cbt_map, page_array_t* map, cbt_summary_t* summary )
+{
+    size_t word_entries = sizeof( unsigned long ) >> cbt_map->entry_shift;
+    size_t cbt_block;
+
+    page_array_memset( summary->level1, 0 );
+    page_array_memset( summary->level2, 0 );
+
+    for (cbt_block = 0; cbt_block < cbt_map->map_size; cbt_block += word_entries){
+        size_t ofs = cbt_block << cbt_map->entry_shift;
+
+        if (0 != *(unsigned long*)(map->pg[ofs >> PAGE_SHIFT].addr + (ofs & (PAGE_SIZE - 1))))
+            _cbt_summary_mark( summary, cbt_block );
+    }
 }
 
-int _cbt_map_set( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt, byte_t snap_number, page_array_t* map )
+// The write map was loaded from the persistent storage before the tracking is started.
+// The read map and the summaries are restored from it.
+void cbt_map_restore( cbt_map_t* cbt_map, unsigned long snap_number_active, unsigned long snap_number_previous, veeam_uuid_t* generationId )
+{
+    size_t page_inx;
+
+    cbt_map_write_lock( cbt_map );
+
+    for (page_inx = 0; page_inx < _get_writable( cbt_map )->pg_cnt; ++page_inx)
+        memcpy( _get_readable( cbt_map )->pg[page_inx].addr, _get_writable( cbt_map )->pg[page_inx].addr, PAGE_SIZE );
+
+    _cbt_summary_rebuild( cbt_map, _get_writable( cbt_map ), &cbt_map->write_summary );
+    _cbt_summary_rebuild( cbt_map, _get_readable( cbt_map ), &cbt_map->read_summary );
+
+    cbt_map->snap_number_active = snap_number_active;
+    cbt_map->snap_number_previous = snap_number_previous;
+    veeam_uuid_copy( &cbt_map->generationId, generationId );
+
+    cbt_map_write_unlock( cbt_map );
+}
+
+static inline unsigned int _cbt_map_entry_bit_shift( unsigned int entry_inx, unsigned int entry_shift )
+{
+#ifdef __BIG_ENDIAN
+    return ((sizeof( unsigned long ) >> entry_shift) - 1 - entry_inx) * (BITS_PER_BYTE << entry_shift);
+#else
+    return entry_inx * (BITS_PER_BYTE << entry_shift);
+#endif
+}
+
+// Raise the entries [first, last] of the word up to snap_number.
+// Writers can change neighbouring entries of the same word concurrently, so the word is replaced atomically.
+static inline void _cbt_map_word_raise( unsigned long* word, unsigned int first, unsigned int last, unsigned int snap_number, unsigned int entry_shift )
+{
+    unsigned long mask = (1UL << (BITS_PER_BYTE << entry_shift)) - 1;
+    unsigned long old_value = *(volatile unsigned long*)word;
+
+    while (true){
+        unsigned long new_value = old_value;
+        unsigned long prev_value;
+        unsigned int inx;
+
+        for (inx = first; inx <= last; ++inx){
+            unsigned int shift = _cbt_map_entry_bit_shift( inx, entry_shift );
+
+            if (((new_value >> shift) & mask) < snap_number)
+                new_value = (new_value & ~(mask << shift)) | ((unsigned long)snap_number << shift);
+        }
+        if (new_value == old_value)
+            return; //already marked, nothing to write
+
+        prev_value = cmpxchg( word, old_value, new_value );
+        if (prev_value == old_value)
+            return;
+
+        old_value = prev_value;
+    }
+}
+
+// Concurrent writers are allowed, only cbt_map_switch() should be excluded by the caller
+int _cbt_map_set( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt, unsigned int snap_number, page_array_t* map, cbt_summary_t* summary )
 {
     int res = SUCCESS;
+    unsigned int page_shift = _cbt_map_page_shift( cbt_map );
+    size_t word_entries = sizeof( unsigned long ) >> cbt_map->entry_shift;
     size_t cbt_block;
     size_t cbt_block_first = ( size_t )(sector_start >> cbt_map->sect_in_block_degree);
     size_t cbt_block_last = (size_t)((sector_start + sector_cnt -1) >> cbt_map->sect_in_block_degree); //inclusive
 
-    for (cbt_block = cbt_block_first; cbt_block <= cbt_block_last; ++cbt_block){
-        if (cbt_block < cbt_map->map_size){
-            byte_t num;
-            res = page_array_byte_get( map, cbt_block, &num );
-            if (SUCCESS == res){
-                if (num < snap_number){
-                    res = page_array_byte_set( map, cbt_block, snap_number );
-                }
-            }
-        }
-        else
-            res = -EINVAL;
+    if (cbt_block_last >= cbt_map->map_size){
+        log_err_format( "Block index is too large. #%ld was demanded, map size %ld", cbt_block_last, cbt_map->map_size );
+        if (cbt_block_first >= cbt_map->map_size)
+            return -EINVAL;
 
-        if (SUCCESS != res){
-            log_err_format( "Block index is too large. #%ld was demanded, map size %ld", cbt_block, cbt_map->map_size );
-            break;
+        cbt_block_last = cbt_map->map_size - 1;
+        res = -EINVAL;
+    }
+
+    cbt_block = cbt_block_first;
+    while (cbt_block <= cbt_block_last){
+        size_t page_pos = cbt_block & ((1 << page_shift) - 1);
+        size_t word_first = cbt_block & ~(word_entries - 1);
+        size_t word_last = min_t( size_t, word_first + word_entries - 1, cbt_block_last );
+        byte_t* ptr = map->pg[cbt_block >> page_shift].addr;
+
+        if ((page_pos == 0) || (cbt_block == cbt_block_first)){
+            if (map == _get_writable( cbt_map ))
+                _cbt_map_page_sync( cbt_map, cbt_block >> page_shift );
         }
+        if ((cbt_block == cbt_block_first) || (0 == (word_first & ((1 << CBT_SUMMARY_SHIFT) - 1))))
+            _cbt_summary_mark( summary, cbt_block );
+
+        _cbt_map_word_raise( (unsigned long*)(ptr + ((page_pos & ~(word_entries - 1)) << cbt_map->entry_shift)),
+            (unsigned int)(cbt_block - word_first), (unsigned int)(word_last - word_first), snap_number, cbt_map->entry_shift );
+
+        cbt_block = word_last + 1;
     }
     return res;
 }
 
-int cbt_map_set( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt )
+// The block is marked as discarded if it is covered by the discard entirely, the write clears the mark.
+static void _cbt_map_discard_mark( cbt_map_t* cbt_map, page_array_t* discard_map, sector_t sector_start, sector_t sector_cnt, bool discard )
 {
-    int res = SUCCESS;
-    _cbt_map_lock( cbt_map );
-    {
-        byte_t snap_number = (byte_t)cbt_map->snap_number_active;
+    sector_t block_mask = ((sector_t)1 << cbt_map->sect_in_block_degree) - 1;
+    size_t cbt_block;
+    size_t cbt_block_first = (size_t)(sector_start >> cbt_map->sect_in_block_degree);
+    size_t cbt_block_last = (size_t)((sector_start + sector_cnt - 1) >> cbt_map->sect_in_block_degree); //inclusive
+
+    if (cbt_block_last >= cbt_map->map_size)
+        cbt_block_last = cbt_map->map_size - 1;
+
+    for (cbt_block = cbt_block_first; cbt_block <= cbt_block_last; ++cbt_block){
+        bool whole = discard;
 
-        res = _cbt_map_set( cbt_map, sector_start, sector_cnt, snap_number, _get_writable( cbt_map ) );
+        if ((cbt_block == cbt_block_first) && (sector_start & block_mask))
+            whole = false;
+        if ((cbt_block == cbt_block_last) && ((sector_start + sector_cnt) & block_mask))
+            whole = false;
+
+        if ((discard_map == cbt_map->discard_write) &&
+            ((cbt_block == cbt_block_first) || (0 == (cbt_block & ((1 << CBT_DISCARD_PAGE_SHIFT) - 1)))))
+            _cbt_map_discard_page_sync( cbt_map, cbt_block >> CBT_DISCARD_PAGE_SHIFT );
+
+        if (whole)
+            _cbt_bitmap_mark( discard_map, cbt_block );
+        else if (_cbt_bitmap_test( discard_map, cbt_block ))
+            clear_bit( (int)(cbt_block % BITS_PER_LONG), _cbt_bitmap_word( discard_map, cbt_block ) );
     }
-    _cbt_map_unlock( cbt_map );
+}
+
+int cbt_map_set( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt, bool discard )
+{
+    int res;
+    unsigned int snap_number = (unsigned int)cbt_map->snap_number_active;
+
+    res = _cbt_map_set( cbt_map, sector_start, sector_cnt, snap_number, _get_writable( cbt_map ), &cbt_map->write_summary );
+
+    if ((cbt_map->discard_write != NULL) && ((size_t)(sector_start >> cbt_map->sect_in_block_degree) < cbt_map->map_size))
+        _cbt_map_discard_mark( cbt_map, cbt_map->discard_write, sector_start, sector_cnt, discard );
     return res;
 }
 
 int cbt_map_set_both( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt )
 {
     int res = SUCCESS;
-    _cbt_map_lock( cbt_map );
+
+    cbt_map_read_lock( cbt_map );
     {
-        res = _cbt_map_set(cbt_map, sector_start, sector_cnt, (byte_t)cbt_map->snap_number_active, _get_writable(cbt_map));
+        res = _cbt_map_set(cbt_map, sector_start, sector_cnt, (unsigned int)cbt_map->snap_number_active, _get_writable(cbt_map), &cbt_map->write_summary);
         if (res == SUCCESS)
-            res = _cbt_map_set(cbt_map, sector_start, sector_cnt, (byte_t)cbt_map->snap_number_previous, _get_readable(cbt_map));
+            res = _cbt_map_set(cbt_map, sector_start, sector_cnt, (unsigned int)cbt_map->snap_number_previous, _get_readable(cbt_map), &cbt_map->read_summary);
+
+        if ((res == SUCCESS) && (cbt_map->discard_write != NULL)){
+            _cbt_map_discard_mark( cbt_map, cbt_map->discard_write, sector_start, sector_cnt, false );
+            _cbt_map_discard_mark( cbt_map, cbt_map->discard_read, sector_start, sector_cnt, false );
+        }
     }
-    _cbt_map_unlock( cbt_map );
+    cbt_map_read_unlock( cbt_map );
     return res;
 }
 
+static size_t _cbt_bitmap_next( page_array_t* bitmap, size_t bit_inx, size_t bit_last )
+{
+    while (bit_inx < bit_last){
+        unsigned long word = *_cbt_bitmap_word( bitmap, bit_inx ) >> (bit_inx % BITS_PER_LONG);
+
+        if (word)
+            return min_t( size_t, bit_inx + __ffs( word ), bit_last );
+
+        bit_inx = (bit_inx | (BITS_PER_LONG - 1)) + 1;
+    }
+    return bit_last;
+}
+
+// Returns the first block of the read map, that is not less than cbt_block and can be changed,
+// the blocks in between are not changed. Returns map_size if there are no changes anymore.
+size_t cbt_map_next_dirty( cbt_map_t* cbt_map, size_t cbt_block )
+{
+    cbt_summary_t* summary = &cbt_map->read_summary;
+    size_t level1_last = DIV_ROUND_UP( cbt_map->map_size, 1 << CBT_SUMMARY_SHIFT );
+    size_t level2_last = DIV_ROUND_UP( level1_last, 1 << summary->level2_shift );
+    size_t level1 = cbt_block >> CBT_SUMMARY_SHIFT;
+
+    while (level1 < level1_last){
+        size_t level2 = _cbt_bitmap_next( summary->level2, level1 >> summary->level2_shift, level2_last );
+        if (level2 == level2_last)
+            break;
+
+        if ((level2 << summary->level2_shift) > level1)
+            level1 = level2 << summary->level2_shift;
+
+        level1 = _cbt_bitmap_next( summary->level1, level1, min_t( size_t, (level2 + 1) << summary->level2_shift, level1_last ) );
+        if ((level1 < level1_last) && _cbt_bitmap_test( summary->level1, level1 ))
+            return max_t( size_t, cbt_block, level1 << CBT_SUMMARY_SHIFT );
+    }
+    return cbt_map->map_size;
+}
+
 size_t cbt_map_read_to_user( cbt_map_t* cbt_map, void __user* user_buff, size_t offset, size_t size )
 {
     size_t readed = 0;
     do{
-        size_t real_size = min( (cbt_map->map_size - offset), size );
+        size_t real_size = min( (cbt_map_size_in_bytes( cbt_map ) - offset), size );
 
         size_t left_size;
 
         {
             page_array_t* map = _get_readable( cbt_map );
-            left_size = real_size - page_array_page2user( user_buff, offset, map, real_size );
+            size_t processed = 0;
+
+            while (processed < real_size){
+                size_t ofs = offset + processed;
+                size_t len = min_t( size_t, PAGE_SIZE - (ofs & (PAGE_SIZE - 1)), real_size - processed );
+                size_t done;
+
+                //the clean pages of the map are not read
+                if (_cbt_summary_page_is_dirty( &cbt_map->read_summary, ofs >> PAGE_SHIFT, _cbt_map_page_shift( cbt_map ) ))
+                    done = page_array_page2user( user_buff + processed, ofs, map, len );
+                else
+                    done = len - clear_user( user_buff + processed, len );
+
+                processed += done;
+                if (done != len)
+                    break;
+            }
+            left_size = real_size - processed;
         }
 
         if (left_size == 0)
@@ -223,3 +679,211 @@ size_t cbt_map_read_to_user( cbt_map_t* cbt_map, void __user* user_buff, size_t
     return readed;
 }
 
+// Has the word any entry greater than snap_number
+static inline bool _cbt_word_has_greater( unsigned long word, unsigned int snap_number, unsigned int entry_shift )
+{
+    unsigned int entry_bits = BITS_PER_BYTE << entry_shift;
+    unsigned long ones = ~0UL / ((1UL << entry_bits) - 1);   // 0x0101...01 or 0x00010001...
+    unsigned long high = ones << (entry_bits - 1);           // 0x8080...80 or 0x80008000...
+    unsigned long half = (1UL << (entry_bits - 1)) - 1;      // 0x7F or 0x7FFF
+
+    if (snap_number > half){
+        // only the entries with the high bit can be greater, compare the rest of them
+        word &= ((word & high) >> (entry_bits - 1)) * half;
+        snap_number -= half + 1;
+    }
+    return 0 != (((word + ones * (half - snap_number)) | word) & high);
+}
+
+static inline unsigned int _cbt_map_entry( cbt_map_t* cbt_map, page_array_t* map, size_t cbt_block )
+{
+    size_t ofs = cbt_block << cbt_map->entry_shift;
+    void* ptr = map->pg[ofs >> PAGE_SHIFT].addr + (ofs & (PAGE_SIZE - 1));
+
+    if (cbt_map->entry_shift)
+        return *(u16*)ptr;
+    return *(byte_t*)ptr;
+}
+
+// Collects the extents of the read map, which blocks were changed after base_snap_number.
+// The extents are in CBT blocks, *p_cursor is the block to start from and to continue from.
+int cbt_map_read_extents( cbt_map_t* cbt_map, unsigned int base_snap_number, bool discarded, size_t* p_cursor, range_t* extents, unsigned int capacity, unsigned int* p_count )
+{
+    page_array_t* map;
+    size_t word_entries = sizeof( unsigned long ) >> cbt_map->entry_shift;
+    size_t cbt_block = *p_cursor;
+    size_t extent_first = 0;
+    bool in_extent = false;
+    unsigned int count = 0;
+
+    if (capacity == 0)
+        return -EINVAL;
+    if (discarded && (cbt_map->discard_read == NULL))
+        return -EOPNOTSUPP;
+
+    cbt_map_read_lock( cbt_map );
+    map = _get_readable( cbt_map );
+
+    while (cbt_block < cbt_map->map_size){
+        if (!in_extent){
+            size_t next;
+
+            // the regions without any changes are skipped by the summary
+            if (0 == (cbt_block & ((1 << CBT_SUMMARY_SHIFT) - 1))){
+                next = cbt_map_next_dirty( cbt_map, cbt_block );
+                if (next != cbt_block){
+                    cbt_block = next;
+                    continue;
+                }
+            }
+            // and the unchanged words are skipped at once
+            if ((0 == (cbt_block & (word_entries - 1))) && ((cbt_block + word_entries) <= cbt_map->map_size)){
+                size_t ofs = cbt_block << cbt_map->entry_shift;
+                unsigned long word = *(unsigned long*)(map->pg[ofs >> PAGE_SHIFT].addr + (ofs & (PAGE_SIZE - 1)));
+
+                if (!_cbt_word_has_greater( word, base_snap_number, cbt_map->entry_shift )){
+                    cbt_block += word_entries;
+                    continue;
+                }
+            }
+        }
+
+        if ((_cbt_map_entry( cbt_map, map, cbt_block ) > base_snap_number) &&
+            (!discarded || _cbt_bitmap_test( cbt_map->discard_read, cbt_block ))){
+            if (!in_extent){
+                in_extent = true;
+                extent_first = cbt_block;
+            }
+        }
+        else if (in_extent){
+            in_extent = false;
+
+            extents[count].ofs = extent_first;
+            extents[count].cnt = cbt_block - extent_first;
+            if (++count == capacity){
+                ++cbt_block;
+                break;
+            }
+        }
+        ++cbt_block;
+    }
+    if (in_extent){
+        extents[count].ofs = extent_first;
+        extents[count].cnt = cbt_block - extent_first;
+        ++count;
+    }
+
+    cbt_map_read_unlock( cbt_map );
+
+    *p_cursor = cbt_block;
+    *p_count = count;
+    return SUCCESS;
+}
+
+// The mapping of the read map is valid until the next switch, after that it raises SIGBUS.
+typedef struct cbt_map_mmap_s
+{
+    atomic_t refcount;
+    cbt_map_t* cbt_map;
+    u32 generation;
+}cbt_map_mmap_t;
+
+static void _cbt_map_vm_open( struct vm_area_struct* vma )
+{
+    cbt_map_mmap_t* mmap = (cbt_map_mmap_t*)vma->vm_private_data;
+
+    atomic_inc( &mmap->refcount );
+}
+
+static void _cbt_map_vm_close( struct vm_area_struct* vma )
+{
+    cbt_map_mmap_t* mmap = (cbt_map_mmap_t*)vma->vm_private_data;
+
+    if (atomic_dec_and_test( &mmap->refcount )){
+        cbt_map_put_resource( mmap->cbt_map );
+        dbg_kfree( mmap );
+    }
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+static int _cbt_map_vm_fault( struct vm_area_struct* vma, struct vm_fault* vmf )
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0)
+static int _cbt_map_vm_fault( struct vm_fault* vmf )
+#else
+static vm_fault_t _cbt_map_vm_fault( struct vm_fault* vmf )
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+    struct vm_area_struct* vma = vmf->vma;
+#endif
+    cbt_map_mmap_t* mmap = (cbt_map_mmap_t*)vma->vm_private_data;
+    cbt_map_t* cbt_map = mmap->cbt_map;
+    size_t page_inx = vmf->pgoff & ((1UL << CBT_MAP_MMAP_DEV_SHIFT) - 1);
+    int ret = VM_FAULT_SIGBUS;
+
+    cbt_map_read_lock( cbt_map );
+    if ((cbt_map->generation == mmap->generation) && (page_inx < _get_readable( cbt_map )->pg_cnt)){
+        struct page* pg = _get_readable( cbt_map )->pg[page_inx].page;
+
+        get_page( pg );
+        vmf->page = pg;
+        ret = 0;
+    }
+    cbt_map_read_unlock( cbt_map );
+
+    return ret;
+}
+
+static const struct vm_operations_struct cbt_map_vm_ops = {
+    .open = _cbt_map_vm_open,
+    .close = _cbt_map_vm_close,
+    .fault = _cbt_map_vm_fault,
+};
+
+int cbt_map_mmap( cbt_map_t* cbt_map, struct vm_area_struct* vma )
+{
+    int res = SUCCESS;
+    size_t page_first = vma->vm_pgoff & ((1UL << CBT_MAP_MMAP_DEV_SHIFT) - 1);
+    cbt_map_mmap_t* mmap;
+
+    if (vma->vm_flags & VM_WRITE){
+        log_err( "Unable to map CBT map: the map is read only" );
+        return -EPERM;
+    }
+
+    mmap = dbg_kzalloc( sizeof( cbt_map_mmap_t ), GFP_KERNEL );
+    if (mmap == NULL)
+        return -ENOMEM;
+
+    do{
+        if ((page_first + vma_pages( vma )) > _get_readable( cbt_map )->pg_cnt){
+            log_err( "Unable to map CBT map: out of the map" );
+            res = -EINVAL;
+            break;
+        }
+
+        atomic_set( &mmap->refcount, 1 );
+        mmap->cbt_map = cbt_map_get_resource( cbt_map );
+        //the mapping is done out of the switch, else the fault raises SIGBUS
+        mmap->generation = cbt_map->generation;
+
+        //the inode of the ctrl file is kept to drop the mappings
+        spin_lock( &cbt_map->sync_locker );
+        if (cbt_map->mmap_inode == NULL)
+            cbt_map->mmap_inode = igrab( vma->vm_file->f_mapping->host );
+        spin_unlock( &cbt_map->sync_locker );
+
+        vma->vm_flags &= ~VM_MAYWRITE;
+#ifdef VM_DONTDUMP
+        vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+#else
+        vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_RESERVED;
+#endif
+        vma->vm_private_data = mmap;
+        vma->vm_ops = &cbt_map_vm_ops;
+    } while (false);
+
+    if (res != SUCCESS)
+        dbg_kfree( mmap );
+    return res;
+}
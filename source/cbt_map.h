@@ -3,18 +3,41 @@
 #include "page_array.h"
 #include "shared_resource.h"
 #include "uuid_util.h"
+#include "range.h"
+
+#define CBT_SUMMARY_SHIFT 6 // each bit of the summary covers 64 entries of the lower level
+
+#define CBT_ENTRY_SIZE_DEFAULT 1
+
+// The summary of the map: the bit of the first level is set when any of the 64 blocks
+// is changed, the bit of the second level is set when any of the 64 first level bits is set.
+// For the wide entries the second level bit covers fewer bits, not more than a page of the map.
+typedef struct cbt_summary_s
+{
+    page_array_t* level1;
+    page_array_t* level2;
+    unsigned int level2_shift;
+}cbt_summary_t;
 
 typedef struct cbt_map_s
 {
     shared_resource_t sharing_header;
 
-    spinlock_t locker;
-
     size_t   sect_in_block_degree;
-    size_t   map_size;
+    size_t   map_size; // in entries, one per CBT block
+    unsigned int entry_shift; // the entry is a byte or 16-bit word, the snapshot number is wrapped accordingly
 
     page_array_t*  read_map;
     page_array_t*  write_map;
+    cbt_summary_t read_summary;
+    cbt_summary_t write_summary;
+
+    // the pages of the write map are synced with the read map lazily after the switch
+    page_array_t*  page_generation; // u32 per page, the page is synced when equals to generation
+    u32 generation;
+    u32 synced_generation; // all pages are synced
+    bool sync_reset; // the write map should be zeroed instead of copying
+    spinlock_t sync_locker;
 
     volatile unsigned long snap_number_active;
     volatile unsigned long snap_number_previous;
@@ -22,18 +45,50 @@ typedef struct cbt_map_s
 
     volatile bool active;
 
+    // the blocks, which were discarded or zeroed entirely and were not written after that.
+    // NULL when the discarded blocks are not recorded.
+    page_array_t* discard_write;
+    page_array_t* discard_read; // the discard_write at the last switch
+    // the pages of the discard_write are synced with the discard_read lazily after the switch, as the write map pages
+    page_array_t* discard_generation; // u32 per page, the page is synced when equals to generation
+
+    // the read map is mapped into the user space by the ctrl file, the mappings are dropped on the switch
+    struct inode* mmap_inode;
+
+    // the map is updated by the writers concurrently under the read lock, the switch takes the write lock
     struct rw_semaphore rw_lock;
 }cbt_map_t;
 
-cbt_map_t* cbt_map_create( unsigned int cbt_sect_in_block_degree, sector_t blk_dev_sect_count );
+cbt_map_t* cbt_map_create( unsigned int cbt_sect_in_block_degree, sector_t blk_dev_sect_count, unsigned int entry_size );
 void cbt_map_destroy( cbt_map_t* cbt_map );
 
 void cbt_map_switch( cbt_map_t* cbt_map );
-int cbt_map_set( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt );
+void cbt_map_sync( cbt_map_t* cbt_map );
+void cbt_map_restore( cbt_map_t* cbt_map, unsigned long snap_number_active, unsigned long snap_number_previous, veeam_uuid_t* generationId );
+// should be called under cbt_map_read_lock()
+int cbt_map_set( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt, bool discard );
 int cbt_map_set_both( cbt_map_t* cbt_map, sector_t sector_start, sector_t sector_cnt );
 
+size_t cbt_map_next_dirty( cbt_map_t* cbt_map, size_t cbt_block );
+
+#define CBT_MAP_EXTENTS_PORTION 4096 // extents count collected at once
+// discarded - only the changed blocks, which were discarded at the switch, are collected
+int cbt_map_read_extents( cbt_map_t* cbt_map, unsigned int base_snap_number, bool discarded, size_t* p_cursor, range_t* extents, unsigned int capacity, unsigned int* p_count );
+
 size_t cbt_map_read_to_user( cbt_map_t* cbt_map, void __user * user_buffer, size_t offset, size_t size );
 
+#define CBT_MAP_MMAP_DEV_SHIFT 20 // the device is selected by the high bits of the mmap page offset
+int cbt_map_mmap( cbt_map_t* cbt_map, struct vm_area_struct* vma );
+
+static inline unsigned int cbt_map_entry_size( cbt_map_t* cbt_map )
+{
+    return 1 << cbt_map->entry_shift;
+}
+
+static inline size_t cbt_map_size_in_bytes( cbt_map_t* cbt_map )
+{
+    return cbt_map->map_size << cbt_map->entry_shift;
+}
 
 static inline cbt_map_t* cbt_map_get_resource( cbt_map_t* cbt_map )
 {
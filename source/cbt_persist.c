@@ -0,0 +1,413 @@
+#include "stdafx.h"
+#include "cbt_persist.h"
+#include "blk_util.h"
+#include "blk_direct.h"
+
+#include <linux/crc32.h>
+#include <linux/reboot.h>
+
+#define SECTION "cbtpersist"
+#include "log_format.h"
+
+static container_t CbtPersists;
+
+static inline u32 _cbt_persist_header_crc( cbt_persist_header_t* header )
+{
+    return crc32_le( ~0, (unsigned char*)header, offsetof( cbt_persist_header_t, header_crc ) );
+}
+
+static u32 _cbt_persist_map_crc( page_array_t* map )
+{
+    size_t inx;
+    u32 crc = ~0;
+
+    for (inx = 0; inx < map->pg_cnt; ++inx)
+        crc = crc32_le( crc, (unsigned char*)map->pg[inx].addr, PAGE_SIZE );
+    return crc;
+}
+
+// The area of the storage is addressed as a file: from zero to the sum of the ranges lengths.
+static int _cbt_persist_io( cbt_persist_t* persist, struct block_device* blk_dev, int direction, page_array_t* arr, sector_t virt_ofs, sector_t size )
+{
+    sector_t processed = 0;
+
+    while (processed < size){
+        sector_t phys_ofs;
+        sector_t phys_len;
+
+        if (SUCCESS != rangevector_v2p( &persist->ranges, virt_ofs + processed, size - processed, &phys_ofs, &phys_len )){
+            log_err_sect( "Out of the CBT storage area. offset=", virt_ofs + processed );
+            return -ENOSPC;
+        }
+
+        if (phys_len != blk_direct_submit_pages( blk_dev, direction, processed, arr, phys_ofs, phys_len )){
+            log_err_sect( "Failed to access the CBT storage area. offset=", virt_ofs + processed );
+            return -EIO;
+        }
+        processed += phys_len;
+    }
+    return SUCCESS;
+}
+
+static void _cbt_persist_header_fill( cbt_persist_header_t* header, cbt_map_t* cbt_map, sector_t device_capacity, u32 state )
+{
+    memset( header, 0, sizeof( cbt_persist_header_t ) );
+
+    header->magic = CBT_PERSIST_MAGIC;
+    header->version = CBT_PERSIST_VERSION;
+    header->state = state;
+    header->device_capacity = (u64)device_capacity;
+    header->sect_in_block_degree = (u32)cbt_map->sect_in_block_degree;
+    header->entry_size = cbt_map_entry_size( cbt_map );
+    header->map_size = (u64)cbt_map->map_size;
+    header->snap_number_active = (u64)cbt_map->snap_number_active;
+    header->snap_number_previous = (u64)cbt_map->snap_number_previous;
+    memcpy( header->generationId, cbt_map->generationId.b, sizeof( header->generationId ) );
+}
+
+static int _cbt_persist_header_write( cbt_persist_t* persist, struct block_device* blk_dev, page_array_t* header_arr )
+{
+    int res;
+    cbt_persist_header_t* header = (cbt_persist_header_t*)header_arr->pg[0].addr;
+
+    header->header_crc = _cbt_persist_header_crc( header );
+
+    res = _cbt_persist_io( persist, blk_dev, WRITE, header_arr, 0, SECTORS_IN_PAGE );
+    if (res == SUCCESS)
+        res = blk_dev_flush( blk_dev );
+    return res;
+}
+
+static int _cbt_persist_header_check( cbt_persist_header_t* header, cbt_map_t* cbt_map, sector_t device_capacity )
+{
+    if ((header->magic != CBT_PERSIST_MAGIC) || (header->header_crc != _cbt_persist_header_crc( header ))){
+        log_tr( "The stored CBT map is absent" );
+        return -ENODATA;
+    }
+    if (header->version != CBT_PERSIST_VERSION){
+        log_warn_d( "The stored CBT map has unsupported version ", header->version );
+        return -EINVAL;
+    }
+    if (header->state != CBT_PERSIST_STATE_CLEAN){
+        log_warn( "The stored CBT map is not valid: the system was not shut down cleanly" );
+        return -ESTALE;
+    }
+    if ((header->device_capacity != (u64)device_capacity) ||
+        (header->sect_in_block_degree != (u32)cbt_map->sect_in_block_degree) ||
+        (header->entry_size != cbt_map_entry_size( cbt_map )) ||
+        (header->map_size != (u64)cbt_map->map_size)){
+        log_warn( "The stored CBT map does not fit the device" );
+        return -EINVAL;
+    }
+    if ((header->snap_number_active == 0) ||
+        ((header->snap_number_active >> (BITS_PER_BYTE * header->entry_size)) != 0) ||
+        ((header->snap_number_previous >> (BITS_PER_BYTE * header->entry_size)) != 0)){
+        log_warn( "The stored CBT map has invalid snapshot numbers" );
+        return -EINVAL;
+    }
+    return SUCCESS;
+}
+
+static int _cbt_persist_load( cbt_persist_t* persist, struct block_device* blk_dev, page_array_t* header_arr, cbt_map_t* cbt_map, sector_t device_capacity )
+{
+    int res;
+    cbt_persist_header_t* header = (cbt_persist_header_t*)header_arr->pg[0].addr;
+    page_array_t* map = cbt_map->write_map;
+
+    res = _cbt_persist_io( persist, blk_dev, READ, header_arr, 0, SECTORS_IN_PAGE );
+    if (res != SUCCESS)
+        return res;
+
+    res = _cbt_persist_header_check( header, cbt_map, device_capacity );
+    if (res != SUCCESS)
+        return res;
+
+    res = _cbt_persist_io( persist, blk_dev, READ, map, SECTORS_IN_PAGE, map->pg_cnt * SECTORS_IN_PAGE );
+    if ((res == SUCCESS) && (header->map_crc != _cbt_persist_map_crc( map ))){
+        log_warn( "The stored CBT map is corrupted" );
+        res = -EINVAL;
+    }
+    if (res != SUCCESS){
+        page_array_memset( map, 0 );
+        return res;
+    }
+
+    cbt_map_restore( cbt_map, (unsigned long)header->snap_number_active, (unsigned long)header->snap_number_previous,
+        (veeam_uuid_t*)header->generationId );
+
+    log_tr_format( "The stored CBT map was loaded. Snap number %ld", cbt_map->snap_number_active );
+    return SUCCESS;
+}
+
+// The map is marked dirty in the storage while it is used, so the map is rejected after a crash.
+static int _cbt_persist_attach( cbt_persist_t* persist, cbt_map_t* cbt_map, sector_t device_capacity, bool load )
+{
+    int res;
+    struct block_device* blk_dev = NULL;
+    page_array_t* header_arr = NULL;
+
+    if ((SECTORS_IN_PAGE + page_count_calc( cbt_map_size_in_bytes( cbt_map ) ) * SECTORS_IN_PAGE) > rangevector_length( &persist->ranges )){
+        log_err( "Unable to keep CBT map: the storage area is too small" );
+        return -ENOSPC;
+    }
+
+    res = blk_dev_open( persist->storage_dev_id, &blk_dev );
+    if (res != SUCCESS){
+        log_err_dev_t( "Unable to open CBT storage device ", persist->storage_dev_id );
+        return res;
+    }
+    do{
+        header_arr = page_array_alloc( 1, GFP_KERNEL );
+        if (header_arr == NULL){
+            res = -ENOMEM;
+            break;
+        }
+
+        if (load)
+            _cbt_persist_load( persist, blk_dev, header_arr, cbt_map, device_capacity );
+
+        _cbt_persist_header_fill( (cbt_persist_header_t*)header_arr->pg[0].addr, cbt_map, device_capacity, CBT_PERSIST_STATE_DIRTY );
+        res = _cbt_persist_header_write( persist, blk_dev, header_arr );
+        if (res != SUCCESS){
+            log_err_d( "Failed to mark stored CBT map dirty. errno=", res );
+            break;
+        }
+
+        if (persist->cbt_map != NULL)
+            cbt_map_put_resource( persist->cbt_map );
+        persist->cbt_map = cbt_map_get_resource( cbt_map );
+        persist->device_capacity = device_capacity;
+    } while (false);
+
+    if (header_arr)
+        page_array_free( header_arr );
+    blk_dev_close( blk_dev );
+    return res;
+}
+
+// The map pages are written first, and the header is marked clean after them.
+static int _cbt_persist_store( cbt_persist_t* persist )
+{
+    int res;
+    cbt_map_t* cbt_map = persist->cbt_map;
+    struct block_device* blk_dev = NULL;
+    page_array_t* header_arr = NULL;
+
+    res = blk_dev_open( persist->storage_dev_id, &blk_dev );
+    if (res != SUCCESS){
+        log_err_dev_t( "Unable to open CBT storage device ", persist->storage_dev_id );
+        return res;
+    }
+    do{
+        cbt_persist_header_t* header;
+
+        header_arr = page_array_alloc( 1, GFP_KERNEL );
+        if (header_arr == NULL){
+            res = -ENOMEM;
+            break;
+        }
+        header = (cbt_persist_header_t*)header_arr->pg[0].addr;
+
+        // The tracking for the map is stopped, the writers in flight are waited for.
+        // The later changes are not marked, so the map is not used again: the tracking finds it nonactive and resets it.
+        // The nonactive map is not switched, so the lock is not held while writing, the storage device may be tracked itself.
+        cbt_map_write_lock( cbt_map );
+        cbt_map->active = false;
+        _cbt_persist_header_fill( header, cbt_map, persist->device_capacity, CBT_PERSIST_STATE_CLEAN );
+        cbt_map_write_unlock( cbt_map );
+
+        cbt_map_sync( cbt_map );
+        header->map_crc = _cbt_persist_map_crc( cbt_map->write_map );
+
+        res = _cbt_persist_io( persist, blk_dev, WRITE, cbt_map->write_map, SECTORS_IN_PAGE, cbt_map->write_map->pg_cnt * SECTORS_IN_PAGE );
+        if (res == SUCCESS)
+            res = blk_dev_flush( blk_dev );
+        if (res != SUCCESS){
+            log_err_d( "Failed to store CBT map. errno=", res );
+            break;
+        }
+
+        res = _cbt_persist_header_write( persist, blk_dev, header_arr );
+        if (res != SUCCESS){
+            log_err_d( "Failed to mark stored CBT map clean. errno=", res );
+            break;
+        }
+        log_tr_dev_t( "CBT map was stored for device ", persist->dev_id );
+    } while (false);
+
+    if (header_arr)
+        page_array_free( header_arr );
+    blk_dev_close( blk_dev );
+    return res;
+}
+
+static void _cbt_persist_free( cbt_persist_t* persist )
+{
+    if (persist->cbt_map != NULL){
+        cbt_map_put_resource( persist->cbt_map );
+        persist->cbt_map = NULL;
+    }
+    rangevector_done( &persist->ranges );
+    content_free( &persist->content );
+}
+
+// The maps are stored on the clean reboot or power off, the tracking of each stored map is stopped.
+static int cbt_persist_reboot_notify( struct notifier_block* nb, unsigned long action, void* data )
+{
+    content_t* content = NULL;
+
+    CONTAINER_FOREACH_BEGIN( CbtPersists, content ){
+        cbt_persist_t* persist = (cbt_persist_t*)content;
+
+        mutex_lock( &persist->locker );
+        if (persist->cbt_map != NULL)
+            _cbt_persist_store( persist );
+        mutex_unlock( &persist->locker );
+    }CONTAINER_FOREACH_END( CbtPersists );
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cbt_persist_reboot_nb = {
+    .notifier_call = cbt_persist_reboot_notify,
+};
+static bool cbt_persist_reboot_registered = false;
+
+int cbt_persist_init( void )
+{
+    int res = container_init( &CbtPersists, sizeof( cbt_persist_t ) );
+    if (res != SUCCESS)
+        log_err( "Failed to initialize CBT storage container" );
+    return res;
+}
+
+// The notifier is registered after all the module parts are initialized,
+// and is unregistered before any of them is released, so it never outlives the module.
+int cbt_persist_reboot_register( void )
+{
+    int res = register_reboot_notifier( &cbt_persist_reboot_nb );
+    if (res != SUCCESS){
+        log_err_d( "Failed to register reboot notifier. errno=", res );
+        return res;
+    }
+    cbt_persist_reboot_registered = true;
+    return SUCCESS;
+}
+
+void cbt_persist_reboot_unregister( void )
+{
+    if (!cbt_persist_reboot_registered)
+        return;
+
+    unregister_reboot_notifier( &cbt_persist_reboot_nb );
+    cbt_persist_reboot_registered = false;
+}
+
+void cbt_persist_done( void )
+{
+    content_t* content;
+
+    cbt_persist_reboot_unregister( );
+
+    while (NULL != (content = container_get_first( &CbtPersists )))
+        _cbt_persist_free( (cbt_persist_t*)content );
+
+    if (SUCCESS != container_done( &CbtPersists ))
+        log_err( "Unable to perform CBT storage cleanup: container is not empty" );
+}
+
+int cbt_persist_set( dev_t dev_id, dev_t storage_dev_id, struct block_range_s* ranges, size_t ranges_count )
+{
+    int res = SUCCESS;
+    size_t inx;
+    cbt_persist_t* persist;
+
+    log_tr_format( "Set CBT storage for device [%d:%d] on device [%d:%d], %ld ranges",
+        MAJOR( dev_id ), MINOR( dev_id ), MAJOR( storage_dev_id ), MINOR( storage_dev_id ), ranges_count );
+
+    cbt_persist_remove( dev_id );
+
+    persist = (cbt_persist_t*)content_new( &CbtPersists );
+    if (persist == NULL)
+        return -ENOMEM;
+
+    persist->dev_id = dev_id;
+    persist->storage_dev_id = storage_dev_id;
+    rangevector_init( &persist->ranges, false );
+    mutex_init( &persist->locker );
+
+    for (inx = 0; inx < ranges_count; ++inx){
+        range_t rg;
+
+        rg.ofs = (sector_t)ranges[inx].ofs;
+        rg.cnt = (sector_t)ranges[inx].cnt;
+        res = rangevector_add( &persist->ranges, &rg );
+        if (res != SUCCESS){
+            _cbt_persist_free( persist );
+            return res;
+        }
+    }
+
+    container_push_back( &CbtPersists, &persist->content );
+    return SUCCESS;
+}
+
+int cbt_persist_remove( dev_t dev_id )
+{
+    content_t* content = NULL;
+    cbt_persist_t* persist = NULL;
+
+    CONTAINER_FOREACH_BEGIN( CbtPersists, content ){
+        if (((cbt_persist_t*)content)->dev_id == dev_id){
+            persist = (cbt_persist_t*)content;
+            break;
+        }
+    }CONTAINER_FOREACH_END( CbtPersists );
+
+    if (persist == NULL)
+        return -ENODATA;
+
+    container_get( &persist->content );
+    _cbt_persist_free( persist );
+    return SUCCESS;
+}
+
+// Returns -ENODATA when the device has no storage area for its CBT map
+int cbt_persist_attach( dev_t dev_id, cbt_map_t* cbt_map, sector_t device_capacity, bool load )
+{
+    int res = -ENODATA;
+    content_t* content = NULL;
+
+    CONTAINER_FOREACH_BEGIN( CbtPersists, content ){
+        cbt_persist_t* persist = (cbt_persist_t*)content;
+
+        if (persist->dev_id == dev_id){
+            mutex_lock( &persist->locker );
+            res = _cbt_persist_attach( persist, cbt_map, device_capacity, load );
+            mutex_unlock( &persist->locker );
+            break;
+        }
+    }CONTAINER_FOREACH_END( CbtPersists );
+
+    return res;
+}
+
+void cbt_persist_detach( dev_t dev_id, cbt_map_t* cbt_map, bool store )
+{
+    content_t* content = NULL;
+
+    CONTAINER_FOREACH_BEGIN( CbtPersists, content ){
+        cbt_persist_t* persist = (cbt_persist_t*)content;
+
+        if ((persist->dev_id == dev_id) && (persist->cbt_map == cbt_map)){
+            mutex_lock( &persist->locker );
+            if (store)
+                _cbt_persist_store( persist );
+
+            cbt_map_put_resource( persist->cbt_map );
+            persist->cbt_map = NULL;
+            mutex_unlock( &persist->locker );
+            break;
+        }
+    }CONTAINER_FOREACH_END( CbtPersists );
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "container.h"
+#include "rangevector.h"
+#include "cbt_map.h"
+#include "veeamsnap_ioctl.h"
+
+#define CBT_PERSIST_MAGIC 0x7473727350544243ull // "CBTPsrst"
+#define CBT_PERSIST_VERSION 1
+
+#define CBT_PERSIST_STATE_DIRTY 0 // the map is in use or the system was not shut down cleanly
+#define CBT_PERSIST_STATE_CLEAN 1 // the map was stored on the module unload or on the reboot
+
+#define CBT_PERSIST_RANGES_MAX CBT_MAP_EXTENTS_PORTION // the ranges of the area are passed at once
+
+// The header is in the first sector of the storage, the map pages are after the first page
+typedef struct cbt_persist_header_s
+{
+    u64 magic;
+    u32 version;
+    u32 state;
+    u64 device_capacity;
+    u32 sect_in_block_degree;
+    u32 entry_size;
+    u64 map_size;
+    u64 snap_number_active;
+    u64 snap_number_previous;
+    u8 generationId[16];
+    u32 map_crc;
+    u32 header_crc; // of the header up to this field
+}__attribute__((packed)) cbt_persist_header_t;
+
+// The reserved area where the CBT map of the tracked device is kept between the module loads.
+// The area is a file preallocated by the user space, or a region of a device.
+typedef struct cbt_persist_s
+{
+    content_t content;
+    dev_t dev_id;
+    dev_t storage_dev_id;
+    rangevector_t ranges; // in sectors of the storage device
+
+    struct mutex locker;
+    cbt_map_t* cbt_map; // the map, which is kept in the area now
+    sector_t device_capacity;
+}cbt_persist_t;
+
+int cbt_persist_init( void );
+void cbt_persist_done( void );
+
+int cbt_persist_reboot_register( void );
+void cbt_persist_reboot_unregister( void );
+
+int cbt_persist_set( dev_t dev_id, dev_t storage_dev_id, struct block_range_s* ranges, size_t ranges_count );
+int cbt_persist_remove( dev_t dev_id );
+
+int cbt_persist_attach( dev_t dev_id, cbt_map_t* cbt_map, sector_t device_capacity, bool load );
+void cbt_persist_detach( dev_t dev_id, cbt_map_t* cbt_map, bool store );
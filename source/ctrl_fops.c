@@ -13,6 +13,7 @@
 #include "snapdata_collect.h"
 #include "snapimage.h"
 #include "tracker.h"
+#include "cbt_persist.h"
 #include "page_array.h"
 #include "blk_deferred.h"
 
@@ -76,6 +77,12 @@ unsigned int ctrl_poll( struct file *fl, struct poll_table_struct *wait )
 }
 
 
+int ctrl_mmap( struct file *fl, struct vm_area_struct *vma )
+{
+    return tracking_cbt_mmap( vma );
+}
+
+
 int ctrl_open(struct inode *inode, struct file *fl)
 {
     fl->f_pos = 0;
@@ -158,7 +165,24 @@ int ioctl_tracking_add( unsigned long arg )
         return -ENODATA;
     }
 
-    return tracking_add( MKDEV( dev.major, dev.minor ), CBT_BLOCK_SIZE_DEGREE, 0ull );
+    return tracking_add( MKDEV( dev.major, dev.minor ), CBT_BLOCK_SIZE_DEGREE, 0, 0ull );
+}
+
+int ioctl_tracking_add_ex( unsigned long arg )
+{
+    struct ioctl_tracking_add_ex_s param;
+
+    if (0 != copy_from_user( &param, (void*)arg, sizeof( struct ioctl_tracking_add_ex_s ) )){
+        log_err( "Unable to add device under tracking: invalid user buffer" );
+        return -ENODATA;
+    }
+
+    if ((param.cbt_entry_size != CBT_ENTRY_SIZE_BYTE) && (param.cbt_entry_size != CBT_ENTRY_SIZE_WORD)){
+        log_err_d( "Unable to add device under tracking: invalid CBT entry size ", param.cbt_entry_size );
+        return -EINVAL;
+    }
+
+    return tracking_add( MKDEV( param.dev_id.major, param.dev_id.minor ), CBT_BLOCK_SIZE_DEGREE, param.cbt_entry_size, 0ull );
 }
 
 int ioctl_tracking_remove( unsigned long arg )
@@ -260,6 +284,122 @@ int ioctl_tracking_read_cbt_map( unsigned long arg )
     );
 }
 
+static int _ioctl_tracking_read_cbt_extents( unsigned long arg, bool discarded )
+{
+    int result;
+    struct ioctl_tracking_read_cbt_extents_s param;
+
+    if (0 != copy_from_user( &param, (void*)arg, sizeof( struct ioctl_tracking_read_cbt_extents_s ) )){
+        log_err( "Unable to read CBT extents: invalid user buffer" );
+        return -ENODATA;
+    }
+
+    result = tracking_read_cbt_extents( MKDEV( param.dev_id.major, param.dev_id.minor ),
+        param.base_snap_number, discarded, &param.cursor, param.p_extents, &param.count );
+    if (result != SUCCESS)
+        return result;
+
+    if (0 != copy_to_user( (void*)arg, &param, sizeof( struct ioctl_tracking_read_cbt_extents_s ) )){
+        log_err( "Unable to read CBT extents: invalid user buffer" );
+        return -ENODATA;
+    }
+    return SUCCESS;
+}
+
+int ioctl_tracking_read_cbt_extents( unsigned long arg )
+{
+    return _ioctl_tracking_read_cbt_extents( arg, false );
+}
+
+int ioctl_tracking_read_cbt_discarded( unsigned long arg )
+{
+    return _ioctl_tracking_read_cbt_extents( arg, true );
+}
+
+int ioctl_tracking_cbt_info( unsigned long arg )
+{
+    int result;
+    struct ioctl_tracking_cbt_info_s param;
+
+    if (0 != copy_from_user( &param, (void*)arg, sizeof( struct ioctl_tracking_cbt_info_s ) )){
+        log_err( "Unable to get CBT info: invalid user buffer" );
+        return -ENODATA;
+    }
+
+    result = tracking_cbt_info( MKDEV( param.dev_id.major, param.dev_id.minor ), &param );
+    if (result != SUCCESS)
+        return result;
+
+    if (0 != copy_to_user( (void*)arg, &param, sizeof( struct ioctl_tracking_cbt_info_s ) )){
+        log_err( "Unable to get CBT info: invalid user buffer" );
+        return -ENODATA;
+    }
+    return SUCCESS;
+}
+
+int ioctl_tracking_cbt_persist( unsigned long arg )
+{
+    struct ioctl_tracking_cbt_persist_s param;
+    struct block_range_s* ranges = NULL;
+    size_t buffer_size;
+    int result = SUCCESS;
+
+    if (0 != copy_from_user( &param, (void*)arg, sizeof( struct ioctl_tracking_cbt_persist_s ) )){
+        log_err( "Unable to set CBT storage: invalid user buffer" );
+        return -ENODATA;
+    }
+
+    if (param.range_count > CBT_PERSIST_RANGES_MAX){
+        log_err_d( "Unable to set CBT storage: too many ranges ", param.range_count );
+        return -EINVAL;
+    }
+
+    buffer_size = param.range_count * sizeof( struct block_range_s );
+    if (buffer_size != 0){
+        ranges = dbg_kzalloc( buffer_size, GFP_KERNEL );
+        if (ranges == NULL){
+            log_err_format( "Unable to set CBT storage: cannot allocate [%ld] bytes", buffer_size );
+            return -ENOMEM;
+        }
+    }
+
+    do{
+        if ((ranges != NULL) && (0 != copy_from_user( ranges, (void*)param.p_ranges, buffer_size ))){
+            log_err( "Unable to set CBT storage: invalid user buffer" );
+            result = -ENODATA;
+            break;
+        }
+
+        result = tracking_cbt_persist( MKDEV( param.dev_id.major, param.dev_id.minor ),
+            MKDEV( param.storage_dev_id.major, param.storage_dev_id.minor ), ranges, param.range_count );
+    } while (false);
+
+    if (ranges != NULL)
+        dbg_kfree( ranges );
+    return result;
+}
+
+int ioctl_tracking_cbt_mmap( unsigned long arg )
+{
+    int result;
+    struct ioctl_tracking_cbt_mmap_s param;
+
+    if (0 != copy_from_user( &param, (void*)arg, sizeof( struct ioctl_tracking_cbt_mmap_s ) )){
+        log_err( "Unable to map CBT map: invalid user buffer" );
+        return -ENODATA;
+    }
+
+    result = tracking_cbt_mmap_info( MKDEV( param.dev_id.major, param.dev_id.minor ), &param.offset, &param.length );
+    if (result != SUCCESS)
+        return result;
+
+    if (0 != copy_to_user( (void*)arg, &param, sizeof( struct ioctl_tracking_cbt_mmap_s ) )){
+        log_err( "Unable to map CBT map: invalid user buffer" );
+        return -ENODATA;
+    }
+    return SUCCESS;
+}
+
 int ioctl_tracking_mark_dirty_blocks(unsigned long arg)
 {
     struct ioctl_tracking_mark_dirty_blocks_s param;
@@ -565,6 +705,55 @@ int ioctl_snapshot_errno( unsigned long arg )
     return SUCCESS;
 }
 
+typedef int (snapstore_device_ranges_fn)( dev_t dev_id, page_array_t* ranges, size_t ranges_cnt );
+
+// The ranges of the snapshot, which do not need the copy-on-write, are passed to the snapstore device
+static int _ioctl_snapshot_cow_ranges( unsigned long arg, snapstore_device_ranges_fn* ranges_fn, const char* action )
+{
+    int res = SUCCESS;
+    struct ioctl_snapshot_cow_exclude_s param;
+    page_array_t* ranges = NULL;
+    size_t ranges_buffer_size;
+
+    if (0 != copy_from_user( &param, (void*)arg, sizeof( struct ioctl_snapshot_cow_exclude_s ) )){
+        log_err_format( "Unable to %s: invalid user buffer", action );
+        return -EINVAL;
+    }
+    if (param.range_count == 0)
+        return SUCCESS;
+
+    ranges_buffer_size = sizeof( struct ioctl_range_s ) * param.range_count;
+
+    ranges = page_array_alloc( page_count_calc( ranges_buffer_size ), GFP_KERNEL );
+    if (NULL == ranges){
+        log_err_format( "Unable to %s: cannot allocate [%ld] bytes", action, ranges_buffer_size );
+        return -ENOMEM;
+    }
+
+    do{
+        if (ranges_buffer_size != page_array_user2page( (void*)param.ranges, 0, ranges, ranges_buffer_size )){
+            log_err_format( "Unable to %s: invalid user buffer for parameters.", action );
+            res = -ENODATA;
+            break;
+        }
+
+        res = ranges_fn( MKDEV( param.dev_id.major, param.dev_id.minor ), ranges, (size_t)param.range_count );
+    } while (false);
+    page_array_free( ranges );
+
+    return res;
+}
+
+int ioctl_snapshot_cow_exclude( unsigned long arg )
+{
+    return _ioctl_snapshot_cow_ranges( arg, snapstore_device_cow_exclude, "exclude ranges from copy-on-write" );
+}
+
+int ioctl_snapshot_cow_consumed( unsigned long arg )
+{
+    return _ioctl_snapshot_cow_ranges( arg, snapstore_device_cow_consumed, "mark ranges as consumed" );
+}
+
 int ioctl_collect_snapshotdata_location_start( unsigned long arg )
 {
     struct ioctl_collect_snapshotdata_location_start_s param;
@@ -721,10 +910,18 @@ static veeam_ioctl_table_t veeam_ioctl_table[] =
     { (IOCTL_TRACKING_BLOCK_SIZE), ioctl_tracking_block_size, "IOCTL_TRACKING_BLOCK_SIZE" },
     { (IOCTL_TRACKING_READ_CBT_BITMAP), ioctl_tracking_read_cbt_map, "IOCTL_TRACKING_READ_CBT_BITMAP" },
     { (IOCTL_TRACKING_MARK_DIRTY_BLOCKS), ioctl_tracking_mark_dirty_blocks, "IOCTL_TRACKING_MARK_DIRTY_BLOCKS" },
+    { (IOCTL_TRACKING_READ_CBT_EXTENTS), ioctl_tracking_read_cbt_extents, "IOCTL_TRACKING_READ_CBT_EXTENTS" },
+    { (IOCTL_TRACKING_ADD_EX), ioctl_tracking_add_ex, "IOCTL_TRACKING_ADD_EX" },
+    { (IOCTL_TRACKING_CBT_INFO), ioctl_tracking_cbt_info, "IOCTL_TRACKING_CBT_INFO" },
+    { (IOCTL_TRACKING_CBT_PERSIST), ioctl_tracking_cbt_persist, "IOCTL_TRACKING_CBT_PERSIST" },
+    { (IOCTL_TRACKING_CBT_MMAP), ioctl_tracking_cbt_mmap, "IOCTL_TRACKING_CBT_MMAP" },
+    { (IOCTL_TRACKING_READ_CBT_DISCARDED), ioctl_tracking_read_cbt_discarded, "IOCTL_TRACKING_READ_CBT_DISCARDED" },
 
     { (IOCTL_SNAPSHOT_CREATE), ioctl_snapshot_create, "IOCTL_SNAPSHOT_CREATE" },
     { (IOCTL_SNAPSHOT_DESTROY), ioctl_snapshot_destroy, "IOCTL_SNAPSHOT_DESTROY" },
     { (IOCTL_SNAPSHOT_ERRNO), ioctl_snapshot_errno, "IOCTL_SNAPSHOT_ERRNO" },
+    { (IOCTL_SNAPSHOT_COW_EXCLUDE), ioctl_snapshot_cow_exclude, "IOCTL_SNAPSHOT_COW_EXCLUDE" },
+    { (IOCTL_SNAPSHOT_COW_CONSUMED), ioctl_snapshot_cow_consumed, "IOCTL_SNAPSHOT_COW_CONSUMED" },
 
     { (IOCTL_SNAPSTORE_CREATE), ioctl_snapstore_create, "IOCTL_SNAPSTORE_CREATE" },
     { (IOCTL_SNAPSTORE_FILE), ioctl_snapstore_file, "IOCTL_SNAPSTORE_FILE" },
@@ -753,10 +950,18 @@ static veeam_ioctl_table_t veeam_ioctl_table[] =
     { (IOCTL_TRACKING_BLOCK_SIZE), ioctl_tracking_block_size },
     { (IOCTL_TRACKING_READ_CBT_BITMAP), ioctl_tracking_read_cbt_map },
     { (IOCTL_TRACKING_MARK_DIRTY_BLOCKS), ioctl_tracking_mark_dirty_blocks},
+    { (IOCTL_TRACKING_READ_CBT_EXTENTS), ioctl_tracking_read_cbt_extents },
+    { (IOCTL_TRACKING_ADD_EX), ioctl_tracking_add_ex },
+    { (IOCTL_TRACKING_CBT_INFO), ioctl_tracking_cbt_info },
+    { (IOCTL_TRACKING_CBT_PERSIST), ioctl_tracking_cbt_persist },
+    { (IOCTL_TRACKING_CBT_MMAP), ioctl_tracking_cbt_mmap },
+    { (IOCTL_TRACKING_READ_CBT_DISCARDED), ioctl_tracking_read_cbt_discarded },
 
     { (IOCTL_SNAPSHOT_CREATE), ioctl_snapshot_create },
     { (IOCTL_SNAPSHOT_DESTROY), ioctl_snapshot_destroy },
     { (IOCTL_SNAPSHOT_ERRNO), ioctl_snapshot_errno },
+    { (IOCTL_SNAPSHOT_COW_EXCLUDE), ioctl_snapshot_cow_exclude },
+    { (IOCTL_SNAPSHOT_COW_CONSUMED), ioctl_snapshot_cow_consumed },
 
     { (IOCTL_SNAPSTORE_CREATE), ioctl_snapstore_create },
     { (IOCTL_SNAPSTORE_FILE), ioctl_snapstore_file },
@@ -11,5 +11,7 @@ ssize_t ctrl_write(struct file *filp, const char __user *buffer, size_t length,
 
 unsigned int ctrl_poll(struct file *filp, struct poll_table_struct *wait);
 
+int ctrl_mmap( struct file *filp, struct vm_area_struct *vma );
+
 long ctrl_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
@@ -9,8 +9,6 @@
 #include "log_format.h"
 
 typedef struct defer_io_original_request_s{
-    queue_content_sl_t content;
-
     range_t sect;
 
     struct bio* bio;
@@ -18,94 +16,425 @@ typedef struct defer_io_original_request_s{
     make_request_fn* make_rq_fn;
     tracker_t* tracker;
 
+    atomic_t parts_count; // parts are not processed yet plus the reference of the submitter
 }defer_io_original_request_t;
 
+// each part of the request is processed by the worker of its stripe
+typedef struct defer_io_request_part_s{
+    queue_content_sl_t content;
 
-void _defer_io_finish( defer_io_t* defer_io, queue_sl_t* queue_in_progress )
+    range_t sect;
+    defer_io_original_request_t* orig_req;
+    sector_t wait_sect; // length of the copy request part, that should be stored before the bio is released
+    bool cow_needed; // the part overwrites the blocks, which may be copied by another request
+
+    defer_io_original_request_t own_req; // valid for the first part only
+}defer_io_request_part_t;
+
+// the reserve allows the writes to the original device to proceed when the memory is low
+#define DEFER_IO_PART_POOL_MIN 256
+
+static struct kmem_cache* g_defer_io_part_cache = NULL;
+static mempool_t* g_defer_io_part_pool = NULL;
+
+int defer_io_init( void )
 {
-    while ( !queue_sl_empty( *queue_in_progress ) )
+    g_defer_io_part_cache = kmem_cache_create( "veeamsnap_defer_io_part", sizeof( defer_io_request_part_t ), 0, 0, NULL );
+    if (g_defer_io_part_cache == NULL){
+        log_err( "Unable to create kmem_cache for defer IO requests" );
+        return -ENOMEM;
+    }
+    g_defer_io_part_pool = mempool_create_slab_pool( DEFER_IO_PART_POOL_MIN, g_defer_io_part_cache );
+    if (g_defer_io_part_pool == NULL){
+        log_err( "Unable to create mempool for defer IO requests" );
+        kmem_cache_destroy( g_defer_io_part_cache );
+        g_defer_io_part_cache = NULL;
+        return -ENOMEM;
+    }
+    return SUCCESS;
+}
+
+void defer_io_done( void )
+{
+    if (g_defer_io_part_pool != NULL){
+        mempool_destroy( g_defer_io_part_pool );
+        g_defer_io_part_pool = NULL;
+    }
+    if (g_defer_io_part_cache != NULL){
+        kmem_cache_destroy( g_defer_io_part_cache );
+        g_defer_io_part_cache = NULL;
+    }
+}
+
+
+// the credit, which can be gathered while the image is not read
+#define DEFER_IO_THROTTLE_CREDIT_MAX (16ll << (20 - SECTOR512_SHIFT))
+// the time to recheck the credit, which is earned for the minimum read bandwidth
+#define DEFER_IO_THROTTLE_TICK (HZ / 50 + 1)
+
+static inline void _defer_io_throttle_credit_add( defer_io_t* defer_io, s64 credit )
+{
+    defer_io->throttle_credit = min_t( s64, defer_io->throttle_credit + credit, DEFER_IO_THROTTLE_CREDIT_MAX );
+}
+
+// the copied sectors give the image reads their share by the weights
+static void _defer_io_throttle_copied( defer_io_t* defer_io, sector_t sect_cnt )
+{
+    // the parameters may be changed at runtime, so they are limited here too
+    s64 credit = div_s64( (s64)sect_cnt * max_t( int, get_throttle_read_weight( ), 0 ), max_t( int, get_throttle_cow_weight( ), 1 ) );
+
+    spin_lock( &defer_io->throttle_lock );
+    _defer_io_throttle_credit_add( defer_io, credit );
+    spin_unlock( &defer_io->throttle_lock );
+
+    wake_up_interruptible( &defer_io->queue_throttle_waiter );
+}
+
+// the s64 credit may be torn on 32-bit, so it is read under the lock
+static s64 _defer_io_throttle_credit( defer_io_t* defer_io )
+{
+    s64 credit;
+
+    spin_lock( &defer_io->throttle_lock );
+    credit = defer_io->throttle_credit;
+    spin_unlock( &defer_io->throttle_lock );
+    return credit;
+}
+
+static bool _defer_io_throttle_take( defer_io_t* defer_io, sector_t sect_cnt )
+{
+    bool taken = false;
+    u64 now = get_jiffies_64( );
+
+    spin_lock( &defer_io->throttle_lock );
     {
-        tracker_t* tracker = NULL;
-        bool cbt_locked = false;
-        bool is_write_bio;
-        defer_io_original_request_t* orig_req = (defer_io_original_request_t*)queue_sl_get_first( queue_in_progress );
-
-        is_write_bio = bio_data_dir( orig_req->bio ) && bio_has_data( orig_req->bio );
-
-        if (orig_req->tracker && is_write_bio){
-            tracker = orig_req->tracker;
-            cbt_locked = tracker_cbt_bitmap_lock( tracker );
-            if (cbt_locked)
-                tracker_cbt_bitmap_set( tracker, orig_req->sect.ofs, orig_req->sect.cnt );
+        u64 elapsed_ms = jiffies_to_msecs( now - defer_io->throttle_jiffies );
+
+        // the minimum read bandwidth: MiB per second is 2048 sectors per 1000 ms
+        if (elapsed_ms > 0){
+            _defer_io_throttle_credit_add( defer_io, (s64)div_u64( (elapsed_ms * max_t( int, get_throttle_min_read_mbps( ), 0 )) << (20 - SECTOR512_SHIFT), 1000 ) );
+            defer_io->throttle_jiffies = now;
+        }
+        // a large read is allowed with any positive credit and pays off its debt later
+        if (defer_io->throttle_credit > 0){
+            defer_io->throttle_credit -= sect_cnt;
+            taken = true;
         }
+    }
+    spin_unlock( &defer_io->throttle_lock );
+    return taken;
+}
 
-        {
-            struct bio* _bio = orig_req->bio;
-            orig_req->bio = NULL;
+// The snapshot image request is delayed while the copy-on-write is queued and the reads have spent their share.
+// The request is never delayed longer than VEEAMIMAGE_THROTTLE_TIMEOUT.
+int defer_io_throttle( defer_io_t* defer_io, sector_t sect_cnt )
+{
+    int res = SUCCESS;
+    u64 start_jiffies = 0;
 
-            bio_put(_bio); //bio_put should be before orig_req->make_rq_fn
+    while (0 != atomic_read( &defer_io->queue_filling_count )){
+        if (_defer_io_throttle_take( defer_io, sect_cnt ))
+            break;
 
-            orig_req->make_rq_fn( orig_req->q, _bio );
+        if (start_jiffies == 0){
+            start_jiffies = get_jiffies_64( );
+            atomic64_inc( &defer_io->state_throttled );
         }
-        atomic64_inc( &defer_io->state_bios_processed );
-        atomic64_add( (orig_req->sect.cnt), &defer_io->state_sectors_processed );
+        else if ((get_jiffies_64( ) - start_jiffies) > VEEAMIMAGE_THROTTLE_TIMEOUT)
+            break;
+
+        res = wait_event_interruptible_timeout( defer_io->queue_throttle_waiter,
+            (0 == atomic_read( &defer_io->queue_filling_count )) || (_defer_io_throttle_credit( defer_io ) > 0), DEFER_IO_THROTTLE_TICK );
+        if (res < 0)
+            break;
+        res = SUCCESS;
+    }
+
+    if (start_jiffies != 0)
+        atomic64_add( jiffies_to_msecs( get_jiffies_64( ) - start_jiffies ), &defer_io->state_throttled_ms );
+    return res;
+}
+
+static inline sector_t _defer_io_stripe_shift( void )
+{
+    // the stripe cannot be less than the snapstore block
+    return max_t( sector_t, SNAPSTORE_BLK_SHIFT, DEFER_IO_WORKER_STRIPE_SHIFT );
+}
+
+// the part of the request is not longer than a stripe, so it may need one more block, if the stripe is not aligned
+static inline bool _defer_io_pool_has_room( defer_io_t* defer_io )
+{
+    blk_deferred_pool_t* pool = defer_io->snapstore_device->cow_pool;
+
+    if (pool == NULL)
+        return true;
+    return blk_deferred_pool_has_room( pool, (size_t)((1ull << _defer_io_stripe_shift( )) >> SNAPSTORE_BLK_SHIFT) + 1 );
+}
+
+static inline defer_io_worker_t* _defer_io_worker_by_sector( defer_io_t* defer_io, sector_t sector )
+{
+    sector_t stripe = sector >> _defer_io_stripe_shift( );
+
+    return &defer_io->workers[sector_div( stripe, defer_io->workers_count )];
+}
+
+static void _defer_io_original_request_release( defer_io_t* defer_io, defer_io_original_request_t* orig_req )
+{
+    tracker_t* tracker = NULL;
+    bool cbt_locked = false;
+    bool is_write_bio;
+    defer_io_request_part_t* owner_part = container_of( orig_req, defer_io_request_part_t, own_req );
+
+    is_write_bio = blk_bio_is_write( orig_req->bio );
 
+    if (orig_req->tracker && is_write_bio){
+        tracker = orig_req->tracker;
+        cbt_locked = tracker_cbt_bitmap_lock( tracker );
         if (cbt_locked)
-            tracker_cbt_bitmap_unlock( tracker );
+            tracker_cbt_bitmap_set( tracker, orig_req->sect.ofs, orig_req->sect.cnt, blk_bio_is_discard( orig_req->bio ) );
+    }
+
+    {
+        struct bio* _bio = orig_req->bio;
+        orig_req->bio = NULL;
+
+        bio_put(_bio); //bio_put should be before orig_req->make_rq_fn
 
-        queue_content_sl_free( &orig_req->content );
+        orig_req->make_rq_fn( orig_req->q, _bio );
     }
+    atomic64_inc( &defer_io->state_bios_processed );
+    atomic64_add( (orig_req->sect.cnt), &defer_io->state_sectors_processed );
+
+    if (cbt_locked)
+        tracker_cbt_bitmap_unlock( tracker );
+
+    queue_content_sl_free( &owner_part->content );
+}
+
+static inline void _defer_io_original_request_put( defer_io_t* defer_io, defer_io_original_request_t* orig_req )
+{
+    if (atomic_dec_and_test( &orig_req->parts_count ))
+        _defer_io_original_request_release( defer_io, orig_req );
+}
+
+static inline void _defer_io_part_complete( defer_io_t* defer_io, defer_io_request_part_t* part )
+{
+    defer_io_original_request_t* orig_req = part->orig_req;
+
+    // the first part lives until the request is released
+    if (orig_req != &part->own_req)
+        queue_content_sl_free( &part->content );
+
+    _defer_io_original_request_put( defer_io, orig_req );
 }
 
-int _defer_io_copy_prepare( defer_io_t* defer_io, queue_sl_t* queue_in_process, blk_deferred_request_t** dio_copy_req )
+// the blocks of the part may be copied by the snapshot image write yet
+static inline int _defer_io_part_complete_stored( defer_io_t* defer_io, defer_io_request_part_t* part )
+{
+    int res = SUCCESS;
+
+    if (part->cow_needed)
+        res = snapstore_device_wait_in_flight( defer_io->snapstore_device, &part->sect );
+
+    _defer_io_part_complete( defer_io, part );
+    return res;
+}
+
+void _defer_io_finish( defer_io_t* defer_io, queue_sl_t* queue_in_progress )
+{
+    while ( !queue_sl_empty( *queue_in_progress ) )
+    {
+        defer_io_request_part_t* part = (defer_io_request_part_t*)queue_sl_get_first( queue_in_progress );
+
+        _defer_io_part_complete_stored( defer_io, part );
+    }
+}
+
+int _defer_io_copy_prepare( defer_io_worker_t* worker, queue_sl_t* queue_in_process, blk_deferred_request_t** dio_copy_req )
 {
     int res = SUCCESS;
     int dios_count = 0;
     sector_t dios_sectors_count = 0;
+    defer_io_t* defer_io = worker->defer_io;
 
-    //fill copy_request set
-    while (!queue_sl_empty( defer_io->dio_queue ) && (dios_count < DEFER_IO_DIO_REQUEST_LENGTH) && (dios_sectors_count < DEFER_IO_DIO_REQUEST_SECTORS_COUNT)){
+    //fill copy_request set, the batch is closed early when the buffers pool is exhausted
+    while (!queue_sl_empty( worker->dio_queue ) && (dios_count < DEFER_IO_DIO_REQUEST_LENGTH) && (dios_sectors_count < DEFER_IO_DIO_REQUEST_SECTORS_COUNT) &&
+        ((dios_count == 0) || _defer_io_pool_has_room( defer_io ))){
 
-        defer_io_original_request_t* dio_orig_req = (defer_io_original_request_t*)queue_sl_get_first( &defer_io->dio_queue );
+        defer_io_request_part_t* part = (defer_io_request_part_t*)queue_sl_get_first( &worker->dio_queue );
+        struct bio* bio = part->orig_req->bio;
+        bool cow_needed = false;
         atomic_dec( &defer_io->queue_filling_count );
+        ++dios_count;
 
-        queue_sl_push_back( queue_in_process, &dio_orig_req->content );
+        if (!kthread_should_stop( ) && !snapstore_device_is_corrupted( defer_io->snapstore_device ))
+            cow_needed = blk_bio_is_write( bio ) && (part->sect.cnt != 0);
 
-        if (!kthread_should_stop( ) && !snapstore_device_is_corrupted( defer_io->snapstore_device )){
-            if (bio_data_dir( dio_orig_req->bio ) && bio_has_data( dio_orig_req->bio )){
-                res = snapstore_device_prepare_requests( defer_io->snapstore_device, &dio_orig_req->sect, dio_copy_req );
-                if (res != SUCCESS){
-                    log_err_d( "Unable to execute Copy On Write algorithm: failed to add ranges to copy to snapstore request. errno=", res );
-                    break;
-                }
-                dios_sectors_count += dio_orig_req->sect.cnt;
+        if (cow_needed && snapstore_device_is_preserved( defer_io->snapstore_device, &part->sect )){
+            //nothing to copy, the write is passed through immediately
+            atomic64_add( part->sect.cnt, &defer_io->state_sectors_passed );
+            _defer_io_part_complete( defer_io, part );
+            continue;
+        }
+
+        part->wait_sect = 0;
+        part->cow_needed = cow_needed;
+        queue_sl_push_back( queue_in_process, &part->content );
+
+        if (cow_needed){
+            res = snapstore_device_prepare_requests( defer_io->snapstore_device, &part->sect, dio_copy_req, &part->wait_sect );
+            if (res != SUCCESS){
+                log_err_d( "Unable to execute Copy On Write algorithm: failed to add ranges to copy to snapstore request. errno=", res );
+                break;
             }
+            dios_sectors_count += part->sect.cnt;
         }
-        ++dios_count;
     }
     return res;
 }
 
-int defer_io_work_thread( void* p )
+// batch of requests, that was prepared and whose original data is being read
+typedef struct defer_io_batch_s{
+    queue_sl_t queue_in_process;
+    blk_deferred_request_t* dio_copy_req;
+    int result;
+}defer_io_batch_t;
+
+static void _defer_io_batch_start( defer_io_worker_t* worker, defer_io_batch_t* batch )
 {
+    defer_io_t* defer_io = worker->defer_io;
 
-    queue_sl_t queue_in_process;
-    defer_io_t* defer_io = NULL;
+    batch->dio_copy_req = NULL;
+    do{
+        batch->result = _defer_io_copy_prepare( worker, &batch->queue_in_process, &batch->dio_copy_req );
+        if (batch->result != SUCCESS){
+            log_err_d( "Unable to process defer IO request: failed to prepare copy request", batch->result );
+            break;
+        }
+        if (NULL == batch->dio_copy_req)
+            break;//nothing to copy
 
-    //set_user_nice( current, -20 ); //MIN_NICE
+        batch->result = blk_deferred_request_read_original_submit( defer_io->original_blk_dev, batch->dio_copy_req );
+        if (batch->result != SUCCESS){
+            log_err_d( "Unable to process defer IO request: failed to read data to copy request. errno=", batch->result );
+            break;
+        }
+    } while (false);
+}
+
+static void _defer_io_batch_complete( defer_io_worker_t* worker, defer_io_batch_t* batch )
+{
+    defer_io_t* defer_io = worker->defer_io;
+    blk_deferred_request_t* dio_copy_req = batch->dio_copy_req;
+    int dio_copy_result = batch->result;
+
+    do{
+        if ((dio_copy_result != SUCCESS) || (NULL == dio_copy_req))
+            break;
+
+        dio_copy_result = blk_deferred_request_wait( dio_copy_req );
+        if (dio_copy_result != SUCCESS){
+            log_err_d( "Unable to process defer IO request: failed to read data to copy request. errno=", dio_copy_result );
+            break;
+        }
+        dio_copy_result = snapstore_device_store_submit( defer_io->snapstore_device, dio_copy_req );
+        if (dio_copy_result != SUCCESS){
+            log_err_d( "Unable to process defer IO request: failed to write data from copy request. errno=", dio_copy_result );
+            break;
+        }
+
+        // each bio is released as soon as the blocks it overwrites are stored
+        while (!queue_sl_empty( batch->queue_in_process )){
+            defer_io_request_part_t* part = (defer_io_request_part_t*)queue_sl_get_first( &batch->queue_in_process );
+
+            dio_copy_result = snapstore_device_store_wait_part( defer_io->snapstore_device, dio_copy_req, part->wait_sect );
+            if (dio_copy_result == SUCCESS)
+                dio_copy_result = _defer_io_part_complete_stored( defer_io, part );
+            else
+                _defer_io_part_complete( defer_io, part );
+            if (dio_copy_result != SUCCESS)
+                break;
+        }
+        if (dio_copy_result == -EDEADLK){
+            log_err( "Unable to process defer IO request: failed to write data from copy request in time" );
+            break;
+        }
+
+        dio_copy_result = snapstore_device_store_wait( defer_io->snapstore_device, dio_copy_req );
+        if (dio_copy_result != SUCCESS){
+            log_err_d( "Unable to process defer IO request: failed to write data from copy request. errno=", dio_copy_result );
+            break;
+        }
+
+        atomic64_add( dio_copy_req->sect_len, &defer_io->state_sectors_copy_read );
+        atomic64_add( dio_copy_req->sect_len, &worker->state_sectors_copy_read );
+        atomic64_inc( &worker->state_batches );
+
+        _defer_io_throttle_copied( defer_io, dio_copy_req->sect_len );
+    } while (false);
 
-    if (SUCCESS != queue_sl_init( &queue_in_process, sizeof( defer_io_original_request_t ) )){
-        log_err( "Failed to initialize queue for defer IO requests" );
-        return -EFAULT;
+    _defer_io_finish( defer_io, &batch->queue_in_process );
+
+    if (dio_copy_req){
+        if (dio_copy_result == -EDEADLK)
+            blk_deferred_request_deadlocked( dio_copy_req );
+        else
+            blk_deferred_request_free( dio_copy_req );
+        batch->dio_copy_req = NULL;
     }
+}
 
-    defer_io = defer_io_get_resource((defer_io_t*)p);
-    log_tr_format("Defer IO thread for original device [%d:%d] started", MAJOR(defer_io->original_dev_id), MINOR(defer_io->original_dev_id));
+// The batches are allocated before the thread is started: the stripes are queued to the worker anyway, so it should not fail
+static int _defer_io_worker_batches_create( defer_io_worker_t* worker, int depth )
+{
+    int inx;
 
-    while (!kthread_should_stop( ) || !queue_sl_empty( defer_io->dio_queue )){
+    worker->batches = dbg_kzalloc( depth * sizeof( defer_io_batch_t ), GFP_KERNEL );
+    if (NULL == worker->batches){
+        log_err( "Failed to allocate defer IO batches" );
+        return -ENOMEM;
+    }
+    for (inx = 0; inx < depth; ++inx){
+        if (SUCCESS != queue_sl_init( &worker->batches[inx].queue_in_process, sizeof( defer_io_request_part_t ) )){
+            log_err( "Failed to initialize queue for defer IO requests" );
+            return -EFAULT;
+        }
+    }
+    return SUCCESS;
+}
+
+static void _defer_io_worker_batches_free( defer_io_worker_t* worker, int depth )
+{
+    int inx;
 
-        if (queue_sl_empty( defer_io->dio_queue )){
-            int res = wait_event_interruptible_timeout( defer_io->queue_add_event, (!queue_sl_empty( defer_io->dio_queue )), VEEAMIMAGE_THROTTLE_TIMEOUT );
+    if (NULL == worker->batches)
+        return;
+
+    for (inx = 0; inx < depth; ++inx){
+        if (SUCCESS != queue_sl_done( &worker->batches[inx].queue_in_process ))
+            log_err( "Failed to free up queue for defer IO requests" );
+    }
+    dbg_kfree( worker->batches );
+    worker->batches = NULL;
+}
+
+int defer_io_work_thread( void* p )
+{
+    defer_io_worker_t* worker = (defer_io_worker_t*)p;
+    defer_io_t* defer_io = worker->defer_io;
+    defer_io_batch_t* batches = worker->batches;
+    int depth = defer_io->pipeline_depth;
+    int head = 0;
+    int outstanding = 0;
+
+    //set_user_nice( current, -20 ); //MIN_NICE
+
+    log_tr_format( "Defer IO thread #%d for original device [%d:%d] started", worker->id, MAJOR( defer_io->original_dev_id ), MINOR( defer_io->original_dev_id ) );
+
+    while (!kthread_should_stop( ) || !queue_sl_empty( worker->dio_queue ) || (outstanding > 0)){
+
+        if ((outstanding == 0) && queue_sl_empty( worker->dio_queue )){
+            int res = wait_event_interruptible_timeout( worker->queue_add_event, (!queue_sl_empty( worker->dio_queue )), VEEAMIMAGE_THROTTLE_TIMEOUT );
             if (-ERESTARTSYS == res){
                 log_err( "Signal received in defer IO thread. Waiting for completion with code ERESTARTSYS" );
             }
@@ -115,63 +444,44 @@ int defer_io_work_thread( void* p )
             }
         }
 
-        if (!queue_sl_empty( defer_io->dio_queue )){
-            int dio_copy_result = SUCCESS;
-            blk_deferred_request_t* dio_copy_req = NULL;
-
-
-            _snapstore_device_descr_read_lock( defer_io->snapstore_device );
-            do{
-                dio_copy_result = _defer_io_copy_prepare( defer_io, &queue_in_process, &dio_copy_req );
-                if (dio_copy_result != SUCCESS){
-                    log_err_d( "Unable to process defer IO request: failed to prepare copy request", dio_copy_result );
-                    break;
-                }
-                if (NULL == dio_copy_req)
-                    break;//nothing to copy
-
-                dio_copy_result = blk_deferred_request_read_original( defer_io->original_blk_dev, dio_copy_req );
-                if (dio_copy_result != SUCCESS){
-                    log_err_d( "Unable to process defer IO request: failed to read data to copy request. errno=", dio_copy_result );
-                    break;
-                }
-                dio_copy_result = snapstore_device_store( defer_io->snapstore_device, dio_copy_req );
-                if (dio_copy_result != SUCCESS){
-                    log_err_d( "Unable to process defer IO request: failed to write data from copy request. errno=", dio_copy_result );
-                    break;
-                }
-
-                atomic64_add( dio_copy_req->sect_len, &defer_io->state_sectors_copy_read );
-            } while (false);
-
-            _defer_io_finish( defer_io, &queue_in_process );
-
-            _snapstore_device_descr_read_unlock( defer_io->snapstore_device );
-
-            if (dio_copy_req){
-                if (dio_copy_result == -EDEADLK)
-                    blk_deferred_request_deadlocked( dio_copy_req );
-                else
-                    blk_deferred_request_free( dio_copy_req );
-            }
+        // the buffers are returned by the batches of other workers, so wait for them a little,
+        // after the timeout the buffers are allocated on demand
+        if ((outstanding == 0) && !queue_sl_empty( worker->dio_queue ) &&
+            !snapstore_device_is_corrupted( defer_io->snapstore_device ) && !_defer_io_pool_has_room( defer_io )){
+            blk_deferred_pool_t* pool = defer_io->snapstore_device->cow_pool;
+
+            atomic64_inc( &pool->state_wait );
+            wait_event_timeout( pool->waiter, _defer_io_pool_has_room( defer_io ), VEEAMIMAGE_THROTTLE_TIMEOUT );
         }
 
-        //wake up snapimage if defer io queue empty
-        if (queue_sl_empty( defer_io->dio_queue )){
+        // reading of the next batches is in flight while the oldest one is being stored
+        while ((outstanding < depth) && !queue_sl_empty( worker->dio_queue )){
+            // the buffers of the next batch are returned by the oldest one
+            if ((outstanding > 0) && !_defer_io_pool_has_room( defer_io ))
+                break;
+
+            _defer_io_batch_start( worker, &batches[(head + outstanding) % depth] );
+            ++outstanding;
+        }
+
+        if (outstanding > 0){
+            _defer_io_batch_complete( worker, &batches[head] );
+
+            head = (head + 1) % depth;
+            --outstanding;
+        }
+
+        //wake up snapimage if all defer io queues are empty
+        if (0 == atomic_read( &defer_io->queue_filling_count )){
             wake_up_interruptible( &defer_io->queue_throttle_waiter );
         }
     }
-    queue_sl_active( &defer_io->dio_queue, false );
+    queue_sl_active( &worker->dio_queue, false );
 
     //waiting for all sent request complete
-    _defer_io_finish( defer_io, &defer_io->dio_queue );
-
-    if (SUCCESS != queue_sl_done( &queue_in_process)){
-        log_err( "Failed to free up queue for defer IO requests" );
-    }
+    _defer_io_finish( defer_io, &worker->dio_queue );
 
-    log_tr_format( "Defer IO thread for original device [%d:%d] completed", MAJOR( defer_io->original_dev_id ), MINOR( defer_io->original_dev_id ) );
-    defer_io_put_resource(defer_io);
+    log_tr_format( "Defer IO thread #%d for original device [%d:%d] completed", worker->id, MAJOR( defer_io->original_dev_id ), MINOR( defer_io->original_dev_id ) );
     return SUCCESS;
 }
 
@@ -191,10 +501,20 @@ void _defer_io_destroy( void* this_resource )
         log_tr_format( "%lld MiB was processed", (processed >> (20-SECTOR512_SHIFT)) );
         log_tr_format( "%lld MiB was copied", (copyed >> (20 - SECTOR512_SHIFT)) );
     }
-    if (defer_io->dio_thread)
+
+    if (defer_io->workers){
+        int inx;
+
         defer_io_stop( defer_io );
 
-    queue_sl_done( &defer_io->dio_queue );
+        for (inx = 0; inx < defer_io->workers_count; ++inx){
+            queue_sl_done( &defer_io->workers[inx].dio_queue );
+            _defer_io_worker_batches_free( &defer_io->workers[inx], defer_io->pipeline_depth );
+        }
+
+        dbg_kfree( defer_io->workers );
+        defer_io->workers = NULL;
+    }
 
     if (defer_io->snapstore_device)
         snapstore_device_put_resource(defer_io->snapstore_device);
@@ -204,6 +524,23 @@ void _defer_io_destroy( void* this_resource )
 }
 
 
+// the parameters may be changed at runtime, so they are limited where they are used
+int defer_io_workers_count( void )
+{
+    int workers_count = min_t( int, get_cow_workers( ), min_t( int, num_online_cpus( ), DEFER_IO_WORKERS_MAX ) );
+    if (workers_count < 1)
+        workers_count = 1;
+    return workers_count;
+}
+
+int defer_io_pipeline_depth( void )
+{
+    int pipeline_depth = min_t( int, get_cow_pipeline_depth( ), DEFER_IO_PIPELINE_DEPTH_MAX );
+    if (pipeline_depth < 1)
+        pipeline_depth = 1;
+    return pipeline_depth;
+}
+
 int defer_io_create( dev_t dev_id, struct block_device* blk_dev, defer_io_t** pp_defer_io )
 {
     int res = SUCCESS;
@@ -217,11 +554,15 @@ int defer_io_create( dev_t dev_id, struct block_device* blk_dev, defer_io_t** pp
         return -ENOMEM;
 
     do{
+        int inx;
+
         atomic64_set( &defer_io->state_bios_received, 0 );
         atomic64_set( &defer_io->state_bios_processed, 0 );
         atomic64_set( &defer_io->state_sectors_received, 0 );
         atomic64_set( &defer_io->state_sectors_processed, 0 );
         atomic64_set( &defer_io->state_sectors_copy_read, 0 );
+        atomic64_set( &defer_io->state_sectors_passed, 0 );
+        atomic64_set( &defer_io->state_bios_bypassed, 0 );
 
         defer_io->original_dev_id = dev_id;
         defer_io->original_blk_dev = blk_dev;
@@ -236,31 +577,66 @@ int defer_io_create( dev_t dev_id, struct block_device* blk_dev, defer_io_t** pp
             defer_io->snapstore_device = snapstore_device_get_resource( snapstore_device );
         }
 
-
-        res = queue_sl_init( &defer_io->dio_queue, sizeof( defer_io_original_request_t ) );
-
-        init_waitqueue_head( &defer_io->queue_add_event );
-
         atomic_set( &defer_io->queue_filling_count, 0 );
 
         init_waitqueue_head( &defer_io->queue_throttle_waiter );
 
+        spin_lock_init( &defer_io->throttle_lock );
+        defer_io->throttle_credit = 0;
+        defer_io->throttle_jiffies = get_jiffies_64( );
+        atomic64_set( &defer_io->state_throttled, 0 );
+        atomic64_set( &defer_io->state_throttled_ms, 0 );
+
         shared_resource_init( &defer_io->sharing_header, defer_io, _defer_io_destroy );
 
-        //if (sprintf( thread_name, "%s%d:%d", "veeamdeferio", MAJOR( dev_id ), MINOR( dev_id ) ) >= DISK_NAME_LEN){
-        //    log_err_dev_t( "Failed to create defer IO processor. Cannot create thread name for device ", dev_id );
-        //    res = -EINVAL;
-        //    break;
-        //}
+        defer_io->workers_count = defer_io_workers_count( );
+        defer_io->pipeline_depth = defer_io_pipeline_depth( );
+
+        defer_io->workers = dbg_kzalloc( defer_io->workers_count * sizeof( defer_io_worker_t ), GFP_KERNEL );
+        if (defer_io->workers == NULL){
+            log_err( "Unable to create defer IO processor: failed to allocate workers" );
+            res = -ENOMEM;
+            break;
+        }
+
+        for (inx = 0; inx < defer_io->workers_count; ++inx){
+            defer_io_worker_t* worker = &defer_io->workers[inx];
+
+            worker->defer_io = defer_io;
+            worker->id = inx;
 
-        defer_io->dio_thread = kthread_create( defer_io_work_thread, (void *)defer_io, "veeamdeferio%d:%d", MAJOR( dev_id ), MINOR( dev_id ) );
-        if (IS_ERR( defer_io->dio_thread )) {
-            res = PTR_ERR( defer_io->dio_thread );
-            log_err_d( "Unable to create defer IO processor: failed to create thread. errno=", res );
+            init_waitqueue_head( &worker->queue_add_event );
+            queue_sl_init_pool( &worker->dio_queue, sizeof( defer_io_request_part_t ), g_defer_io_part_pool );
+
+            atomic64_set( &worker->state_batches, 0 );
+            atomic64_set( &worker->state_sectors_copy_read, 0 );
+        }
+
+        for (inx = 0; inx < defer_io->workers_count; ++inx){
+            res = _defer_io_worker_batches_create( &defer_io->workers[inx], defer_io->pipeline_depth );
+            if (res != SUCCESS)
+                break;
+        }
+        if (res != SUCCESS)
             break;
+
+        for (inx = 0; inx < defer_io->workers_count; ++inx){
+            defer_io_worker_t* worker = &defer_io->workers[inx];
+            struct task_struct* dio_thread;
+
+            dio_thread = kthread_create( defer_io_work_thread, (void *)worker, "veeamdeferio%d:%d/%d", MAJOR( dev_id ), MINOR( dev_id ), inx );
+            if (IS_ERR( dio_thread )) {
+                res = PTR_ERR( dio_thread );
+                log_err_d( "Unable to create defer IO processor: failed to create thread. errno=", res );
+                break;
+            }
+            worker->dio_thread = dio_thread;
+            wake_up_process( worker->dio_thread );
         }
-        wake_up_process( defer_io->dio_thread );
+        if (res != SUCCESS)
+            break;
 
+        log_tr_format( "Copy-on-write threads count %d, pipeline depth %d", defer_io->workers_count, defer_io->pipeline_depth );
     } while (false);
 
     if (res == SUCCESS){
@@ -281,51 +657,140 @@ int defer_io_create( dev_t dev_id, struct block_device* blk_dev, defer_io_t** pp
 int defer_io_stop( defer_io_t* defer_io )
 {
     int res = SUCCESS;
+    int inx;
 
     log_tr_dev_t( "Defer IO thread for the device stopped ", defer_io->original_dev_id );
-    if (defer_io->dio_thread != NULL){
-        struct task_struct* dio_thread = defer_io->dio_thread;
-        defer_io->dio_thread = NULL;
-
-        res = kthread_stop( dio_thread );//stopping and waiting.
-        if (res != SUCCESS){
-            log_err_d( "Failed to stop defer IO thread. errno=", res );
+    for (inx = 0; inx < defer_io->workers_count; ++inx){
+        defer_io_worker_t* worker = &defer_io->workers[inx];
+
+        if (worker->dio_thread != NULL){
+            struct task_struct* dio_thread = worker->dio_thread;
+            int status;
+            worker->dio_thread = NULL;
+
+            status = kthread_stop( dio_thread );//stopping and waiting.
+            if (status != SUCCESS){
+                log_err_d( "Failed to stop defer IO thread. errno=", status );
+                res = status;
+            }
         }
     }
     return res;
 }
 
+// The write, that overwrites only the already stored blocks, needs no copy-on-write,
+// so it is sent to the original device in the submitter context without queueing.
+bool defer_io_bypass_bio( defer_io_t* defer_io, struct bio *bio, sector_t sectStart, sector_t sectCount )
+{
+    range_t sect;
+
+    if (!blk_bio_is_write( bio ) || (sectCount == 0))
+        return false;
+
+    sect.ofs = sectStart;
+    sect.cnt = sectCount;
+    if (!snapstore_device_is_preserved( defer_io->snapstore_device, &sect ))
+        return false;
+
+    atomic64_inc( &defer_io->state_bios_bypassed );
+    atomic64_add( sectCount, &defer_io->state_sectors_passed );
+    return true;
+}
+
 int defer_io_redirect_bio( defer_io_t* defer_io, struct bio *bio, sector_t sectStart, sector_t sectCount, struct request_queue *q, make_request_fn* TargetMakeRequest_fn, void* tracker )
 {
-    defer_io_original_request_t* dio_orig_req;
+    int res = SUCCESS;
+    int queued_count = 0;
+    sector_t stripe_shift = _defer_io_stripe_shift( );
+    sector_t ofs = sectStart;
+    sector_t last = sectStart + sectCount;
+    defer_io_request_part_t* owner_part = NULL;
+    defer_io_original_request_t* orig_req = NULL;
 
     if (snapstore_device_is_corrupted( defer_io->snapstore_device ))
         return -ENODATA;
 
-    dio_orig_req = (defer_io_original_request_t*)queue_content_sl_new_opt( &defer_io->dio_queue, GFP_NOIO );
-    if (dio_orig_req == NULL)
-        return -ENOMEM;
+    // split request by stripes, so the same block is always copied by the same worker
+    do{
+        defer_io_worker_t* worker = _defer_io_worker_by_sector( defer_io, ofs );
+        sector_t stripe_last = ((ofs >> stripe_shift) + 1) << stripe_shift;
+        sector_t cnt = min_t( sector_t, stripe_last, last ) - ofs;
+        defer_io_request_part_t* part;
+        range_t stripe;
+
+        // the preserved stripes are not queued, so a large discard is copied
+        // only where the blocks are not stored yet
+        stripe.ofs = ofs;
+        stripe.cnt = cnt;
+        if (snapstore_device_is_preserved( defer_io->snapstore_device, &stripe )){
+            atomic64_add( cnt, &defer_io->state_sectors_passed );
+            ofs += cnt;
+            continue;
+        }
 
+        part = (defer_io_request_part_t*)queue_content_sl_new_opt( &worker->dio_queue, GFP_NOIO );
+        if (part == NULL){
+            res = -ENOMEM;
+            break;
+        }
 
-    //copy data from bio to dio write buffer
-    dio_orig_req->sect.ofs = sectStart;
-    dio_orig_req->sect.cnt = sectCount;
-    bio_get( dio_orig_req->bio = bio );
-    dio_orig_req->q = q;
-    dio_orig_req->make_rq_fn = TargetMakeRequest_fn;
-    dio_orig_req->tracker = (tracker_t*)tracker;
+        if (owner_part == NULL){
+            owner_part = part;
+            orig_req = &owner_part->own_req;
 
-    if (SUCCESS != queue_sl_push_back( &defer_io->dio_queue, &dio_orig_req->content )){
-        queue_content_sl_free( &dio_orig_req->content );
-        return -EFAULT;
+            //copy data from bio to dio write buffer
+            orig_req->sect.ofs = sectStart;
+            orig_req->sect.cnt = sectCount;
+            bio_get( orig_req->bio = bio );
+            orig_req->q = q;
+            orig_req->make_rq_fn = TargetMakeRequest_fn;
+            orig_req->tracker = (tracker_t*)tracker;
+
+            atomic_set( &orig_req->parts_count, 1 );
+        }
+
+        part->orig_req = orig_req;
+        part->sect.ofs = ofs;
+        part->sect.cnt = cnt;
+
+        atomic_inc( &orig_req->parts_count );
+        if (SUCCESS != queue_sl_push_back( &worker->dio_queue, &part->content )){
+            atomic_dec( &orig_req->parts_count );
+            if (part != owner_part)
+                queue_content_sl_free( &part->content );
+            res = -EFAULT;
+            break;
+        }
+        ++queued_count;
+
+        atomic_inc( &defer_io->queue_filling_count );
+
+        wake_up_interruptible( &worker->queue_add_event );
+
+        ofs += cnt;
+    } while (ofs < last);
+
+    if (queued_count == 0){
+        if (owner_part != NULL){
+            bio_put( bio );
+            queue_content_sl_free( &owner_part->content );
+        }
+        if (res == SUCCESS)
+            res = -EALREADY; // nothing to copy, the bio should be passed to the original device
+        return res;
+    }
+
+    if (res != SUCCESS){
+        // the rest of the request is written without copy-on-write, the snapshot cannot be trusted
+        log_err_d( "Failed to queue a part of the request for copy-on-write. errno=", res );
+        snapstore_device_set_corrupted( defer_io->snapstore_device, res );
     }
 
     atomic64_inc( &defer_io->state_bios_received );
     atomic64_add( sectCount, &defer_io->state_sectors_received );
 
-    atomic_inc( &defer_io->queue_filling_count );
-
-    wake_up_interruptible( &defer_io->queue_add_event );
+    // the bio is released by the last completed part
+    _defer_io_original_request_put( defer_io, orig_req );
 
     return SUCCESS;
 }
@@ -333,6 +798,7 @@ int defer_io_redirect_bio( defer_io_t* defer_io, struct bio *bio, sector_t sectS
 
 void defer_io_print_state( defer_io_t* defer_io )
 {
+    int inx;
     unsigned long received_mb;
     unsigned long processed_mb;
     unsigned long copy_read_mb;
@@ -343,14 +809,21 @@ void defer_io_print_state( defer_io_t* defer_io )
     log_tr_d( "requests in queue count=",
         atomic_read( &defer_io->queue_filling_count ) );
 
-    log_tr_format( "bios: received=%lld processed=%lld",
+    log_tr_format( "image throttling: delayed=%lld time=%lld ms credit=%lld sectors",
+        (long long int)atomic64_read( &defer_io->state_throttled ),
+        (long long int)atomic64_read( &defer_io->state_throttled_ms ),
+        (long long int)_defer_io_throttle_credit( defer_io ) );
+
+    log_tr_format( "bios: received=%lld processed=%lld bypassed=%lld",
         (long long int)atomic64_read( &defer_io->state_bios_received ),
-        (long long int)atomic64_read( &defer_io->state_bios_processed ) );
+        (long long int)atomic64_read( &defer_io->state_bios_processed ),
+        (long long int)atomic64_read( &defer_io->state_bios_bypassed ) );
 
-    log_tr_format( "sectors: received=%lld processed=%lld copy_read=%lld",
+    log_tr_format( "sectors: received=%lld processed=%lld copy_read=%lld passed=%lld",
         (long long int)atomic64_read( &defer_io->state_sectors_received ),
         (long long int)atomic64_read( &defer_io->state_sectors_processed ),
-        (long long int)atomic64_read( &defer_io->state_sectors_copy_read ) );
+        (long long int)atomic64_read( &defer_io->state_sectors_copy_read ),
+        (long long int)atomic64_read( &defer_io->state_sectors_passed ) );
 
     received_mb = (unsigned long)(atomic64_read( &defer_io->state_sectors_received ) >> (20 - SECTOR512_SHIFT));
     processed_mb = (unsigned long)(atomic64_read( &defer_io->state_sectors_processed ) >> (20 - SECTOR512_SHIFT));
@@ -361,7 +834,15 @@ void defer_io_print_state( defer_io_t* defer_io )
         processed_mb,
         copy_read_mb);
 
+    for (inx = 0; inx < defer_io->workers_count; ++inx){
+        defer_io_worker_t* worker = &defer_io->workers[inx];
+
+        log_tr_format( "worker #%d: in queue=%d batches=%lld copy_read=%ld MiB", inx,
+            queue_sl_length( worker->dio_queue ),
+            (long long int)atomic64_read( &worker->state_batches ),
+            (unsigned long)(atomic64_read( &worker->state_sectors_copy_read ) >> (20 - SECTOR512_SHIFT)) );
+    }
+
     if (defer_io->snapstore_device)
         snapstore_device_print_state( defer_io->snapstore_device );
 }
-
@@ -3,35 +3,67 @@
 #include "shared_resource.h"
 #include "snapstore_device.h"
 
-typedef struct defer_io_s
+struct defer_io_s;
+struct defer_io_batch_s;
+
+typedef struct defer_io_worker_s
 {
-    shared_resource_t sharing_header;
+    struct defer_io_s* defer_io;
+    int id;
+
+    struct task_struct* dio_thread;
+    struct defer_io_batch_s* batches; // pipeline_depth batches, allocated before the thread is started
 
     wait_queue_head_t queue_add_event;
+    queue_sl_t dio_queue; // parts of requests for the stripes of this worker
+
+    atomic64_t state_batches;
+    atomic64_t state_sectors_copy_read;
+}defer_io_worker_t;
+
+typedef struct defer_io_s
+{
+    shared_resource_t sharing_header;
 
     atomic_t queue_filling_count;
     wait_queue_head_t queue_throttle_waiter;
 
+    // the snapshot image reads spend the credit while the copy-on-write is queued,
+    // the credit is earned by the copied sectors and by the time for the minimum read bandwidth
+    spinlock_t throttle_lock;
+    s64 throttle_credit; // in sectors, negative while the last large read is paid off
+    u64 throttle_jiffies; // time of the last refill
+    atomic64_t state_throttled; // image requests, that were delayed
+    atomic64_t state_throttled_ms;
+
     dev_t original_dev_id;
     struct block_device*  original_blk_dev;
 
     snapstore_device_t* snapstore_device;
 
-    struct task_struct* dio_thread;
+    int workers_count;
+    defer_io_worker_t* workers;
+    int pipeline_depth; // batches in process by each worker
 
     void*  rangecopy_buff;
     size_t rangecopy_buff_size;
 
-    queue_sl_t dio_queue;
-
     atomic64_t state_bios_received;
     atomic64_t state_bios_processed;
     atomic64_t state_sectors_received;
     atomic64_t state_sectors_processed;
     atomic64_t state_sectors_copy_read;
+    atomic64_t state_sectors_passed; // writes to the already stored blocks, that were not delayed
+    atomic64_t state_bios_bypassed; // writes, that were not queued at all
 }defer_io_t;
 
 
+int defer_io_init( void );
+void defer_io_done( void );
+
+int defer_io_workers_count( void );
+int defer_io_pipeline_depth( void );
+
 int defer_io_create( dev_t dev_id, struct block_device* blk_dev, defer_io_t** pp_defer_io );
 int defer_io_stop( defer_io_t* defer_io );
 
@@ -44,6 +76,9 @@ static inline void defer_io_put_resource( defer_io_t* defer_io )
     shared_resource_put( &defer_io->sharing_header );
 }
 
+bool defer_io_bypass_bio( defer_io_t* defer_io, struct bio *bio, sector_t sectStart, sector_t sectCount );
+int defer_io_throttle( defer_io_t* defer_io, sector_t sect_cnt );
+
 int defer_io_redirect_bio( defer_io_t* defer_io, struct bio *bio, sector_t sectStart, sector_t sectCount, struct request_queue *q, make_request_fn* TargetMakeRequest_fn, void* tracker );
 
 void defer_io_print_state( defer_io_t* defer_io );
@@ -5,12 +5,18 @@
 #include "log_format.h"
 
 int queue_sl_init( queue_sl_t* queue, int content_size )
+{
+    return queue_sl_init_pool( queue, content_size, NULL );
+}
+
+int queue_sl_init_pool( queue_sl_t* queue, int content_size, mempool_t* pool )
 {
     INIT_LIST_HEAD( &queue->headList );
 
     spin_lock_init( &queue->lock );
 
     queue->content_size = content_size;
+    queue->pool = pool;
 
     atomic_set( &queue->in_queue_cnt, 0);
     atomic_set( &queue->alloc_cnt, 0 );
@@ -40,7 +46,15 @@ int queue_sl_done( queue_sl_t* queue )
 
 queue_content_sl_t* queue_content_sl_new_opt_append( queue_sl_t* queue, gfp_t gfp_opt, size_t append_size )
 {
-    queue_content_sl_t* content = dbg_kmalloc( queue->content_size + append_size, gfp_opt );
+    queue_content_sl_t* content;
+
+    if (queue->pool != NULL){
+        if (append_size != 0)
+            return NULL;
+        content = mempool_alloc( queue->pool, gfp_opt );
+    }
+    else
+        content = dbg_kmalloc( queue->content_size + append_size, gfp_opt );
 
     if (content){
         atomic_inc( &queue->alloc_cnt );
@@ -59,11 +73,16 @@ void queue_content_sl_free( queue_content_sl_t* content )
 {
     if (content){
         queue_sl_t* queue = content->queue;
+        mempool_t* pool = queue->pool;
 
         memset( content, 0xFF, queue->content_size );
+        // the queue may be released as soon as the counter is zero
         atomic_dec( &queue->alloc_cnt );
 
-        dbg_kfree( content );
+        if (pool != NULL)
+            mempool_free( content, pool );
+        else
+            dbg_kfree( content );
     }
 }
 
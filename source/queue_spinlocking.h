@@ -9,6 +9,8 @@ typedef struct queue_sl_s
     int content_size;
     atomic_t in_queue_cnt;
     atomic_t alloc_cnt;
+
+    mempool_t* pool; // if set, the content is allocated from the pool and cannot be appended
 }queue_sl_t;
 
 typedef struct queue_content_sl_s
@@ -19,6 +21,7 @@ typedef struct queue_content_sl_s
 
 
 int queue_sl_init( queue_sl_t* queue, int content_size );
+int queue_sl_init_pool( queue_sl_t* queue, int content_size, mempool_t* pool );
 int queue_sl_done( queue_sl_t* queue );
 
 queue_content_sl_t* queue_content_sl_new_opt_append( queue_sl_t* queue, gfp_t gfp_opt, size_t append_size );
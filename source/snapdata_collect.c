@@ -300,6 +300,10 @@ int snapdata_collect_Find( struct request_queue *q, struct bio *bio, snapdata_co
     int res = -ENODATA;
     content_sl_t* content = NULL;
     snapdata_collector_t* collector = NULL;
+
+    if (container_sl_empty( &SnapdataCollectors ))//do not touch the container lock on each write
+        return res;
+
     CONTAINER_SL_FOREACH_BEGIN( SnapdataCollectors, content )
     {
         collector = (snapdata_collector_t*)content;
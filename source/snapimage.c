@@ -14,6 +14,8 @@ static inline unsigned long int do_div_inline( unsigned long long int division,
 }
 
 #include "snapimage.h"
+#include "snapimage_ra.h"
+#include "snapimage_plan.h"
 #include "blk_util.h"
 #include "defer_io.h"
 #include "queue_spinlocking.h"
@@ -29,6 +31,12 @@ static bitmap_sync_t g_snapimage_minors;
 static container_t SnapImages;
 struct rw_semaphore snap_image_destroy_lock;
 
+// the reserve allows the image requests to be processed when the memory is low
+#define SNAPIMAGE_RQ_POOL_MIN 64
+
+static struct kmem_cache* g_snapimage_rq_cache = NULL;
+static mempool_t* g_snapimage_rq_pool = NULL;
+
 #ifdef SNAPIMAGE_TRACER
 
 typedef struct trace_page_s
@@ -43,6 +51,18 @@ typedef struct trace_page_s
 #define TRACE_RECORDS_PER_PAGE ((PAGE_SIZE - offsetof(trace_page_t, records)) / sizeof(trace_record_t))
 #endif
 
+struct snapimage_s;
+
+// the requests are dispatched to the worker of the submitting CPU
+typedef struct snapimage_worker_s{
+    struct snapimage_s* image;
+    int id;
+
+    struct task_struct* rq_processor;
+    queue_sl_t rq_proc_queue;
+    wait_queue_head_t rq_proc_event;
+}snapimage_worker_t;
+
 typedef struct snapimage_s{
     content_t content;
 
@@ -60,23 +80,25 @@ typedef struct snapimage_s{
 
     atomic_t own_cnt;
 
-    queue_sl_t rq_proc_queue;
-
-    struct task_struct* rq_processor;
+    int workers_count;
+    snapimage_worker_t* workers;
 
-    wait_queue_head_t rq_proc_event;
     wait_queue_head_t rq_complete_event;
 
     atomic64_t state_received;
 
     atomic64_t state_inprocess;
     atomic64_t state_processed;
+    atomic64_t state_inline; // reads processed in the context of the caller
 
     volatile sector_t last_read_sector;
     volatile sector_t last_read_size;
     volatile sector_t last_write_sector;
     volatile sector_t last_write_size;
 
+    snapimage_ra_t ra;
+    snapimage_plan_stat_t plan_stat;
+
     struct mutex open_locker;
     struct block_device* open_bdev;
     volatile size_t open_cnt;
@@ -389,6 +411,24 @@ int _snapimage_ioctl( struct block_device *bdev, fmode_t mode, unsigned cmd, uns
                 res = -EINVAL;
         }
         break;
+        case IOCTL_IMAGE_READ_PLAN:
+        {
+            struct ioctl_image_read_plan_s param;
+
+            if (0 != copy_from_user( &param, (void*)arg, sizeof( struct ioctl_image_read_plan_s ) )){
+                log_err( "Unable to read plan: invalid user buffer" );
+                res = -EINVAL;
+                break;
+            }
+            res = snapimage_plan_read( image->defer_io, image->capacity, &param, &image->plan_stat );
+            if (res == SUCCESS){
+                if (0 != copy_to_user( (void*)arg, &param, sizeof( struct ioctl_image_read_plan_s ) )){
+                    log_err( "Unable to read plan: invalid user buffer" );
+                    res = -ENODATA;
+                }
+            }
+        }
+        break;
 #ifdef SNAPIMAGE_TRACER
         case IOCTL_IMAGE_TRACE_READ:
         {
@@ -457,12 +497,29 @@ static struct block_device_operations g_snapimage_ops = {
     //.swap_slot_free_notify = NULL
 };
 
-int _snapimage_request_read( defer_io_t* p_defer_io, blk_redirect_bio_endio_t* rq_endio )
+int _snapimage_request_read( snapimage_t* image, blk_redirect_bio_endio_t* rq_endio, bool nowait )
 {
     int res = -ENODATA;
+    sector_t ofs = bio_bi_sector( rq_endio->bio );
+    sector_t cnt = sector_from_uint( bio_bi_size( rq_endio->bio ) );
+    bool hit = snapimage_ra_read( &image->ra, rq_endio->bio );
 
-    res = snapstore_device_read( p_defer_io->snapstore_device, rq_endio );
+    if (hit){
+        blk_redirect_complete( rq_endio, SUCCESS );
+        res = SUCCESS;
+    }
+    else
+        res = snapstore_device_read( image->defer_io->snapstore_device, rq_endio, nowait );
+
+    if (res == SUCCESS){
+        image->last_read_sector = ofs;
+        image->last_read_size = cnt;
 
+        snapimage_ra_update( &image->ra, ofs, cnt, hit );
+    }
+    else if (res != -EAGAIN){
+        log_err_d( "Failed to read data from snapshot image. errno=", res );
+    }
     return res;
 }
 
@@ -509,31 +566,29 @@ int _snapimage_request_write( snapimage_t * image, blk_redirect_bio_endio_t* rq_
     return res;
 }
 
-void _snapimage_processing( snapimage_t * image )
+void _snapimage_processing( snapimage_worker_t* worker )
 {
     int res = SUCCESS;
+    snapimage_t* image = worker->image;
     blk_redirect_bio_endio_t* rq_endio;
 
     atomic64_inc( &image->state_inprocess );
-    rq_endio = (blk_redirect_bio_endio_t*)queue_sl_get_first( &image->rq_proc_queue );
+    rq_endio = (blk_redirect_bio_endio_t*)queue_sl_get_first( &worker->rq_proc_queue );
 
 #ifdef SNAPIMAGE_TRACER
     image_trace_add(image, bio_bi_sector(rq_endio->bio), bio_bi_size(rq_endio->bio), bio_data_dir(rq_endio->bio));
 #endif
 
     if (bio_data_dir( rq_endio->bio ) == READ){
-        image->last_read_sector = bio_bi_sector( rq_endio->bio );
-        image->last_read_size =  sector_from_uint( bio_bi_size( rq_endio->bio ) );
-
-        res = _snapimage_request_read( image->defer_io, rq_endio );
-        if (res != SUCCESS){
-            log_err_d( "Failed to read data from snapshot image. errno=", res );
-        }
+        res = _snapimage_request_read( image, rq_endio, false );
     }
     else{
         image->last_write_sector = bio_bi_sector( rq_endio->bio );
         image->last_write_size = sector_from_uint( bio_bi_size( rq_endio->bio ) );
 
+        // the readahead is suspended until the write is completed
+        snapimage_ra_write_begin( &image->ra, image->last_write_sector, image->last_write_size );
+
         res = _snapimage_request_write( image, rq_endio );
         if (res != SUCCESS){
             log_err_d( "Failed to write data to snapshot image. errno=", res );
@@ -545,12 +600,12 @@ void _snapimage_processing( snapimage_t * image )
 }
 
 
-int snapimage_processor_waiting( snapimage_t *image )
+int snapimage_processor_waiting( snapimage_worker_t* worker )
 {
     int res = SUCCESS;
 
-    if (queue_sl_empty( image->rq_proc_queue )){
-        res = wait_event_interruptible_timeout( image->rq_proc_event, (!queue_sl_empty( image->rq_proc_queue ) || kthread_should_stop( )), 5 * HZ );
+    if (queue_sl_empty( worker->rq_proc_queue )){
+        res = wait_event_interruptible_timeout( worker->rq_proc_event, (!queue_sl_empty( worker->rq_proc_queue ) || kthread_should_stop( )), 5 * HZ );
         if (res > 0){
             res = SUCCESS;
         }
@@ -562,24 +617,26 @@ int snapimage_processor_waiting( snapimage_t *image )
 }
 
 
+// The first worker adds and deletes the disk
 int snapimage_processor_thread( void *data )
 {
+    snapimage_worker_t* worker = data;
+    snapimage_t *image = worker->image;
 
-    snapimage_t *image = data;
-    
-    log_tr_format( "Snapshot image thread for device [%d:%d] start", MAJOR( image->image_dev ), MINOR( image->image_dev ) );
+    log_tr_format( "Snapshot image thread #%d for device [%d:%d] start", worker->id, MAJOR( image->image_dev ), MINOR( image->image_dev ) );
 
-    add_disk( image->disk );
+    if (worker->id == 0)
+        add_disk( image->disk );
 
     //priority
     set_user_nice( current, -20 ); //MIN_NICE
 
     while ( !kthread_should_stop( ) )
     {
-        int res = snapimage_processor_waiting( image );
+        int res = snapimage_processor_waiting( worker );
         if (res == SUCCESS){
-            if (!queue_sl_empty( image->rq_proc_queue ))
-                _snapimage_processing( image );
+            if (!queue_sl_empty( worker->rq_proc_queue ))
+                _snapimage_processing( worker );
         } else if (res == -ETIME){
             //Nobody read me
         }
@@ -589,17 +646,30 @@ int snapimage_processor_thread( void *data )
         }
         schedule( );
     }
-    log_tr( "Snapshot image disk delete" );
-    del_gendisk( image->disk );
+    if (worker->id == 0){
+        log_tr( "Snapshot image disk delete" );
+        del_gendisk( image->disk );
+    }
 
-    while (!queue_sl_empty( image->rq_proc_queue ))
-        _snapimage_processing( image );
+    while (!queue_sl_empty( worker->rq_proc_queue ))
+        _snapimage_processing( worker );
 
-    log_tr_format( "Snapshot image thread for device [%d:%d] complete", MAJOR( image->image_dev ), MINOR( image->image_dev ) );
+    log_tr_format( "Snapshot image thread #%d for device [%d:%d] complete", worker->id, MAJOR( image->image_dev ), MINOR( image->image_dev ) );
     return 0;
 }
 
 
+static bool _snapimage_unactive( snapimage_t* image )
+{
+    int inx;
+
+    for (inx = 0; inx < image->workers_count; ++inx){
+        if (!queue_sl_unactive( image->workers[inx].rq_proc_queue ))
+            return false;
+    }
+    return true;
+}
+
 static inline void _snapimage_bio_complete( struct bio* bio, int err )
 {
     blk_bio_end( bio, err );
@@ -613,9 +683,12 @@ void _snapimage_bio_complete_cb( void* complete_param, struct bio* bio, int err
 
     atomic64_inc( &image->state_processed );
 
+    if (bio_data_dir( bio ) == WRITE)
+        snapimage_ra_write_end( &image->ra );
+
     _snapimage_bio_complete( bio, err );
 
-    if (queue_sl_unactive( image->rq_proc_queue )){
+    if (_snapimage_unactive( image )){
         wake_up_interruptible( &image->rq_complete_event );
     }
 
@@ -623,12 +696,6 @@ void _snapimage_bio_complete_cb( void* complete_param, struct bio* bio, int err
 }
 
 
-int _snapimage_throttling( defer_io_t* defer_io )
-{
-    //wait_event_interruptible_timeout( defer_io->queue_throttle_waiter, (0 == atomic_read( &defer_io->queue_filling_count )), VEEAMIMAGE_THROTTLE_TIMEOUT );
-    return wait_event_interruptible( defer_io->queue_throttle_waiter, queue_sl_empty( defer_io->dio_queue ) );
-}
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION( 4, 4, 0 )
 
 #ifdef HAVE_MAKE_REQUEST_INT
@@ -678,8 +745,9 @@ blk_qc_t _snapimage_make_request(struct request_queue *q, struct bio *bio)
     atomic_inc( &image->own_cnt );
     do{
         blk_redirect_bio_endio_t* rq_endio;
+        snapimage_worker_t* worker = &image->workers[raw_smp_processor_id( ) % image->workers_count];
 
-        if (false == atomic_read( &(image->rq_proc_queue.active_state) )){
+        if (false == atomic_read( &(worker->rq_proc_queue.active_state) )){
             _snapimage_bio_complete( bio, -ENODEV );
             break;
         }
@@ -690,7 +758,7 @@ blk_qc_t _snapimage_make_request(struct request_queue *q, struct bio *bio)
         }
 
         {
-            int res = _snapimage_throttling( image->defer_io );
+            int res = defer_io_throttle( image->defer_io, sector_from_size( bio_bi_size( bio ) ) );
             if (SUCCESS != res){
                 log_err_d( "Failed to throttle snapshot image device. errno=", res );
                 _snapimage_bio_complete( bio, res );
@@ -698,7 +766,7 @@ blk_qc_t _snapimage_make_request(struct request_queue *q, struct bio *bio)
             }
         }
 
-        rq_endio = (blk_redirect_bio_endio_t*)queue_content_sl_new_opt( &image->rq_proc_queue, GFP_NOIO );
+        rq_endio = (blk_redirect_bio_endio_t*)queue_content_sl_new_opt( &worker->rq_proc_queue, GFP_NOIO );
         if (NULL == rq_endio){
 			log_err("Unable to make snapshot image request: failed to allocate redirect bio structure");
             _snapimage_bio_complete( bio, -ENOMEM );
@@ -716,14 +784,27 @@ blk_qc_t _snapimage_make_request(struct request_queue *q, struct bio *bio)
 
         atomic64_inc( &image->state_received );
 
-        if (SUCCESS == queue_sl_push_back( &image->rq_proc_queue, &rq_endio->content )){
-            wake_up( &image->rq_proc_event );
+        // the read is planned and submitted by the caller, if it does not need to wait,
+        // so the most of the backup reads need no context switch to the worker
+        if (get_snapimage_inline_read( ) && (bio_data_dir( bio ) == READ)){
+            int res = _snapimage_request_read( image, rq_endio, true );
+            if (res != -EAGAIN){
+                atomic64_inc( &image->state_inprocess );
+                atomic64_inc( &image->state_inline );
+                if (res != SUCCESS)
+                    blk_redirect_complete( rq_endio, res );
+                break;
+            }
+        }
+
+        if (SUCCESS == queue_sl_push_back( &worker->rq_proc_queue, &rq_endio->content )){
+            wake_up( &worker->rq_proc_event );
         }
         else{
             queue_content_sl_free( &rq_endio->content );
             _snapimage_bio_complete( bio, -EIO );
 
-            if (queue_sl_unactive( image->rq_proc_queue )){
+            if (_snapimage_unactive( image )){
                 wake_up_interruptible( &image->rq_complete_event );
             }
         }
@@ -760,6 +841,8 @@ int snapimage_create( dev_t original_dev )
     snapimage_t* image = NULL;
     struct gendisk *disk = NULL;
     int minor;
+    int workers_count;
+    int readahead_kb;
     blk_dev_info_t original_dev_info;
 
     log_tr_dev_t( "Create snapshot image for device ", original_dev );
@@ -787,16 +870,28 @@ int snapimage_create( dev_t original_dev )
     }
 
     do{
+        // the parameter may be changed at runtime, so it is limited here too
+        readahead_kb = min_t( int, get_snapimage_readahead_kb( ), SNAPIMAGE_READAHEAD_KB_MAX );
+        if (readahead_kb < 0)
+            readahead_kb = 0;
+        res = snapimage_ra_init( &image->ra, defer_io->snapstore_device, original_dev_info.count_sect,
+            (sector_t)readahead_kb << (10 - SECTOR512_SHIFT) );
+        if (res != SUCCESS)
+            break;
+
         minor = bitmap_sync_find_clear_and_set( &g_snapimage_minors );
         if (minor < SUCCESS){
             log_err_d( "Failed to allocate minor for snapshot image device. errno=", 0-minor );
             break;
         }
 
-        image->rq_processor = NULL;
+        image->workers_count = 0;
+        image->workers = NULL;
         atomic64_set( &image->state_received, 0 );
         atomic64_set( &image->state_inprocess, 0 );
         atomic64_set( &image->state_processed, 0 );
+        atomic64_set( &image->state_inline, 0 );
+        snapimage_plan_stat_init( &image->plan_stat );
 
         image->capacity = original_dev_info.count_sect;
 
@@ -880,26 +975,51 @@ int snapimage_create( dev_t original_dev )
         set_capacity( disk, image->capacity );
         log_tr_format( "Snapshot image device capacity %lld bytes", sector_to_streamsize(image->capacity) );
 
-        //res = -ENOMEM;
-        res = queue_sl_init( &image->rq_proc_queue, sizeof( blk_redirect_bio_endio_t ) );
-        if (res != SUCCESS){
-            log_err_d( "Failed to initialize request processing queue for snapshot image device. errno=", res );
+        init_waitqueue_head( &image->rq_complete_event );
+
+        workers_count = min_t( int, get_snapimage_workers( ), min_t( int, num_online_cpus( ), SNAPIMAGE_WORKERS_MAX ) );
+        if (workers_count < 1)
+            workers_count = 1;
+        image->workers = dbg_kzalloc( workers_count * sizeof( snapimage_worker_t ), GFP_KERNEL );
+        if (image->workers == NULL){
+            log_err( "Failed to allocate request processing workers for snapshot image device" );
+            res = -ENOMEM;
             break;
         }
+        while (image->workers_count < workers_count){
+            snapimage_worker_t* worker = &image->workers[image->workers_count];
+            struct task_struct* task;
 
-        {
-            struct task_struct* task = kthread_create( snapimage_processor_thread, image, disk->disk_name );
+            worker->image = image;
+            worker->id = image->workers_count;
+            init_waitqueue_head( &worker->rq_proc_event );
+
+            res = queue_sl_init_pool( &worker->rq_proc_queue, sizeof( blk_redirect_bio_endio_t ), g_snapimage_rq_pool );
+            if (res != SUCCESS){
+                log_err_d( "Failed to initialize request processing queue for snapshot image device. errno=", res );
+                break;
+            }
+
+            task = kthread_create( snapimage_processor_thread, worker, "%s/%d", disk->disk_name, worker->id );
             if (IS_ERR( task )) {
                 res = PTR_ERR( task );
                 log_err_d( "Failed to create request processing thread for snapshot image device. errno=", res );
+                queue_sl_done( &worker->rq_proc_queue );
                 break;
             }
-            image->rq_processor = task;
+            worker->rq_processor = task;
+            ++image->workers_count;
         }
-        init_waitqueue_head( &image->rq_complete_event );
+        if (res != SUCCESS)
+            break;
+        log_tr_format( "Snapshot image requests are processed by %d threads", image->workers_count );
+
+        {
+            int inx;
 
-        init_waitqueue_head( &image->rq_proc_event );
-        wake_up_process( image->rq_processor );
+            for (inx = 0; inx < image->workers_count; ++inx)
+                wake_up_process( image->workers[inx].rq_processor );
+        }
 
         //log_tr_p( "disk=", disk );
 
@@ -924,41 +1044,55 @@ int snapimage_create( dev_t original_dev )
 
 void _snapimage_stop( snapimage_t* image )
 {
-    if (image->rq_processor != NULL){
-        if (queue_sl_active( &image->rq_proc_queue, false )){
-            struct request_queue* q = image->queue;
+    int inx;
+    bool was_active = false;
+
+    if (image->workers_count == 0)
+        return;
+
+    for (inx = 0; inx < image->workers_count; ++inx){
+        if (queue_sl_active( &image->workers[inx].rq_proc_queue, false ))
+            was_active = true;
+    }
+
+    if (was_active){
+        struct request_queue* q = image->queue;
 
-            log_tr( "Snapshot image request processing stop" );
+        log_tr( "Snapshot image request processing stop" );
 
-            if (!blk_queue_stopped( q )){
-                blk_sync_queue(q);
+        if (!blk_queue_stopped( q )){
+            blk_sync_queue(q);
 #ifdef VEEAMSNAP_MQ_IO
-                blk_mq_stop_hw_queues(q);
+            blk_mq_stop_hw_queues(q);
 #else
-                {
-                    unsigned long flags;
-                    spin_lock_irqsave(q->queue_lock, flags);
-                    blk_stop_queue(q);
-                    spin_unlock_irqrestore(q->queue_lock, flags);
-                }
-#endif
+            {
+                unsigned long flags;
+                spin_lock_irqsave(q->queue_lock, flags);
+                blk_stop_queue(q);
+                spin_unlock_irqrestore(q->queue_lock, flags);
             }
+#endif
         }
+    }
 
-        log_tr( "Snapshot image thread stop" );
-        kthread_stop( image->rq_processor );
-        image->rq_processor = NULL;
+    log_tr( "Snapshot image thread stop" );
+    for (inx = 0; inx < image->workers_count; ++inx){
+        snapimage_worker_t* worker = &image->workers[inx];
 
-        while (!queue_sl_unactive( image->rq_proc_queue ))
-            wait_event_interruptible( image->rq_complete_event, queue_sl_unactive( image->rq_proc_queue ) );
+        if (worker->rq_processor != NULL){
+            kthread_stop( worker->rq_processor );
+            worker->rq_processor = NULL;
+        }
     }
+
+    while (!_snapimage_unactive( image ))
+        wait_event_interruptible( image->rq_complete_event, _snapimage_unactive( image ) );
 }
 
 
 int _snapimage_destroy( snapimage_t* image )
 {
-    if (image->rq_processor != NULL)
-        _snapimage_stop( image );
+    _snapimage_stop( image );
 
     if (image->queue) {
         log_tr( "Snapshot image queue cleanup" );
@@ -975,7 +1109,18 @@ int _snapimage_destroy( snapimage_t* image )
         disk->private_data = NULL;
         put_disk( disk );
     }
-    queue_sl_done( &image->rq_proc_queue );
+    if (image->workers != NULL){
+        int inx;
+
+        for (inx = 0; inx < image->workers_count; ++inx)
+            queue_sl_done( &image->workers[inx].rq_proc_queue );
+
+        dbg_kfree( image->workers );
+        image->workers = NULL;
+        image->workers_count = 0;
+    }
+
+    snapimage_ra_done( &image->ra );
 
     bitmap_sync_clear(&g_snapimage_minors, MINOR(image->image_dev));
 
@@ -1093,6 +1238,19 @@ int snapimage_init( void )
 
     init_rwsem(&snap_image_destroy_lock);
 
+    g_snapimage_rq_cache = kmem_cache_create( "veeamsnap_image_rq", sizeof( blk_redirect_bio_endio_t ), 0, 0, NULL );
+    if (g_snapimage_rq_cache == NULL){
+        log_err( "Unable to create kmem_cache for snapshot image requests" );
+        return -ENOMEM;
+    }
+    g_snapimage_rq_pool = mempool_create_slab_pool( SNAPIMAGE_RQ_POOL_MIN, g_snapimage_rq_cache );
+    if (g_snapimage_rq_pool == NULL){
+        log_err( "Unable to create mempool for snapshot image requests" );
+        kmem_cache_destroy( g_snapimage_rq_cache );
+        g_snapimage_rq_cache = NULL;
+        return -ENOMEM;
+    }
+
     res = register_blkdev( g_snapimage_major, VEEAM_SNAP_IMAGE );
     if (res >= SUCCESS){
         g_snapimage_major = res;
@@ -1147,6 +1305,15 @@ int snapimage_done( void )
 
         unregister_blkdev( g_snapimage_major, VEEAM_SNAP_IMAGE );
         log_tr_format( "Snapshot image block device [%d] was unregistered", g_snapimage_major );
+
+        if (g_snapimage_rq_pool != NULL){
+            mempool_destroy( g_snapimage_rq_pool );
+            g_snapimage_rq_pool = NULL;
+        }
+        if (g_snapimage_rq_cache != NULL){
+            kmem_cache_destroy( g_snapimage_rq_cache );
+            g_snapimage_rq_cache = NULL;
+        }
     }
     up_write(&snap_image_destroy_lock);
     return res;
@@ -1260,17 +1427,26 @@ void snapimage_print_state( void )
         snapimage_t* image = (snapimage_t*)pCnt;
         log_tr_p( "image: ", (void*)image );
         log_tr_dev_t( "original_dev: ", image->original_dev );
-        log_tr_format( "request: inprocess %lld, processed %lld",
+        log_tr_format( "request: inprocess %lld, processed %lld, inline %lld",
             (long long int)atomic64_read( &image->state_inprocess ),
-            (long long int)atomic64_read( &image->state_processed ) );
+            (long long int)atomic64_read( &image->state_processed ),
+            (long long int)atomic64_read( &image->state_inline ) );
         log_tr_d( "image owning counter: ", atomic_read( &image->own_cnt ) );
-        log_tr_d( "in queue: ", queue_sl_length( image->rq_proc_queue ) );
-        log_tr_d( "queue allocated: ", atomic_read( &image->rq_proc_queue.alloc_cnt ) );
+        {
+            int inx;
+
+            for (inx = 0; inx < image->workers_count; ++inx)
+                log_tr_format( "thread #%d: in queue %d, queue allocated %d", inx,
+                    queue_sl_length( image->workers[inx].rq_proc_queue ),
+                    atomic_read( &image->workers[inx].rq_proc_queue.alloc_cnt ) );
+        }
 
         log_tr_format( "last read: sector %lld, count %lld",
             (long long int)image->last_read_sector, (long long int)image->last_read_size );
         log_tr_format( "last write: sector %lld, count %lld",
             (long long int)image->last_write_sector, (long long int)image->last_write_size );
+        snapimage_ra_print_state( &image->ra );
+        snapimage_plan_stat_print( &image->plan_stat );
 
 #ifdef SNAPIMAGE_TRACER
         //__image_trace_log(image);
@@ -0,0 +1,332 @@
+#include "stdafx.h"
+#include "snapimage_plan.h"
+#include "blk_util.h"
+#include "blk_redirect.h"
+
+#define SECTION "snapimage "
+#include "log_format.h"
+
+#define SNAPIMAGE_PLAN_RANGES_MAX 1024 // the extents, which are read by one call
+#define SNAPIMAGE_PLAN_CHUNK_SHIFT (20 - SECTOR512_SHIFT) // 1 MiB is read by one bio
+#define SNAPIMAGE_PLAN_CHUNK_SECT (1 << SNAPIMAGE_PLAN_CHUNK_SHIFT)
+
+typedef struct snapimage_plan_chunk_s
+{
+    page_array_t* pages;
+
+    sector_t ofs;
+    sector_t cnt;
+    unsigned long long buffer_ofs;
+
+    int result;
+    struct completion complete; // the plan is not used by the callback after it
+}snapimage_plan_chunk_t;
+
+typedef struct snapimage_plan_s
+{
+    defer_io_t* defer_io;
+
+    queue_sl_t rq_queue;
+
+    int depth;
+    snapimage_plan_chunk_t chunks[0];
+}snapimage_plan_t;
+
+void snapimage_plan_stat_init( snapimage_plan_stat_t* stat )
+{
+    atomic64_set( &stat->calls, 0 );
+    atomic64_set( &stat->extents, 0 );
+    atomic64_set( &stat->runs, 0 );
+    atomic64_set( &stat->chunks, 0 );
+    atomic64_set( &stat->sectors, 0 );
+    atomic64_set( &stat->time_ms, 0 );
+}
+
+void snapimage_plan_stat_print( snapimage_plan_stat_t* stat )
+{
+    log_tr_format( "read plan: calls %lld, extents %lld, runs %lld, chunks %lld, sectors %lld, time %lld ms",
+        (long long int)atomic64_read( &stat->calls ),
+        (long long int)atomic64_read( &stat->extents ),
+        (long long int)atomic64_read( &stat->runs ),
+        (long long int)atomic64_read( &stat->chunks ),
+        (long long int)atomic64_read( &stat->sectors ),
+        (long long int)atomic64_read( &stat->time_ms ) );
+}
+
+static snapimage_plan_t* _snapimage_plan_create( defer_io_t* defer_io, int depth )
+{
+    int inx;
+    snapimage_plan_t* plan = dbg_kzalloc( sizeof( snapimage_plan_t ) + depth * sizeof( snapimage_plan_chunk_t ), GFP_KERNEL );
+    if (plan == NULL)
+        return NULL;
+
+    plan->defer_io = defer_io;
+    queue_sl_init( &plan->rq_queue, sizeof( blk_redirect_bio_endio_t ) );
+
+    for (inx = 0; inx < depth; ++inx){
+        snapimage_plan_chunk_t* chunk = &plan->chunks[inx];
+
+        chunk->pages = page_array_alloc( page_count_calc( sector_to_size( SNAPIMAGE_PLAN_CHUNK_SECT ) ), GFP_KERNEL );
+        if (chunk->pages == NULL){
+            // the plan is read with lower queue depth
+            if (inx == 0){
+                dbg_kfree( plan );
+                return NULL;
+            }
+            break;
+        }
+    }
+    plan->depth = inx;
+    return plan;
+}
+
+static void _snapimage_plan_destroy( snapimage_plan_t* plan )
+{
+    int inx;
+
+    // the requests are freed before their chunks complete, so normally nothing is left here
+    while (atomic_read( &plan->rq_queue.alloc_cnt ) != 0)
+        schedule_timeout_uninterruptible( 1 );
+
+    for (inx = 0; inx < plan->depth; ++inx)
+        page_array_free( plan->chunks[inx].pages );
+
+    queue_sl_done( &plan->rq_queue );
+    dbg_kfree( plan );
+}
+
+static void _snapimage_plan_complete_cb( void* complete_param, struct bio* bio, int err )
+{
+    snapimage_plan_chunk_t* chunk = (snapimage_plan_chunk_t*)complete_param;
+
+    chunk->result = err;
+    bio_put( bio );
+
+    complete( &chunk->complete );
+}
+
+// The chunk is read by the snapshot image read path, so the blocks are read from the original device
+// or from the snapstore, where they are. The error is returned by the chunk completion.
+static int _snapimage_plan_issue( snapimage_plan_t* plan, snapimage_plan_chunk_t* chunk )
+{
+    int res;
+    snapstore_device_t* snapstore_device = plan->defer_io->snapstore_device;
+    struct bio* bio;
+    blk_redirect_bio_endio_t* rq_endio;
+
+    res = defer_io_throttle( plan->defer_io, chunk->cnt );
+    if (res != SUCCESS)
+        return res;
+
+    bio = blk_redirect_page_array_bio( snapstore_device->orig_blk_dev, chunk->ofs, chunk->pages, chunk->cnt );
+    if (bio == NULL)
+        return -ENOMEM;
+    chunk->cnt = sector_from_uint( bio_bi_size( bio ) );
+
+    rq_endio = (blk_redirect_bio_endio_t*)queue_content_sl_new_opt( &plan->rq_queue, GFP_NOIO );
+    if (rq_endio == NULL){
+        bio_put( bio );
+        return -ENOMEM;
+    }
+    rq_endio->bio = bio;
+    rq_endio->complete_cb = _snapimage_plan_complete_cb;
+    rq_endio->complete_param = (void*)chunk;
+
+    chunk->result = SUCCESS;
+    init_completion( &chunk->complete );
+
+    res = snapstore_device_read( snapstore_device, rq_endio, false );
+    if (res != SUCCESS)
+        blk_redirect_complete( rq_endio, res );
+    return SUCCESS;
+}
+
+static int _snapimage_plan_wait( snapimage_plan_t* plan, snapimage_plan_chunk_t* chunk )
+{
+    // the pages of the chunk are in use until the completion
+    wait_for_completion( &chunk->complete );
+    return chunk->result;
+}
+
+// The extents are checked, and the adjacent extents, which are fit in the buffer, are merged into the runs in place.
+static int _snapimage_plan_prepare( page_array_t* ranges, unsigned int range_count, sector_t capacity, unsigned long long buffer_size,
+    unsigned int* p_completed_count, unsigned long long* p_completed_size, size_t* p_run_count )
+{
+    unsigned int inx;
+    size_t run_count = 0;
+    unsigned long long completed_size = 0;
+    unsigned long long prev_right = 0;
+    struct ioctl_range_s* run = NULL;
+
+    for (inx = 0; inx < range_count; ++inx){
+        struct ioctl_range_s* range = (struct ioctl_range_s*)page_get_element( ranges, inx, sizeof( struct ioctl_range_s ) );
+        unsigned long long left = range->left;
+        unsigned long long right = range->right;
+
+        if ((left >= right) || (left & (SECTOR512 - 1)) || (right & (SECTOR512 - 1)) ||
+            (right > sector_to_streamsize( capacity )) || (left < prev_right)){
+            log_err_format( "Unable to read plan: invalid extent #%d [%lld - %lld)", inx, left, right );
+            return -EINVAL;
+        }
+        prev_right = right;
+
+        if ((completed_size + (right - left)) > buffer_size)
+            break;
+        completed_size += (right - left);
+
+        if ((run != NULL) && (run->right == left))
+            run->right = right;
+        else{
+            run = (struct ioctl_range_s*)page_get_element( ranges, run_count, sizeof( struct ioctl_range_s ) );
+            run->left = left;
+            run->right = right;
+            ++run_count;
+        }
+    }
+
+    *p_completed_count = inx;
+    *p_completed_size = completed_size;
+    *p_run_count = run_count;
+    return SUCCESS;
+}
+
+// The runs are split into the chunks, and up to the depth chunks are read at once.
+// The chunks are copied to the user buffer in order of the plan.
+static int _snapimage_plan_process( snapimage_plan_t* plan, page_array_t* ranges, size_t run_count, void __user* buffer, snapimage_plan_stat_t* stat )
+{
+    int res = SUCCESS;
+    size_t run_inx = 0;
+    sector_t run_ofs = 0;
+    unsigned long long buffer_ofs = 0;
+    int issued = 0;
+    int copied = 0;
+
+    while (true){
+        snapimage_plan_chunk_t* chunk;
+        int result;
+
+        while ((res == SUCCESS) && (run_inx < run_count) && ((issued - copied) < plan->depth)){
+            struct ioctl_range_s* run = (struct ioctl_range_s*)page_get_element( ranges, run_inx, sizeof( struct ioctl_range_s ) );
+            sector_t run_start = sector_from_streamsize( run->left );
+            sector_t run_cnt = sector_from_streamsize( run->right ) - run_start;
+
+            chunk = &plan->chunks[issued % plan->depth];
+            chunk->ofs = run_start + run_ofs;
+            chunk->cnt = min_t( sector_t, SNAPIMAGE_PLAN_CHUNK_SECT, run_cnt - run_ofs );
+            chunk->buffer_ofs = buffer_ofs;
+
+            res = _snapimage_plan_issue( plan, chunk );
+            if (res != SUCCESS)
+                break;
+            ++issued;
+            atomic64_inc( &stat->chunks );
+
+            buffer_ofs += sector_to_streamsize( chunk->cnt );
+            run_ofs += chunk->cnt;
+            if (run_ofs == run_cnt){
+                ++run_inx;
+                run_ofs = 0;
+            }
+        }
+
+        if (copied == issued)
+            break;
+
+        chunk = &plan->chunks[copied % plan->depth];
+        result = _snapimage_plan_wait( plan, chunk );
+        ++copied;
+
+        if (res != SUCCESS)
+            continue; // the chunks in flight are waited for
+        if (result != SUCCESS){
+            res = result;
+            log_err_format( "Unable to read plan: failed to read [%lld - %lld) sectors. errno=%d", (long long int)chunk->ofs, (long long int)(chunk->ofs + chunk->cnt), 0 - res );
+            continue;
+        }
+
+        if (sector_to_size( chunk->cnt ) != page_array_page2user( buffer + chunk->buffer_ofs, 0, chunk->pages, sector_to_size( chunk->cnt ) )){
+            log_err( "Unable to read plan: invalid user buffer" );
+            res = -EFAULT;
+            continue;
+        }
+        atomic64_add( chunk->cnt, &stat->sectors );
+    }
+    return res;
+}
+
+int snapimage_plan_read( defer_io_t* defer_io, sector_t capacity, struct ioctl_image_read_plan_s* param, snapimage_plan_stat_t* stat )
+{
+    int res = SUCCESS;
+    unsigned int range_count = min_t( unsigned int, param->range_count, SNAPIMAGE_PLAN_RANGES_MAX );
+    size_t ranges_buffer_size = sizeof( struct ioctl_range_s ) * range_count;
+    page_array_t* ranges = NULL;
+    snapimage_plan_t* plan = NULL;
+    size_t run_count = 0;
+    u64 start_jiffies = get_jiffies_64( );
+
+    param->completed_count = 0;
+    param->completed_size = 0;
+    if (range_count == 0)
+        return SUCCESS;
+
+    if (snapstore_device_is_corrupted( defer_io->snapstore_device ))
+        return -ENODATA;
+
+    ranges = page_array_alloc( page_count_calc( ranges_buffer_size ), GFP_KERNEL );
+    if (ranges == NULL){
+        log_err_format( "Unable to read plan: cannot allocate [%ld] bytes", ranges_buffer_size );
+        return -ENOMEM;
+    }
+
+    do{
+        unsigned int completed_count = 0;
+        unsigned long long completed_size = 0;
+        unsigned long long chunks_count;
+        int depth;
+
+        if (ranges_buffer_size != page_array_user2page( (void*)param->ranges, 0, ranges, ranges_buffer_size )){
+            log_err( "Unable to read plan: invalid user buffer for parameters" );
+            res = -ENODATA;
+            break;
+        }
+
+        res = _snapimage_plan_prepare( ranges, range_count, capacity, param->buffer_size, &completed_count, &completed_size, &run_count );
+        if (res != SUCCESS)
+            break;
+        if (completed_count == 0){
+            log_err_format( "Unable to read plan: buffer size %lld is too small for the first extent", param->buffer_size );
+            res = -ENOSPC;
+            break;
+        }
+
+        // no more buffers than the chunks of the plan, the parameter may be changed at runtime, so it is limited here too
+        chunks_count = (sector_from_streamsize( completed_size ) >> SNAPIMAGE_PLAN_CHUNK_SHIFT) + run_count;
+        depth = min_t( int, get_snapimage_plan_depth( ), SNAPIMAGE_PLAN_DEPTH_MAX );
+        if (depth < 1)
+            depth = 1;
+        plan = _snapimage_plan_create( defer_io, (int)min_t( unsigned long long, depth, chunks_count ) );
+        if (plan == NULL){
+            log_err( "Unable to read plan: failed to allocate buffers" );
+            res = -ENOMEM;
+            break;
+        }
+
+        res = _snapimage_plan_process( plan, ranges, run_count, param->buffer, stat );
+        if (res != SUCCESS)
+            break;
+
+        param->completed_count = completed_count;
+        param->completed_size = completed_size;
+
+        atomic64_add( completed_count, &stat->extents );
+    } while (false);
+
+    if (plan != NULL)
+        _snapimage_plan_destroy( plan );
+    page_array_free( ranges );
+
+    atomic64_inc( &stat->calls );
+    atomic64_add( run_count, &stat->runs );
+    atomic64_add( jiffies_to_msecs( get_jiffies_64( ) - start_jiffies ), &stat->time_ms );
+    return res;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "veeamsnap_ioctl.h"
+#include "defer_io.h"
+
+typedef struct snapimage_plan_stat_s
+{
+    atomic64_t calls;
+    atomic64_t extents;
+    atomic64_t runs; // the adjacent extents are merged into one run
+    atomic64_t chunks;
+    atomic64_t sectors;
+    atomic64_t time_ms;
+}snapimage_plan_stat_t;
+
+void snapimage_plan_stat_init( snapimage_plan_stat_t* stat );
+void snapimage_plan_stat_print( snapimage_plan_stat_t* stat );
+
+int snapimage_plan_read( defer_io_t* defer_io, sector_t capacity, struct ioctl_image_read_plan_s* param, snapimage_plan_stat_t* stat );
@@ -0,0 +1,403 @@
+#include "stdafx.h"
+#include "snapimage_ra.h"
+#include "blk_util.h"
+
+#define SECTION "snapimage "
+#include "log_format.h"
+
+// the reads in a row, after which the reader is considered sequential
+#define SNAPIMAGE_RA_SEQ_MIN 2
+
+int snapimage_ra_init( snapimage_ra_t* ra, snapstore_device_t* snapstore_device, sector_t capacity, sector_t window_sect )
+{
+    int res = SUCCESS;
+    int inx;
+
+    ra->snapstore_device = snapstore_device;
+    ra->capacity = capacity;
+    ra->window_sect = 0;
+
+    spin_lock_init( &ra->lock );
+    ra->stream_next = 0;
+    ra->stream_seq = 0;
+    ra->ra_next = 0;
+    ra->writes_in_flight = 0;
+
+    init_waitqueue_head( &ra->idle_waiter );
+
+    atomic64_set( &ra->state_hits, 0 );
+    atomic64_set( &ra->state_misses, 0 );
+    atomic64_set( &ra->state_loaded, 0 );
+    atomic64_set( &ra->state_loaded_sectors, 0 );
+    atomic64_set( &ra->state_dropped, 0 );
+
+    for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+        snapimage_ra_window_t* window = &ra->windows[inx];
+
+        window->ra = ra;
+        window->pages = NULL;
+        window->state = SNAPIMAGE_RA_EMPTY;
+        window->stale = false;
+        window->users = 0;
+        window->ofs = 0;
+        window->cnt = 0;
+    }
+
+    res = queue_sl_init( &ra->rq_queue, sizeof( blk_redirect_bio_endio_t ) );
+    if (res != SUCCESS){
+        log_err_d( "Failed to initialize readahead request queue. errno=", res );
+        return res;
+    }
+
+    if (window_sect == 0)
+        return SUCCESS;
+
+    for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+        ra->windows[inx].pages = page_array_alloc( page_count_calc( sector_to_size( window_sect ) ), GFP_KERNEL );
+        if (ra->windows[inx].pages == NULL){
+            // the image can be read without readahead
+            log_warn( "Failed to allocate readahead buffer. Snapshot image readahead is disabled" );
+            break;
+        }
+    }
+    if (inx < SNAPIMAGE_RA_WINDOWS){
+        for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+            if (ra->windows[inx].pages != NULL){
+                page_array_free( ra->windows[inx].pages );
+                ra->windows[inx].pages = NULL;
+            }
+        }
+        return SUCCESS;
+    }
+
+    ra->window_sect = window_sect;
+    return SUCCESS;
+}
+
+static bool _snapimage_ra_idle( snapimage_ra_t* ra )
+{
+    bool idle = true;
+    int inx;
+    unsigned long flags;
+
+    spin_lock_irqsave( &ra->lock, flags );
+    for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+        if ((ra->windows[inx].state == SNAPIMAGE_RA_LOADING) || (ra->windows[inx].users != 0))
+            idle = false;
+    }
+    // the request is freed before its window is completed
+    if (atomic_read( &ra->rq_queue.alloc_cnt ) != 0)
+        idle = false;
+    spin_unlock_irqrestore( &ra->lock, flags );
+    return idle;
+}
+
+// The image requests are already completed, the loading windows are waited for.
+// The waiter is woken under the lock, so ra is not used by the others after it is idle.
+void snapimage_ra_done( snapimage_ra_t* ra )
+{
+    int inx;
+
+    if (ra->window_sect != 0)
+        wait_event( ra->idle_waiter, _snapimage_ra_idle( ra ) );
+    ra->window_sect = 0;
+
+    for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+        if (ra->windows[inx].pages != NULL){
+            page_array_free( ra->windows[inx].pages );
+            ra->windows[inx].pages = NULL;
+        }
+    }
+    queue_sl_done( &ra->rq_queue );
+}
+
+static void _snapimage_ra_copy( snapimage_ra_window_t* window, struct bio* bio )
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+    struct bio_vec* bvec;
+    unsigned short iter;
+#else
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+#endif
+    size_t arr_ofs = sector_to_size( bio_bi_sector( bio ) - window->ofs );
+
+    bio_for_each_segment( bvec, bio, iter ){
+        void* mem = mem_kmap_atomic( bio_vec_page( bvec ) );
+
+        page_array_pages2mem( mem + bio_vec_offset( bvec ), arr_ofs, window->pages, bio_vec_len( bvec ) );
+        mem_kunmap_atomic( mem );
+
+        arr_ofs += bio_vec_len( bvec );
+    }
+}
+
+// true - the data was copied from the loaded window, and the bio can be completed
+bool snapimage_ra_read( snapimage_ra_t* ra, struct bio* bio )
+{
+    snapimage_ra_window_t* window = NULL;
+    sector_t ofs = bio_bi_sector( bio );
+    sector_t cnt = sector_from_size( bio_bi_size( bio ) );
+    unsigned long flags;
+    int inx;
+
+    if (ra->window_sect == 0)
+        return false;
+
+    spin_lock_irqsave( &ra->lock, flags );
+    for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+        snapimage_ra_window_t* wnd = &ra->windows[inx];
+
+        if ((wnd->state == SNAPIMAGE_RA_READY) && !wnd->stale && (ofs >= wnd->ofs) && ((ofs + cnt) <= (wnd->ofs + wnd->cnt))){
+            window = wnd;
+            ++window->users;
+            break;
+        }
+    }
+    spin_unlock_irqrestore( &ra->lock, flags );
+
+    if (window == NULL)
+        return false;
+
+    _snapimage_ra_copy( window, bio );
+
+    spin_lock_irqsave( &ra->lock, flags );
+    --window->users;
+    if ((window->users == 0) && window->stale){
+        // the image was written while the data was copied
+        window->state = SNAPIMAGE_RA_EMPTY;
+        window->stale = false;
+        atomic64_inc( &ra->state_dropped );
+    }
+    wake_up( &ra->idle_waiter );
+    spin_unlock_irqrestore( &ra->lock, flags );
+    return true;
+}
+
+static void _snapimage_ra_complete_cb( void* complete_param, struct bio* bio, int err )
+{
+    snapimage_ra_window_t* window = (snapimage_ra_window_t*)complete_param;
+    snapimage_ra_t* ra = window->ra;
+    unsigned long flags;
+
+    bio_put( bio );
+
+    spin_lock_irqsave( &ra->lock, flags );
+    if ((err == SUCCESS) && !window->stale){
+        window->state = SNAPIMAGE_RA_READY;
+        atomic64_inc( &ra->state_loaded );
+        atomic64_add( window->cnt, &ra->state_loaded_sectors );
+    }
+    else{
+        window->state = SNAPIMAGE_RA_EMPTY;
+        atomic64_inc( &ra->state_dropped );
+    }
+    window->stale = false;
+    wake_up( &ra->idle_waiter );
+    spin_unlock_irqrestore( &ra->lock, flags );
+}
+
+static void _snapimage_ra_load_cancel( snapimage_ra_window_t* window )
+{
+    snapimage_ra_t* ra = window->ra;
+    unsigned long flags;
+
+    spin_lock_irqsave( &ra->lock, flags );
+    // the next window is loaded from the same place
+    if (ra->ra_next == (window->ofs + window->cnt))
+        ra->ra_next = window->ofs;
+    window->state = SNAPIMAGE_RA_EMPTY;
+    window->stale = false;
+    atomic64_inc( &ra->state_dropped );
+    wake_up( &ra->idle_waiter );
+    spin_unlock_irqrestore( &ra->lock, flags );
+}
+
+// the window is read by the snapshot image read path into its own pages
+static void _snapimage_ra_load( snapimage_ra_window_t* window )
+{
+    int res = SUCCESS;
+    snapimage_ra_t* ra = window->ra;
+    struct bio* bio = NULL;
+    blk_redirect_bio_endio_t* rq_endio = NULL;
+
+    do{
+        bio = blk_redirect_page_array_bio( ra->snapstore_device->orig_blk_dev, window->ofs, window->pages, window->cnt );
+        if (bio == NULL){
+            res = -ENOMEM;
+            break;
+        }
+        if (sector_from_uint( bio_bi_size( bio ) ) < window->cnt){
+            unsigned long flags;
+
+            spin_lock_irqsave( &ra->lock, flags );
+            if (ra->ra_next == (window->ofs + window->cnt))
+                ra->ra_next = window->ofs + sector_from_uint( bio_bi_size( bio ) );
+            window->cnt = sector_from_uint( bio_bi_size( bio ) );
+            spin_unlock_irqrestore( &ra->lock, flags );
+        }
+
+        rq_endio = (blk_redirect_bio_endio_t*)queue_content_sl_new_opt( &ra->rq_queue, GFP_NOIO );
+        if (rq_endio == NULL){
+            res = -ENOMEM;
+            break;
+        }
+        rq_endio->bio = bio;
+        rq_endio->complete_cb = _snapimage_ra_complete_cb;
+        rq_endio->complete_param = (void*)window;
+
+        // the readahead never waits for the copy-on-write
+        res = snapstore_device_read( ra->snapstore_device, rq_endio, true );
+        if (res == -EAGAIN){
+            queue_content_sl_free( &rq_endio->content );
+            break;
+        }
+        // the window is completed by the callback, which drops it on error
+        if (res != SUCCESS)
+            blk_redirect_complete( rq_endio, res );
+        return;
+    } while (false);
+
+    if ((res != SUCCESS) && (res != -EAGAIN))
+        log_err_d( "Failed to load snapshot image readahead window. errno=", res );
+    if (bio != NULL)
+        bio_put( bio );
+    _snapimage_ra_load_cancel( window );
+}
+
+// The reader position is tracked, and the next window is loaded when the sequential reader comes close to the loaded data.
+// hit - the read was completed by snapimage_ra_read()
+void snapimage_ra_update( snapimage_ra_t* ra, sector_t ofs, sector_t cnt, bool hit )
+{
+    snapimage_ra_window_t* window = NULL;
+    sector_t rq_end = ofs + cnt;
+    unsigned long flags;
+    int inx;
+
+    if (ra->window_sect == 0)
+        return;
+
+    if (hit)
+        atomic64_inc( &ra->state_hits );
+    else
+        atomic64_inc( &ra->state_misses );
+
+    spin_lock_irqsave( &ra->lock, flags );
+    do{
+        if (ofs == ra->stream_next){
+            if (ra->stream_seq < SNAPIMAGE_RA_SEQ_MIN)
+                ++ra->stream_seq;
+        }
+        else{
+            ra->stream_seq = 0;
+            ra->ra_next = rq_end;
+        }
+        ra->stream_next = rq_end;
+
+        if ((ra->stream_seq < SNAPIMAGE_RA_SEQ_MIN) || (ra->writes_in_flight != 0))
+            break;
+
+        if (ra->ra_next < rq_end)
+            ra->ra_next = rq_end;
+        // the data, which is loaded already, is not loaded again
+        for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+            snapimage_ra_window_t* wnd = &ra->windows[inx];
+
+            if ((wnd->state != SNAPIMAGE_RA_EMPTY) && !wnd->stale &&
+                (wnd->ofs <= ra->ra_next) && (ra->ra_next < (wnd->ofs + wnd->cnt))){
+                ra->ra_next = wnd->ofs + wnd->cnt;
+                inx = -1;
+            }
+        }
+        // one window ahead of the reader is enough
+        if ((ra->ra_next - rq_end) >= ra->window_sect)
+            break;
+        if (ra->ra_next >= ra->capacity)
+            break;
+
+        // the empty window, or the window, which is out of the reader way
+        for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+            snapimage_ra_window_t* wnd = &ra->windows[inx];
+
+            if (wnd->users != 0)
+                continue;
+            if ((wnd->state == SNAPIMAGE_RA_EMPTY) ||
+                ((wnd->state == SNAPIMAGE_RA_READY) && (((wnd->ofs + wnd->cnt) <= ofs) || (wnd->ofs >= ra->ra_next)))){
+                window = wnd;
+                break;
+            }
+        }
+        if (window == NULL)
+            break;
+
+        window->state = SNAPIMAGE_RA_LOADING;
+        window->stale = false;
+        window->ofs = ra->ra_next;
+        window->cnt = min_t( sector_t, ra->window_sect, ra->capacity - ra->ra_next );
+        ra->ra_next += window->cnt;
+    } while (false);
+    spin_unlock_irqrestore( &ra->lock, flags );
+
+    if (window != NULL)
+        _snapimage_ra_load( window );
+}
+
+// The windows, which intersect the written range, are dropped, and no window is loaded until the write is completed.
+void snapimage_ra_write_begin( snapimage_ra_t* ra, sector_t ofs, sector_t cnt )
+{
+    unsigned long flags;
+    int inx;
+
+    if (ra->window_sect == 0)
+        return;
+
+    spin_lock_irqsave( &ra->lock, flags );
+    ++ra->writes_in_flight;
+    for (inx = 0; inx < SNAPIMAGE_RA_WINDOWS; ++inx){
+        snapimage_ra_window_t* wnd = &ra->windows[inx];
+
+        if (wnd->state == SNAPIMAGE_RA_EMPTY)
+            continue;
+        if (((ofs + cnt) <= wnd->ofs) || (ofs >= (wnd->ofs + wnd->cnt)))
+            continue;
+
+        if (wnd->state == SNAPIMAGE_RA_LOADING)
+            wnd->stale = true;
+        else if (wnd->users == 0){
+            wnd->state = SNAPIMAGE_RA_EMPTY;
+            atomic64_inc( &ra->state_dropped );
+        }
+        else
+            wnd->stale = true; // the window is dropped, when the copying reader releases it
+    }
+    // the stream restarts after the write
+    ra->stream_seq = 0;
+    spin_unlock_irqrestore( &ra->lock, flags );
+}
+
+void snapimage_ra_write_end( snapimage_ra_t* ra )
+{
+    unsigned long flags;
+
+    if (ra->window_sect == 0)
+        return;
+
+    spin_lock_irqsave( &ra->lock, flags );
+    --ra->writes_in_flight;
+    spin_unlock_irqrestore( &ra->lock, flags );
+}
+
+void snapimage_ra_print_state( snapimage_ra_t* ra )
+{
+    if (ra->window_sect == 0){
+        log_tr( "readahead: disabled" );
+        return;
+    }
+    log_tr_format( "readahead: window %lld sectors, hits %lld, misses %lld, loaded %lld windows %lld sectors, dropped %lld",
+        (long long int)ra->window_sect,
+        (long long int)atomic64_read( &ra->state_hits ),
+        (long long int)atomic64_read( &ra->state_misses ),
+        (long long int)atomic64_read( &ra->state_loaded ),
+        (long long int)atomic64_read( &ra->state_loaded_sectors ),
+        (long long int)atomic64_read( &ra->state_dropped ) );
+}
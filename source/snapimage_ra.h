@@ -0,0 +1,62 @@
+#pragma once
+#include "page_array.h"
+#include "queue_spinlocking.h"
+#include "blk_redirect.h"
+#include "snapstore_device.h"
+
+#define SNAPIMAGE_RA_WINDOWS 2 // the reader consumes one window, while the next one is loaded
+
+#define SNAPIMAGE_RA_EMPTY 0
+#define SNAPIMAGE_RA_LOADING 1
+#define SNAPIMAGE_RA_READY 2
+
+struct snapimage_ra_s;
+
+typedef struct snapimage_ra_window_s
+{
+    struct snapimage_ra_s* ra;
+    page_array_t* pages;
+
+    int state;
+    bool stale; // the image was written while the window was loading
+    int users; // readers, which copy the data from the window now
+    sector_t ofs;
+    sector_t cnt;
+}snapimage_ra_window_t;
+
+// Readahead of the snapshot image for the sequential reader.
+// The windows are read from the original device and from the snapstore ahead of the reader,
+// the reads, which are inside a loaded window, are completed by copying.
+typedef struct snapimage_ra_s
+{
+    snapstore_device_t* snapstore_device;
+    sector_t capacity;
+    sector_t window_sect; // 0 - the readahead is disabled
+
+    spinlock_t lock;
+    sector_t stream_next; // the sector, which the sequential reader should read next
+    int stream_seq; // the sequential reads in a row
+    sector_t ra_next; // the sector, from which the next window is loaded
+    int writes_in_flight;
+
+    snapimage_ra_window_t windows[SNAPIMAGE_RA_WINDOWS];
+    queue_sl_t rq_queue; // the window loading requests
+    wait_queue_head_t idle_waiter;
+
+    atomic64_t state_hits;
+    atomic64_t state_misses;
+    atomic64_t state_loaded;
+    atomic64_t state_loaded_sectors;
+    atomic64_t state_dropped;
+}snapimage_ra_t;
+
+int snapimage_ra_init( snapimage_ra_t* ra, snapstore_device_t* snapstore_device, sector_t capacity, sector_t window_sect );
+void snapimage_ra_done( snapimage_ra_t* ra );
+
+bool snapimage_ra_read( snapimage_ra_t* ra, struct bio* bio );
+void snapimage_ra_update( snapimage_ra_t* ra, sector_t ofs, sector_t cnt, bool hit );
+
+void snapimage_ra_write_begin( snapimage_ra_t* ra, sector_t ofs, sector_t cnt );
+void snapimage_ra_write_end( snapimage_ra_t* ra );
+
+void snapimage_ra_print_state( snapimage_ra_t* ra );
@@ -224,7 +224,7 @@ int snapshot_Create( dev_t* dev_id_set, unsigned int dev_id_set_size, unsigned i
         {
             dev_t dev_id = snapshot->dev_id_set[inx];
 
-            result = tracking_add(dev_id, cbt_block_size_degree, snapshot->id);
+            result = tracking_add(dev_id, cbt_block_size_degree, 0, snapshot->id);
             if (result == -EALREADY)
                 result = SUCCESS;
             else if (result != SUCCESS){
@@ -586,7 +586,7 @@ int snapstore_check_halffill( veeam_uuid_t* unique_id, sector_t* fill_status )
 }
 
 
-int snapstore_request_store( snapstore_t* snapstore, blk_deferred_request_t* dio_copy_req )
+int snapstore_request_store_submit( snapstore_t* snapstore, blk_deferred_request_t* dio_copy_req )
 {
     int res = SUCCESS;
 
@@ -602,19 +602,29 @@ int snapstore_request_store( snapstore_t* snapstore, blk_deferred_request_t* dio
     }
 
     if (snapstore->file)
-        res = blk_deferred_request_store_file( snapstore->file->blk_dev, dio_copy_req );
+        res = blk_deferred_request_store_file_submit( snapstore->file->blk_dev, dio_copy_req );
 #ifdef SNAPSTORE_MULTIDEV
     else if (snapstore->multidev)
-        res = blk_deferred_request_store_multidev( dio_copy_req );
+        res = blk_deferred_request_store_multidev_submit( dio_copy_req );
 #endif
     else if (snapstore->mem)
-        res = blk_deffered_request_store_mem( dio_copy_req );
+        res = blk_deffered_request_store_mem( dio_copy_req ); //completed synchronously
     else
         res = -EINVAL;
 
     return res;
 }
 
+int snapstore_request_store( snapstore_t* snapstore, blk_deferred_request_t* dio_copy_req )
+{
+    int res = snapstore_request_store_submit( snapstore, dio_copy_req );
+
+    if (res == SUCCESS)
+        res = blk_deferred_request_wait( dio_copy_req );
+
+    return res;
+}
+
 int snapstore_redirect_read( blk_redirect_bio_endio_t* rq_endio, snapstore_t* snapstore, blk_descr_unify_t* blk_descr_ptr, sector_t target_pos, sector_t rq_ofs, sector_t rq_count )
 {
     int res = SUCCESS;
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "snapstore_device.h"
 #include "snapstore.h"
+#include "defer_io.h"
 #include "blk_util.h"
 
 #define SECTION "snapstore "
@@ -8,15 +9,48 @@
 
 container_t SnapstoreDevices;
 
-static inline void _snapstore_device_descr_write_lock( snapstore_device_t* snapstore_device )
+static void _snapstore_device_descr_hold_account( snapstore_device_t* snapstore_device, s64 locked_ns )
 {
-//    down_write( &snapstore_device->store_block_map_locker );
-    mutex_lock( &snapstore_device->store_block_map_locker );
+    s64 hold_ns = ktime_to_ns( ktime_get( ) ) - locked_ns;
+
+    atomic64_inc( &snapstore_device->state_descr_lock_count );
+    atomic64_add( hold_ns, &snapstore_device->state_descr_lock_hold_ns );
+    if (hold_ns > atomic64_read( &snapstore_device->state_descr_lock_hold_max_ns ))
+        atomic64_set( &snapstore_device->state_descr_lock_hold_max_ns, hold_ns ); // statistics only, the race is harmless
+}
+
+static inline s64 _snapstore_device_descr_read_lock( snapstore_device_t* snapstore_device )
+{
+    down_read( &snapstore_device->store_block_map_locker );
+    return ktime_to_ns( ktime_get( ) );
 }
-static inline void _snapstore_device_descr_write_unlock( snapstore_device_t* snapstore_device )
+static inline void _snapstore_device_descr_read_unlock( snapstore_device_t* snapstore_device, s64 locked_ns )
 {
-//    up_write( &snapstore_device->store_block_map_locker );
-    mutex_unlock( &snapstore_device->store_block_map_locker );
+    _snapstore_device_descr_hold_account( snapstore_device, locked_ns );
+    up_read( &snapstore_device->store_block_map_locker );
+}
+
+static inline s64 _snapstore_device_descr_write_lock( snapstore_device_t* snapstore_device )
+{
+    down_write( &snapstore_device->store_block_map_locker );
+    return ktime_to_ns( ktime_get( ) );
+}
+static inline void _snapstore_device_descr_write_unlock( snapstore_device_t* snapstore_device, s64 locked_ns )
+{
+    _snapstore_device_descr_hold_account( snapstore_device, locked_ns );
+    up_write( &snapstore_device->store_block_map_locker );
+}
+
+// Once a block is preserved, the original device block may be overwritten.
+// So the readers, which have not seen it preserved yet, submit their reads of the original device first.
+static inline void _snapstore_device_preserve_lock( snapstore_device_t* snapstore_device )
+{
+    down_write( &snapstore_device->read_plan_locker );
+}
+static inline void _snapstore_device_preserve_unlock( snapstore_device_t* snapstore_device )
+{
+    up_write( &snapstore_device->read_plan_locker );
+    wake_up_all( &snapstore_device->preserved_waiter );
 }
 
 
@@ -98,6 +132,19 @@ void _snapstore_device_destroy( snapstore_device_t* snapstore_device )
 #ifdef SNAPDATA_ZEROED
     rangevector_done( &snapstore_device->zero_sectors );
 #endif
+    if (snapstore_device->cow_pool != NULL){
+        blk_deferred_pool_print_state( snapstore_device->cow_pool );
+        blk_deferred_pool_put_resource( snapstore_device->cow_pool );
+        snapstore_device->cow_pool = NULL;
+    }
+    if (snapstore_device->cow_excluded != NULL){
+        page_array_free( snapstore_device->cow_excluded );
+        snapstore_device->cow_excluded = NULL;
+    }
+    if (snapstore_device->cow_consumed != NULL){
+        page_array_free( snapstore_device->cow_consumed );
+        snapstore_device->cow_consumed = NULL;
+    }
     if (snapstore_device->snapstore){
         log_tr_uuid("Snapstore uuid ", (&snapstore_device->snapstore->id));
 
@@ -147,12 +194,19 @@ int snapstore_device_create( dev_t dev_id, snapstore_t* snapstore )
     shared_resource_init( &snapstore_device->shared, snapstore_device, snapstore_device_free_cb );
 
     snapstore_device->snapstore = NULL;
+    snapstore_device->cow_excluded = NULL;
     snapstore_device->err_code = SUCCESS;
     snapstore_device->corrupted = false;
     atomic_set( &snapstore_device->req_failed_cnt, 0 );
 
-    //init_rwsem( &snapstore_device->store_block_map_locker );
-    mutex_init(&snapstore_device->store_block_map_locker);
+    init_rwsem( &snapstore_device->store_block_map_locker );
+    init_rwsem( &snapstore_device->read_plan_locker );
+    init_waitqueue_head( &snapstore_device->preserved_waiter );
+
+    atomic64_set( &snapstore_device->state_descr_lock_count, 0 );
+    atomic64_set( &snapstore_device->state_descr_lock_hold_ns, 0 );
+    atomic64_set( &snapstore_device->state_descr_lock_hold_max_ns, 0 );
+    atomic64_set( &snapstore_device->state_in_flight_wait, 0 );
 
 #ifdef SNAPDATA_ZEROED
     rangevector_init(&snapstore_device->zero_sectors, true);
@@ -186,6 +240,19 @@ int snapstore_device_create( dev_t dev_id, snapstore_t* snapstore )
         return res;
     }
 
+    {// the pool is sized to the batches of all the copy-on-write workers, but is limited by the parameter
+        size_t capacity = (size_t)defer_io_workers_count( ) * (size_t)defer_io_pipeline_depth( ) *
+            (size_t)((DEFER_IO_DIO_REQUEST_SECTORS_COUNT >> SNAPSTORE_BLK_SHIFT) + 1);
+        size_t limit = (size_t)((((sector_t)max_t( int, get_cow_buffer_pool_mb( ), 0 )) << (20 - SECTOR512_SHIFT)) >> SNAPSTORE_BLK_SHIFT);
+
+        capacity = min_t( size_t, capacity, limit );
+        if (capacity != 0){
+            snapstore_device->cow_pool = blk_deferred_pool_create( capacity, SNAPSTORE_BLK_SIZE / SECTORS_IN_PAGE );
+            if (snapstore_device->cow_pool == NULL)
+                log_warn( "Failed to allocate defer IO buffers pool, the buffers are allocated on demand" );
+        }
+    }
+
     snapstore_device->snapstore = snapstore_get(snapstore);
 
     container_push_back(&SnapstoreDevices, &snapstore_device->content);
@@ -238,7 +305,7 @@ int snapstore_device_add_request( snapstore_device_t* snapstore_device, blk_desc
     }
 
     do{
-        dio = blk_deferred_alloc( block_index, blk_descr );
+        dio = blk_deferred_alloc( block_index, blk_descr, snapstore_device->cow_pool );
         if (dio == NULL){
             log_err( "Unabled to add block to defer IO request: failed to allocate defer IO" );
             res = -ENOMEM;
@@ -265,7 +332,132 @@ int snapstore_device_add_request( snapstore_device_t* snapstore_device, blk_desc
     return res;
 }
 
-int snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, range_t* copy_range, blk_deferred_request_t** dio_copy_req )
+#define COW_BITMAP_BITS_IN_PAGE (PAGE_SIZE * BITS_PER_BYTE)
+
+// accessed without lock, the bitmap is not released until the snapstore device is destroyed
+static inline bool _snapstore_device_bitmap_test( page_array_t* bitmap, blk_descr_array_index_t block_index )
+{
+    if (bitmap == NULL)
+        return false;
+
+    return test_bit( (int)(block_index & (COW_BITMAP_BITS_IN_PAGE - 1)),
+        (unsigned long*)bitmap->pg[block_index / COW_BITMAP_BITS_IN_PAGE].addr );
+}
+
+static inline bool _snapstore_device_is_excluded( snapstore_device_t* snapstore_device, blk_descr_array_index_t block_index )
+{
+    return _snapstore_device_bitmap_test( snapstore_device->cow_excluded, block_index );
+}
+
+static inline bool _snapstore_device_is_consumed( snapstore_device_t* snapstore_device, blk_descr_array_index_t block_index )
+{
+    return _snapstore_device_bitmap_test( snapstore_device->cow_consumed, block_index );
+}
+
+// sets the bits of the blocks, which are fully covered by the ranges in bytes
+static int _snapstore_device_bitmap_mark( snapstore_device_t* snapstore_device, page_array_t** p_bitmap, page_array_t* ranges, size_t ranges_cnt, blk_descr_array_index_t* p_marked_cnt )
+{
+    size_t inx;
+    page_array_t* bitmap = *p_bitmap;
+    blk_descr_array_index_t blocks_count = snapstore_device->store_block_map.last + 1;
+
+    if (bitmap == NULL){
+        bitmap = page_array_alloc( page_count_calc( (blocks_count + BITS_PER_BYTE - 1) / BITS_PER_BYTE ), GFP_KERNEL );
+        if (bitmap == NULL){
+            log_err( "Failed to allocate blocks bitmap" );
+            return -ENOMEM;
+        }
+        page_array_memset( bitmap, 0 );
+
+        smp_wmb( ); // the bitmap is read without lock by _snapstore_device_bitmap_test()
+        *p_bitmap = bitmap;
+    }
+
+    for (inx = 0; inx < ranges_cnt; ++inx){
+        struct ioctl_range_s* ioctl_range = (struct ioctl_range_s*)page_get_element( ranges, inx, sizeof( struct ioctl_range_s ) );
+        sector_t ofs = sector_from_streamsize( ioctl_range->left );
+        sector_t end = sector_from_streamsize( ioctl_range->right );
+        blk_descr_array_index_t block_index;
+        blk_descr_array_index_t block_index_end;
+
+        block_index = (blk_descr_array_index_t)((ofs + SNAPSTORE_BLK_SIZE - 1) >> SNAPSTORE_BLK_SHIFT);
+        block_index_end = (blk_descr_array_index_t)(end >> SNAPSTORE_BLK_SHIFT);
+        if (block_index_end > blocks_count)
+            block_index_end = blocks_count;
+
+        for (; block_index < block_index_end; ++block_index){
+            set_bit( (int)(block_index & (COW_BITMAP_BITS_IN_PAGE - 1)),
+                (unsigned long*)bitmap->pg[block_index / COW_BITMAP_BITS_IN_PAGE].addr );
+            ++(*p_marked_cnt);
+        }
+    }
+    return SUCCESS;
+}
+
+int snapstore_device_cow_exclude( dev_t dev_id, page_array_t* ranges, size_t ranges_cnt )
+{
+    int res;
+    s64 locked_ns;
+    blk_descr_array_index_t excluded_cnt = 0;
+    snapstore_device_t* snapstore_device = snapstore_device_find_by_dev_id( dev_id );
+
+    if (snapstore_device == NULL){
+        log_err_dev_t( "Unable to exclude ranges from copy-on-write: cannot find snapstore device for ", dev_id );
+        return -ENODEV;
+    }
+
+    locked_ns = _snapstore_device_descr_write_lock( snapstore_device );
+    res = _snapstore_device_bitmap_mark( snapstore_device, &snapstore_device->cow_excluded, ranges, ranges_cnt, &excluded_cnt );
+    _snapstore_device_descr_write_unlock( snapstore_device, locked_ns );
+
+    if (res == SUCCESS)
+        log_tr_format( "%lu blocks are excluded from copy-on-write", excluded_cnt );
+    return res;
+}
+
+int snapstore_device_cow_consumed( dev_t dev_id, page_array_t* ranges, size_t ranges_cnt )
+{
+    int res;
+    s64 locked_ns;
+    blk_descr_array_index_t consumed_cnt = 0;
+    snapstore_device_t* snapstore_device = snapstore_device_find_by_dev_id( dev_id );
+
+    if (snapstore_device == NULL){
+        log_err_dev_t( "Unable to mark ranges as consumed: cannot find snapstore device for ", dev_id );
+        return -ENODEV;
+    }
+
+    locked_ns = _snapstore_device_descr_write_lock( snapstore_device );
+    res = _snapstore_device_bitmap_mark( snapstore_device, &snapstore_device->cow_consumed, ranges, ranges_cnt, &consumed_cnt );
+    _snapstore_device_descr_write_unlock( snapstore_device, locked_ns );
+
+    if (res == SUCCESS)
+        log_tr_format( "%lu blocks are marked as consumed", consumed_cnt );
+    return res;
+}
+
+// The excluded and the consumed blocks are treated as preserved, their data may be overwritten.
+bool snapstore_device_is_preserved( snapstore_device_t* snapstore_device, range_t* range )
+{
+    blk_descr_array_index_t inx;
+    blk_descr_array_index_t first = (blk_descr_array_index_t)(range->ofs >> SNAPSTORE_BLK_SHIFT);
+    blk_descr_array_index_t last = (blk_descr_array_index_t)((range->ofs + range->cnt - 1) >> SNAPSTORE_BLK_SHIFT);
+
+    for (inx = first; inx <= last; inx++){
+        if (blk_descr_array_is_preserved( &snapstore_device->store_block_map, inx ))
+            continue;
+        if (_snapstore_device_is_excluded( snapstore_device, inx ))
+            continue;
+        if (_snapstore_device_is_consumed( snapstore_device, inx ))
+            continue;
+        return false;
+    }
+    return true;
+}
+
+// p_wait_sect receives the length of the leading part of the request, that should be stored before the range can be overwritten
+// all_blocks - the excluded and the consumed blocks are added too
+static int _snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, range_t* copy_range, blk_deferred_request_t** dio_copy_req, sector_t* p_wait_sect, bool all_blocks )
 {
     int res = SUCCESS;
     blk_descr_array_index_t inx = 0;
@@ -273,9 +465,18 @@ int snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, ran
     blk_descr_array_index_t last = (blk_descr_array_index_t)((copy_range->ofs + copy_range->cnt - 1) >> SNAPSTORE_BLK_SHIFT);
 
     for (inx = first; inx <= last; inx++){
+        if (!all_blocks){
+            if (_snapstore_device_is_excluded( snapstore_device, inx ))
+                continue; //the block was free at the snapshot time
+            if (_snapstore_device_is_consumed( snapstore_device, inx ))
+                continue; //the block was already read by the backup
+        }
         if (_snapstore_device_is_block_stored( snapstore_device, inx ))
         {
             //log_tr_sz( "Already stored block # ", inx );
+            // the block may be copied by this request yet
+            if (p_wait_sect && *dio_copy_req && !blk_descr_array_is_preserved( &snapstore_device->store_block_map, inx ))
+                *p_wait_sect = max_t( sector_t, *p_wait_sect, blk_deferred_request_position( *dio_copy_req, inx ) );
         }else{
 
             res = snapstore_device_add_request( snapstore_device, inx, dio_copy_req );
@@ -283,6 +484,8 @@ int snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, ran
                 log_err_d( "Failed to create copy defer IO request. errno=", res );
                 break;
             }
+            if (p_wait_sect)
+                *p_wait_sect = (*dio_copy_req)->sect_len;
         }
     }
     if (res != SUCCESS){
@@ -292,16 +495,121 @@ int snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, ran
     return res;
 }
 
-int snapstore_device_store( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req )
+// The lock is held while the descriptors are allocated only. The blocks, which are stored by
+// another request, should be waited with snapstore_device_wait_in_flight() before the range is overwritten.
+int snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, range_t* copy_range, blk_deferred_request_t** dio_copy_req, sector_t* p_wait_sect )
+{
+    int res;
+    s64 locked_ns = _snapstore_device_descr_read_lock( snapstore_device );
+
+    res = _snapstore_device_prepare_requests( snapstore_device, copy_range, dio_copy_req, p_wait_sect, false );
+
+    _snapstore_device_descr_read_unlock( snapstore_device, locked_ns );
+    return res;
+}
+
+static inline bool _snapstore_device_is_block_in_flight( snapstore_device_t* snapstore_device, blk_descr_array_index_t block_index )
+{
+    if (blk_descr_array_is_preserved( &snapstore_device->store_block_map, block_index ))
+        return false;
+
+    return _snapstore_device_is_block_stored( snapstore_device, block_index );
+}
+
+// Waits for the blocks of the range, which are being copied by another request.
+int snapstore_device_wait_in_flight( snapstore_device_t* snapstore_device, range_t* range )
 {
-    int res = snapstore_request_store( snapstore_device->snapstore, dio_copy_req );
+    blk_descr_array_index_t inx;
+    blk_descr_array_index_t first = (blk_descr_array_index_t)(range->ofs >> SNAPSTORE_BLK_SHIFT);
+    blk_descr_array_index_t last = (blk_descr_array_index_t)((range->ofs + range->cnt - 1) >> SNAPSTORE_BLK_SHIFT);
+
+    for (inx = first; inx <= last; ++inx){
+        u64 start_jiffies;
+
+        if (!_snapstore_device_is_block_in_flight( snapstore_device, inx ))
+            continue;
+
+        atomic64_inc( &snapstore_device->state_in_flight_wait );
+        start_jiffies = get_jiffies_64( );
+        while (0 == wait_event_timeout( snapstore_device->preserved_waiter,
+            snapstore_device->corrupted || !_snapstore_device_is_block_in_flight( snapstore_device, inx ), (HZ * 1) ))
+        {
+            if (jiffies_to_msecs( get_jiffies_64( ) - start_jiffies ) > 60 * 1000){
+                log_err_sz( "Timeout while waiting for the block to be stored #", inx );
+                return -EDEADLK;
+            }
+        }
+        if (snapstore_device->corrupted)
+            return -ENODATA;
+    }
+    return SUCCESS;
+}
+
+int snapstore_device_store_submit( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req )
+{
+    int res = snapstore_request_store_submit( snapstore_device->snapstore, dio_copy_req );
     if (res != SUCCESS)
         snapstore_device_set_corrupted( snapstore_device, res );
 
     return res;
 }
 
-int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bio_endio_t* rq_endio )
+int snapstore_device_store_wait( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req )
+{
+    int res = blk_deferred_request_wait( dio_copy_req );
+    if (res != SUCCESS){
+        snapstore_device_set_corrupted( snapstore_device, res );
+        return res;
+    }
+
+    _snapstore_device_preserve_lock( snapstore_device );
+    blk_deferred_request_preserve( dio_copy_req, &snapstore_device->store_block_map );
+    _snapstore_device_preserve_unlock( snapstore_device );
+    return SUCCESS;
+}
+
+// The original device blocks of the part can be overwritten after the call succeeded.
+int snapstore_device_store_wait_part( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req, sector_t sect_cnt )
+{
+    int res = blk_deferred_request_wait_part( dio_copy_req, sect_cnt );
+    if (res != SUCCESS)
+        return res;
+
+    _snapstore_device_preserve_lock( snapstore_device );
+    blk_deferred_request_preserve_part( dio_copy_req, sect_cnt, &snapstore_device->store_block_map );
+    _snapstore_device_preserve_unlock( snapstore_device );
+    return SUCCESS;
+}
+
+int snapstore_device_store( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req )
+{
+    int res = snapstore_device_store_submit( snapstore_device, dio_copy_req );
+    if (res != SUCCESS)
+        return res;
+
+    return snapstore_device_store_wait( snapstore_device, dio_copy_req );
+}
+
+// the run of the blocks, which are still on the original device, is read by as few bios as the device limits allow
+static int _snapstore_device_read_original( snapstore_device_t* snapstore_device, blk_redirect_bio_endio_t* rq_endio, sector_t rq_pos, sector_t blk_ofs_start, sector_t blk_ofs_count )
+{
+    int res;
+
+#ifdef SNAPDATA_ZEROED
+    //device read with zeroing
+    if (get_zerosnapdata( ))
+        res = blk_dev_redirect_read_zeroed( rq_endio, snapstore_device->orig_blk_dev, rq_pos, blk_ofs_start, blk_ofs_count, &snapstore_device->zero_sectors );
+    else
+#endif
+    res = blk_dev_redirect_part( rq_endio, READ, snapstore_device->orig_blk_dev, rq_pos + blk_ofs_start, blk_ofs_start, blk_ofs_count );
+
+    if (res != SUCCESS)
+        log_err_dev_t( "Failed to redirect read request to the original device ", snapstore_device->dev_id );
+    return res;
+}
+
+// nowait - the request is not processed and -EAGAIN is returned, if the read should wait for the lock
+int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bio_endio_t* rq_endio, bool nowait )
 {
     int res = SUCCESS;
 
@@ -312,13 +620,10 @@ int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bi
     sector_t blk_ofs_start = 0;         //device range start
     sector_t blk_ofs_count = 0;         //device range length
 
-    range_t rq_range;
+    sector_t orig_ofs_start = 0;        //the run of the original device blocks
+    sector_t orig_ofs_count = 0;
 
-#ifdef SNAPDATA_ZEROED
-    rangevector_t* zero_sectors = NULL;
-    if (get_zerosnapdata( ))
-        zero_sectors = &snapstore_device->zero_sectors;
-#endif //SNAPDATA_ZEROED
+    range_t rq_range;
 
     if (snapstore_device_is_corrupted( snapstore_device ))
         return -ENODATA;
@@ -336,25 +641,38 @@ int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bi
     block_index_first = (blk_descr_array_index_t)(rq_range.ofs >> SNAPSTORE_BLK_SHIFT);
     block_index_last = (blk_descr_array_index_t)((rq_range.ofs + rq_range.cnt - 1) >> SNAPSTORE_BLK_SHIFT);
 
-    _snapstore_device_descr_write_lock( snapstore_device );
+    // the descriptors are looked up without lock, so the readers and the copy-on-write run concurrently
+    if (!nowait)
+        down_read( &snapstore_device->read_plan_locker );
+    else if (!down_read_trylock( &snapstore_device->read_plan_locker ))
+        return -EAGAIN;
     for (block_index = block_index_first; block_index <= block_index_last; ++block_index){
-        int status;
         blk_descr_unify_t* blk_descr = NULL;
+        bool is_excluded;
 
         blk_ofs_count = min_t( sector_t,
             (((sector_t)(block_index + 1)) << SNAPSTORE_BLK_SHIFT) - (rq_range.ofs + blk_ofs_start),
             rq_range.cnt - blk_ofs_start );
 
-        status = blk_descr_array_get( &snapstore_device->store_block_map, block_index, &blk_descr );
-        if (SUCCESS != status){
-            if (-ENODATA == status)
-                blk_descr = NULL;
-            else{
+        // until the block is stored, its data is still on the original device
+        if (blk_descr_array_is_preserved( &snapstore_device->store_block_map, block_index )){
+            int status = blk_descr_array_get( &snapstore_device->store_block_map, block_index, &blk_descr );
+            if (SUCCESS != status){
                 res = status;
                 log_err( "Unable to read from snapstore device: failed to get snapstore block" );
                 break;
             }
         }
+        is_excluded = (blk_descr == NULL) && _snapstore_device_is_excluded( snapstore_device, block_index );
+
+        //the run of the original device blocks ends at the stored or excluded block
+        if ((blk_descr || is_excluded) && (orig_ofs_count != 0)){
+            res = _snapstore_device_read_original( snapstore_device, rq_endio, rq_range.ofs, orig_ofs_start, orig_ofs_count );
+            if (res != SUCCESS)
+                break;
+            orig_ofs_count = 0;
+        }
+
         if (blk_descr ){
             //push snapstore read
             res = snapstore_redirect_read( rq_endio, snapstore_device->snapstore, blk_descr, rq_range.ofs + blk_ofs_start, blk_ofs_start, blk_ofs_count );
@@ -363,25 +681,27 @@ int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bi
                 break;
             }
         }
-        else{
-
-#ifdef SNAPDATA_ZEROED
-            //device read with zeroing
-            if (zero_sectors)
-                res = blk_dev_redirect_read_zeroed( rq_endio, snapstore_device->orig_blk_dev, rq_range.ofs, blk_ofs_start, blk_ofs_count, zero_sectors );
-            else
-#endif
-            res = blk_dev_redirect_part( rq_endio, READ, snapstore_device->orig_blk_dev, rq_range.ofs + blk_ofs_start, blk_ofs_start, blk_ofs_count );
-
+        else if (is_excluded){
+            //the block was free at the snapshot time
+            res = blk_dev_redirect_zeroed_part( rq_endio, blk_ofs_start, blk_ofs_count );
             if (res != SUCCESS){
-                log_err_dev_t( "Failed to redirect read request to the original device ", snapstore_device->dev_id );
+                log_err( "Failed to zero the excluded block" );
                 break;
             }
         }
+        else{
+            //the block is joined to the run, which is read from the original device later
+            if (orig_ofs_count == 0)
+                orig_ofs_start = blk_ofs_start;
+            orig_ofs_count += blk_ofs_count;
+        }
 
         blk_ofs_start += blk_ofs_count;
     }
 
+    if ((res == SUCCESS) && (orig_ofs_count != 0))
+        res = _snapstore_device_read_original( snapstore_device, rq_endio, rq_range.ofs, orig_ofs_start, orig_ofs_count );
+
     if (res == SUCCESS){
         if (atomic64_read( &rq_endio->bio_endio_count ) > 0ll) //async direct access needed
             blk_dev_redirect_submit( rq_endio );
@@ -392,7 +712,7 @@ int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bi
         log_err_d( "Failed to read from snapstore device. errno=", res );
         log_err_format( "Position %lld sector, length %lld sectors", rq_range.ofs, rq_range.cnt );
     }
-    _snapstore_device_descr_write_unlock(snapstore_device);
+    up_read( &snapstore_device->read_plan_locker );
 
     return res;
 }
@@ -401,10 +721,17 @@ int _snapstore_device_copy_on_write( snapstore_device_t* snapstore_device, range
 {
     int res = SUCCESS;
     blk_deferred_request_t* dio_copy_req = NULL;
+    s64 locked_ns;
+
+    // exclusive, because the defer IO workers allocate the descriptors under the shared lock
+    locked_ns = _snapstore_device_descr_write_lock( snapstore_device );
+    // the image write needs the excluded and the consumed blocks too
+    res = _snapstore_device_prepare_requests( snapstore_device, rq_range, &dio_copy_req, NULL, true );
+    _snapstore_device_descr_write_unlock( snapstore_device, locked_ns );
 
-    _snapstore_device_descr_read_lock( snapstore_device );
     do{
-        res = snapstore_device_prepare_requests( snapstore_device, rq_range, &dio_copy_req );
+        blk_descr_array_index_t inx;
+
         if (res != SUCCESS){
             log_err_d( "Failed to create defer IO request for range. errno=", res );
             break;
@@ -418,13 +745,24 @@ int _snapstore_device_copy_on_write( snapstore_device_t* snapstore_device, range
             log_err_d( "Failed to read data from the original device. errno=", res );
             break;
         }
+
+        // the excluded blocks were read as zeros from the image, so they are stored zeroed
+        for (inx = (blk_descr_array_index_t)(rq_range->ofs >> SNAPSTORE_BLK_SHIFT);
+            inx <= (blk_descr_array_index_t)((rq_range->ofs + rq_range->cnt - 1) >> SNAPSTORE_BLK_SHIFT); ++inx)
+        {
+            if (_snapstore_device_is_excluded( snapstore_device, inx ))
+                blk_deferred_request_zero_block( dio_copy_req, inx );
+        }
         res = snapstore_device_store( snapstore_device, dio_copy_req );
         if (res != SUCCESS){
             log_err_d( "Failed to write data to snapstore. errno=", res );
             break;
         }
     } while (false);
-    _snapstore_device_descr_read_unlock( snapstore_device );
+
+    // the image data should not be overwritten by the copy, which is in process by the defer IO workers
+    if (res == SUCCESS)
+        res = snapstore_device_wait_in_flight( snapstore_device, rq_range );
 
     if (dio_copy_req){
         if (res == -EDEADLK)
@@ -469,11 +807,19 @@ int snapstore_device_write( snapstore_device_t* snapstore_device, blk_redirect_b
 
     // do copy to snapstore previously
     res = _snapstore_device_copy_on_write( snapstore_device, &rq_range );
+    if (res != SUCCESS){
+        // the copy of the block may be still in flight and would overwrite the written data
+        log_err_d( "Failed to write from snapstore device: copy-on-write failed. errno=", res );
+        log_err_format( "Position %lld sector, length %lld sectors", rq_range.ofs, rq_range.cnt );
+
+        snapstore_device_set_corrupted( snapstore_device, res );
+        return res;
+    }
 
     block_index_first = (blk_descr_array_index_t)(rq_range.ofs >> SNAPSTORE_BLK_SHIFT);
     block_index_last = (blk_descr_array_index_t)((rq_range.ofs + rq_range.cnt - 1) >> SNAPSTORE_BLK_SHIFT);
 
-    _snapstore_device_descr_write_lock(snapstore_device);
+    // all the blocks are preserved already, so the descriptors are read without lock
     for (block_index = block_index_first; block_index <= block_index_last; ++block_index){
         int status;
         blk_descr_unify_t* blk_descr = NULL;
@@ -520,7 +866,6 @@ int snapstore_device_write( snapstore_device_t* snapstore_device, blk_redirect_b
 
         snapstore_device_set_corrupted( snapstore_device, res );
     }
-    _snapstore_device_descr_write_unlock(snapstore_device);
     return res;
 }
 
@@ -548,6 +893,7 @@ void snapstore_device_set_corrupted( snapstore_device_t* snapstore_device, int e
         snapstore_device->err_code = err_code;
 
         log_err_dev_t( "Set snapshot device is corrupted for ", snapstore_device->dev_id );
+        wake_up_all( &snapstore_device->preserved_waiter );
     }
 }
 
@@ -560,6 +906,13 @@ void snapstore_device_print_state( snapstore_device_t* snapstore_device )
         log_tr( "Corrupted");
         log_tr_d( "Failed request count: ", atomic_read( &snapstore_device->req_failed_cnt ) );
     }
+    log_tr_format( "Descriptors lock: held %lld times, %lld us in total, %lld us at most",
+        (long long int)atomic64_read( &snapstore_device->state_descr_lock_count ),
+        (long long int)div_s64( atomic64_read( &snapstore_device->state_descr_lock_hold_ns ), NSEC_PER_USEC ),
+        (long long int)div_s64( atomic64_read( &snapstore_device->state_descr_lock_hold_max_ns ), NSEC_PER_USEC ) );
+    log_tr_format( "Waits for the blocks in flight: %lld", (long long int)atomic64_read( &snapstore_device->state_in_flight_wait ) );
+    if (snapstore_device->cow_pool)
+        blk_deferred_pool_print_state( snapstore_device->cow_pool );
 }
 
 int snapstore_device_errno( dev_t dev_id, int* p_err_code )
@@ -27,17 +27,35 @@ typedef struct snapstore_device_s
 
 
     blk_descr_array_t store_block_map; // map block index to read block offset
-    //struct rw_semaphore store_block_map_locker;
-    struct mutex store_block_map_locker;
+    // protects the descriptors allocation only, the blocks in flight are waited without it.
+    // Shared by copy-on-write workers, each of them copies its own blocks
+    struct rw_semaphore store_block_map_locker;
+    wait_queue_head_t preserved_waiter; // woken up when the blocks are preserved
+    // shared by the image readers while they choose between the snapstore and the original device,
+    // exclusive while the stored blocks are marked as preserved
+    struct rw_semaphore read_plan_locker;
 
 #ifdef SNAPDATA_ZEROED
     rangevector_t zero_sectors;
 #endif
 
+    blk_deferred_pool_t* cow_pool; // buffers for the blocks to copy, NULL if disabled
+
+    // bitmap of the blocks, which were free in the filesystem at the snapshot time.
+    // Allocated on the first exclusion, the bits are never cleared.
+    page_array_t* cow_excluded;
+    // bitmap of the blocks, which were already read by the backup and need no copy-on-write
+    page_array_t* cow_consumed;
+
     // transaction processing
     //rangevector_t copy_ranges;
     //container_sl_t copy_requests;
 
+    atomic64_t state_descr_lock_count;
+    atomic64_t state_descr_lock_hold_ns;
+    atomic64_t state_descr_lock_hold_max_ns;
+    atomic64_t state_in_flight_wait; // waits for the blocks copied by another request
+
     atomic_t req_failed_cnt;
     volatile int err_code;
     volatile bool corrupted;
@@ -61,10 +79,19 @@ int snapstore_device_create( dev_t dev_id, snapstore_t* snapstore );
 
 int snapstore_device_cleanup( veeam_uuid_t* id );
 
-int snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, range_t* copy_range, blk_deferred_request_t** dio_copy_req );
+int snapstore_device_cow_exclude( dev_t dev_id, page_array_t* ranges, size_t ranges_cnt );
+int snapstore_device_cow_consumed( dev_t dev_id, page_array_t* ranges, size_t ranges_cnt );
+
+bool snapstore_device_is_preserved( snapstore_device_t* snapstore_device, range_t* range );
+
+int snapstore_device_prepare_requests( snapstore_device_t* snapstore_device, range_t* copy_range, blk_deferred_request_t** dio_copy_req, sector_t* p_wait_sect );
+int snapstore_device_store_submit( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req );
+int snapstore_device_store_wait( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req );
+int snapstore_device_store_wait_part( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req, sector_t sect_cnt );
 int snapstore_device_store( snapstore_device_t* snapstore_device, blk_deferred_request_t* dio_copy_req );
+int snapstore_device_wait_in_flight( snapstore_device_t* snapstore_device, range_t* range );
 
-int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bio_endio_t* rq_endio ); //request from image
+int snapstore_device_read( snapstore_device_t* snapstore_device, blk_redirect_bio_endio_t* rq_endio, bool nowait ); //request from image
 int snapstore_device_write( snapstore_device_t* snapstore_device, blk_redirect_bio_endio_t* rq_endio ); //request from image
 
 bool snapstore_device_is_corrupted( snapstore_device_t* snapstore_device );
@@ -72,16 +99,3 @@ void snapstore_device_set_corrupted( snapstore_device_t* snapstore_device, int e
 int snapstore_device_errno( dev_t dev_id, int* p_err_code );
 
 void snapstore_device_print_state( snapstore_device_t* snapstore_device );
-
-
-
-static inline void _snapstore_device_descr_read_lock( snapstore_device_t* snapstore_device )
-{
-    //down_read( &snapstore_device->store_block_map_locker );
-    mutex_lock( &snapstore_device->store_block_map_locker );
-}
-static inline void _snapstore_device_descr_read_unlock( snapstore_device_t* snapstore_device )
-{
-    //up_read( &snapstore_device->store_block_map_locker );
-    mutex_unlock( &snapstore_device->store_block_map_locker );
-}
@@ -17,6 +17,7 @@
 #include <linux/hdreg.h> // For struct hd_geometry
 #include <linux/errno.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <linux/vmalloc.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
@@ -27,6 +28,8 @@
 #include <linux/bitmap.h>
 #include <asm/atomic.h>
 #include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,2,0)
 #define HAVE_MAKE_REQUEST_INT
@@ -66,6 +69,12 @@ typedef unsigned long long stream_size_t;
 #define DEFER_IO_COPY_REQUEST_LENGTH 10
 #define DEFER_IO_DIO_REQUEST_LENGTH 250
 #define DEFER_IO_DIO_REQUEST_SECTORS_COUNT (10*1024*1024/SECTOR512)
+#define DEFER_IO_WORKERS_MAX 16
+#define DEFER_IO_PIPELINE_DEPTH_MAX 8
+#define SNAPIMAGE_WORKERS_MAX 64
+#define SNAPIMAGE_READAHEAD_KB_MAX 1024 // the window is loaded by one bio
+#define SNAPIMAGE_PLAN_DEPTH_MAX 64
+#define DEFER_IO_WORKER_STRIPE_SHIFT (20 - SECTOR512_SHIFT) // 1MiB stripes of the device are spread over COW workers
 
 //#define VEEAMIMAGE_THROTTLE_TIMEOUT ( 30*HZ )    //delay 30 sec
 //#define VEEAMIMAGE_THROTTLE_TIMEOUT ( 3*HZ )    //delay 3 sec
@@ -84,6 +93,17 @@ int get_zerosnapdata( void );
 int get_snapstore_block_size_pow(void);
 int inc_snapstore_block_size_pow(void);
 int get_change_tracking_block_size_pow(void);
+int get_cow_workers(void);
+int get_cow_pipeline_depth(void);
+int get_cbt_discard_zero(void);
+int get_cow_buffer_pool_mb(void);
+int get_snapimage_workers(void);
+int get_snapimage_inline_read(void);
+int get_snapimage_readahead_kb(void);
+int get_snapimage_plan_depth(void);
+int get_throttle_read_weight(void);
+int get_throttle_cow_weight(void);
+int get_throttle_min_read_mbps(void);
 
 #define FIXFLAG_RH6_SPINLOCK 1    //https://www.veeam.com/kb2786 
 unsigned int get_fixflags(void);
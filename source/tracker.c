@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "tracker.h"
 #include "blk_util.h"
+#include "cbt_persist.h"
 #define SECTION "tracker   "
 #include "log_format.h"
 
@@ -29,64 +30,25 @@ int tracker_done(void )
 
 int tracker_find_by_queue_and_sector( tracker_queue_t* queue, sector_t sector, tracker_t** ptracker )
 {
-    int result = -ENODATA;
+    tracker_t* tracker = (tracker_t*)tracker_queue_index_find( queue, sector );
 
-    content_sl_t* content = NULL;
-    tracker_t* tracker = NULL;
-    CONTAINER_SL_FOREACH_BEGIN( trackers_container, content )
-    {
-        tracker = (tracker_t*)content;
-        if ((queue == tracker->tracker_queue) &&
-            (sector >= blk_dev_get_start_sect( tracker->target_dev )) &&
-            (sector < (blk_dev_get_start_sect( tracker->target_dev ) + blk_dev_get_capacity( tracker->target_dev )))
-        ){
-            *ptracker = tracker;
-            result = SUCCESS;
-            break;
-        }
-    }
-    CONTAINER_SL_FOREACH_END( trackers_container );
+    if (NULL == tracker)
+        return -ENODATA;
 
-    return result;
+    *ptracker = tracker;
+    return SUCCESS;
 }
 
 int tracker_find_intersection(tracker_queue_t* queue, sector_t b1, sector_t e1, tracker_t** ptracker)
 {
-    int result = -ENODATA;
-
-    content_sl_t* content = NULL;
-    tracker_t* tracker = NULL;
-    CONTAINER_SL_FOREACH_BEGIN(trackers_container, content)
-    {
-        tracker = (tracker_t*)content;
+    tracker_t* tracker = (tracker_t*)tracker_queue_index_find_intersection( queue, b1, e1 );
 
-        if (queue == tracker->tracker_queue)
-        {
-            bool have_intersection = false;
-            sector_t b2 = blk_dev_get_start_sect(tracker->target_dev);
-            sector_t e2 = blk_dev_get_start_sect(tracker->target_dev) + blk_dev_get_capacity(tracker->target_dev);
-
-            if ((b1 >= b2) && (e1 <= e2))
-                have_intersection = true;
-            if ((b1 <= b2) && (e1 >= e2))
-                have_intersection = true;
-            if ((b1 <= b2) && (e1 > b2))
-                have_intersection = true;
-            if ((b1 < e2) && (e1 >= e2))
-                have_intersection = true;
-
-            if (have_intersection){
-                if (ptracker != NULL)
-                    *ptracker = tracker;
-
-                result = SUCCESS;
-                break;
-            }
-        }
-    }
-    CONTAINER_SL_FOREACH_END(trackers_container);
+    if (NULL == tracker)
+        return -ENODATA;
 
-    return result;
+    if (ptracker != NULL)
+        *ptracker = tracker;
+    return SUCCESS;
 }
 
 int tracker_find_by_dev_id( dev_t dev_id, tracker_t** ptracker )
@@ -129,7 +91,7 @@ int tracker_enum_cbt_info( int max_count, struct cbt_info_s* p_cbt_info, int* p_
             p_cbt_info[count].dev_id.minor = MINOR(tracker->original_dev_id);
 
             if (tracker->cbt_map){
-                p_cbt_info[count].cbt_map_size = tracker->cbt_map->map_size;
+                p_cbt_info[count].cbt_map_size = cbt_map_size_in_bytes( tracker->cbt_map );
                 p_cbt_info[count].snap_number = (unsigned char)tracker->cbt_map->snap_number_previous;
                 veeam_uuid_copy((veeam_uuid_t*)(p_cbt_info[count].generationId), &tracker->cbt_map->generationId);
             }
@@ -149,17 +111,20 @@ int tracker_enum_cbt_info( int max_count, struct cbt_info_s* p_cbt_info, int* p_
     return result;
 }
 
-void tracker_cbt_start( tracker_t* tracker, unsigned long long snapshot_id, unsigned int cbt_block_size_degree, sector_t device_capacity )
+void tracker_cbt_start( tracker_t* tracker, unsigned long long snapshot_id, unsigned int cbt_block_size_degree, sector_t device_capacity, unsigned int cbt_entry_size )
 {
     tracker_snapshot_id_set(tracker, snapshot_id);
 
-    tracker->cbt_map = cbt_map_get_resource( cbt_map_create( (cbt_block_size_degree - SECTOR512_SHIFT), device_capacity ) );
+    tracker->cbt_map = cbt_map_get_resource( cbt_map_create( (cbt_block_size_degree - SECTOR512_SHIFT), device_capacity, cbt_entry_size ) );
+    //the map stored at the previous clean unload or reboot is continued
+    if (tracker->cbt_map != NULL)
+        cbt_persist_attach( tracker->original_dev_id, tracker->cbt_map, device_capacity, true );
     
     tracker->cbt_block_size_degree = cbt_block_size_degree;
     tracker->device_capacity = device_capacity;
 }
 
-int tracker_create( unsigned long long snapshot_id, dev_t dev_id, unsigned int cbt_block_size_degree, tracker_t** ptracker )
+int tracker_create( unsigned long long snapshot_id, dev_t dev_id, unsigned int cbt_block_size_degree, unsigned int cbt_entry_size, tracker_t** ptracker )
 {
     int result = SUCCESS;
     tracker_t* tracker = NULL;
@@ -187,7 +152,7 @@ int tracker_create( unsigned long long snapshot_id, dev_t dev_id, unsigned int c
             (unsigned long long)blk_dev_get_start_sect( tracker->target_dev ),
             (unsigned long long)blk_dev_get_capacity( tracker->target_dev ) );
 
-        tracker_cbt_start( tracker, snapshot_id, cbt_block_size_degree, blk_dev_get_capacity( tracker->target_dev ) );
+        tracker_cbt_start( tracker, snapshot_id, cbt_block_size_degree, blk_dev_get_capacity( tracker->target_dev ), cbt_entry_size );
 
         result = blk_freeze_bdev( tracker->original_dev_id, tracker->target_dev, &superblock );
         if (result != SUCCESS){
@@ -195,6 +160,12 @@ int tracker_create( unsigned long long snapshot_id, dev_t dev_id, unsigned int c
             break;
         }
         result = tracker_queue_ref( bdev_get_queue( tracker->target_dev ), &tracker->tracker_queue );
+        if (result == SUCCESS){
+            result = tracker_queue_index_add( tracker->tracker_queue,
+                blk_dev_get_start_sect( tracker->target_dev ), blk_dev_get_capacity( tracker->target_dev ), tracker );
+            if (result != SUCCESS)
+                log_err_d( "Failed to add tracker to tracker queue index. errno=", result );
+        }
         superblock = blk_thaw_bdev( tracker->original_dev_id, tracker->target_dev, superblock );
 
     }while(false);
@@ -216,26 +187,26 @@ int tracker_create( unsigned long long snapshot_id, dev_t dev_id, unsigned int c
     return result;
 }
 
-int _tracker_remove( tracker_t* tracker )
+// The CBT map is stored when the tracking is stopped on the module unload
+int _tracker_remove( tracker_t* tracker, bool store_cbt )
 {
     int result = SUCCESS;
 
     if (NULL != tracker->target_dev){
 
         struct super_block* superblock = NULL;
-   
-        if (tracker->is_unfreezable)
-            down_write(&tracker->unfreezable_lock);
-        else
+
+        // The index removal waits for tracking_make_request() to finish with the tracker.
+        // The unfreezable lock is not taken, the requests wait for it while holding the tracker queue read lock.
+        if (!tracker->is_unfreezable)
             result = blk_freeze_bdev(tracker->original_dev_id, tracker->target_dev, &superblock);
 
         if (NULL != tracker->tracker_queue){
+            tracker_queue_index_remove( tracker->tracker_queue, tracker );
             tracker_queue_unref( tracker->tracker_queue );
             tracker->tracker_queue = NULL;
         }
-        if (tracker->is_unfreezable)
-            up_write(&tracker->unfreezable_lock);
-        else
+        if (!tracker->is_unfreezable)
             superblock = blk_thaw_bdev(tracker->original_dev_id, tracker->target_dev, superblock);
 
         blk_dev_close( tracker->target_dev );
@@ -245,6 +216,8 @@ int _tracker_remove( tracker_t* tracker )
         result=-ENODEV;
 
     if (NULL != tracker->cbt_map){
+        cbt_persist_detach( tracker->original_dev_id, tracker->cbt_map, store_cbt );
+
         cbt_map_put_resource( tracker->cbt_map );
         tracker->cbt_map = NULL;
     }
@@ -255,7 +228,7 @@ int _tracker_remove( tracker_t* tracker )
 
 int tracker_remove(tracker_t* tracker)
 {
-    int result = _tracker_remove( tracker );
+    int result = _tracker_remove( tracker, false );
 
     container_sl_free( &tracker->content );
 
@@ -274,7 +247,7 @@ int tracker_remove_all(void )
     while (NULL != (content = container_sl_get_first( &trackers_container ))){
         tracker_t* tracker = (tracker_t*)content;
 
-        status = _tracker_remove( tracker );
+        status = _tracker_remove( tracker, true );
         if (status != SUCCESS)
             log_err_format( "Failed to remove device [%d:%d] from tracking. errno=%d",
                 MAJOR( tracker->original_dev_id ), MINOR( tracker->original_dev_id ), 0 - status );
@@ -286,12 +259,12 @@ int tracker_remove_all(void )
     return result;
 }
 
-int tracker_cbt_bitmap_set( tracker_t* tracker, sector_t sector, sector_t sector_cnt )
+int tracker_cbt_bitmap_set( tracker_t* tracker, sector_t sector, sector_t sector_cnt, bool discard )
 {
     int res = SUCCESS;
     if (tracker->device_capacity == blk_dev_get_capacity( tracker->target_dev )){
         if (tracker->cbt_map)
-            res = cbt_map_set( tracker->cbt_map, sector, sector_cnt );
+            res = cbt_map_set( tracker->cbt_map, sector, sector_cnt, discard );
     }
     else{
         log_warn( "Device resize detected" );
@@ -343,7 +316,8 @@ int _tracker_capture_snapshot( tracker_t* tracker )
 
         if (tracker->cbt_map != NULL){
             cbt_map_write_lock( tracker->cbt_map );
-            cbt_map_switch( tracker->cbt_map );
+            if (tracker->cbt_map->active) // the stored map is not changed any more
+                cbt_map_switch( tracker->cbt_map );
             cbt_map_write_unlock( tracker->cbt_map );
 
             log_tr_format( "Snapshot captured for device [%d:%d]. New snap number %ld",
@@ -385,6 +359,10 @@ int tracker_capture_snapshot( snapshot_t* snapshot )
             up_write(&tracker->unfreezable_lock);
         else
             superblock = blk_thaw_bdev(tracker->original_dev_id, tracker->target_dev, superblock);
+
+        //the switched CBT map is synced out of the freeze window
+        if ((result == SUCCESS) && (tracker->cbt_map != NULL))
+            cbt_map_sync( tracker->cbt_map );
     }
     if (result != SUCCESS)
         return result;
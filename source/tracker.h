@@ -41,13 +41,13 @@ int tracker_enum_cbt_info( int max_count, struct cbt_info_s* p_cbt_info, int* p_
 int tracker_capture_snapshot( snapshot_t* p_snapshot );
 int tracker_release_snapshot( snapshot_t* p_snapshot );
 
-void tracker_cbt_start( tracker_t* tracker, unsigned long long snapshot_id, unsigned int cbt_block_size_degree, sector_t device_capacity );
+void tracker_cbt_start( tracker_t* tracker, unsigned long long snapshot_id, unsigned int cbt_block_size_degree, sector_t device_capacity, unsigned int cbt_entry_size );
 
-int tracker_create( unsigned long long snapshot_id, dev_t dev_id, unsigned int cbt_block_size_degree, tracker_t** ptracker );
+int tracker_create( unsigned long long snapshot_id, dev_t dev_id, unsigned int cbt_block_size_degree, unsigned int cbt_entry_size, tracker_t** ptracker );
 int tracker_remove( tracker_t* tracker );
 int tracker_remove_all( void );
 
-int tracker_cbt_bitmap_set( tracker_t* tracker, sector_t sector, sector_t sector_cnt );
+int tracker_cbt_bitmap_set( tracker_t* tracker, sector_t sector, sector_t sector_cnt, bool discard );
 
 bool tracker_cbt_bitmap_lock( tracker_t* tracker );
 void tracker_cbt_bitmap_unlock( tracker_t* tracker );
@@ -16,11 +16,28 @@ void tracking_make_request(struct request_queue *q, struct bio *bio);
 blk_qc_t tracking_make_request( struct request_queue *q, struct bio *bio );
 #endif
 
+// tracker queues sorted by original_queue, read under SRCU
+typedef struct tracker_queue_set_s
+{
+    size_t count;
+    tracker_queue_t* queues[0];
+}tracker_queue_set_t;
 
 container_sl_t tracker_queue_container;
 
+static tracker_queue_set_t* tracker_queue_set = NULL;
+// serializes publishing of tracker_queue_set and of the tracker queues indexes
+static DEFINE_MUTEX( tracker_queue_index_lock );
+// tracking_make_request() sleeps while it uses the found tracker queue and tracker, so SRCU is used instead of RCU
+static struct srcu_struct tracker_queue_srcu;
+
 int tracker_queue_init(void )
 {
+    int result = init_srcu_struct( &tracker_queue_srcu );
+    if (SUCCESS != result){
+        log_err_d( "Failed to initialize tracker queue SRCU. errno=", result );
+        return result;
+    }
     container_sl_init(&tracker_queue_container, sizeof(tracker_queue_t));
     return SUCCESS;
 }
@@ -30,15 +47,78 @@ int tracker_queue_done(void )
     int result = container_sl_done( &tracker_queue_container );
     if (SUCCESS != result)
         log_err( "Failed to free up tracker queue container");
+    else{
+        if (tracker_queue_set != NULL){
+            dbg_kfree( tracker_queue_set );
+            tracker_queue_set = NULL;
+        }
+        cleanup_srcu_struct( &tracker_queue_srcu );
+    }
     return result;
 }
 
+// The found tracker queue and the index owners stay valid until the read unlock
+int tracker_queue_read_lock( void )
+{
+    return srcu_read_lock( &tracker_queue_srcu );
+}
+
+void tracker_queue_read_unlock( int lock_idx )
+{
+    srcu_read_unlock( &tracker_queue_srcu, lock_idx );
+}
+
+static int _tracker_queue_set_publish( tracker_queue_t* add_tr_q, tracker_queue_t* remove_tr_q )
+{
+    tracker_queue_set_t* old_set = tracker_queue_set;
+    tracker_queue_set_t* new_set = NULL;
+    size_t old_count = (old_set != NULL) ? old_set->count : 0;
+    size_t new_count = old_count;
+    size_t inx;
+
+    if (add_tr_q != NULL)
+        ++new_count;
+    if (remove_tr_q != NULL)
+        --new_count;
+
+    if (new_count != 0){
+        new_set = dbg_kzalloc( sizeof( tracker_queue_set_t ) + new_count * sizeof( tracker_queue_t* ), GFP_KERNEL );
+        if (new_set == NULL)
+            return -ENOMEM;
+
+        for (inx = 0; inx < old_count; ++inx){
+            tracker_queue_t* tr_q = old_set->queues[inx];
+
+            if (tr_q == remove_tr_q)
+                continue;
+
+            if ((add_tr_q != NULL) && ((uintptr_t)add_tr_q->original_queue < (uintptr_t)tr_q->original_queue)){
+                new_set->queues[new_set->count++] = add_tr_q;
+                add_tr_q = NULL;
+            }
+            new_set->queues[new_set->count++] = tr_q;
+        }
+        if (add_tr_q != NULL)
+            new_set->queues[new_set->count++] = add_tr_q;
+    }
+
+    rcu_assign_pointer( tracker_queue_set, new_set );
+
+    if (old_set != NULL){
+        synchronize_srcu( &tracker_queue_srcu );
+        dbg_kfree( old_set );
+    }
+    return SUCCESS;
+}
+
 // find or create new tracker queue
 int tracker_queue_ref(    struct request_queue* queue, tracker_queue_t** ptracker_queue )
 {
     int find_result = SUCCESS;
     tracker_queue_t* tr_q = NULL;
 
+    mutex_lock( &tracker_queue_index_lock );
+
     find_result = tracker_queue_find(queue, &tr_q);
     if (SUCCESS == find_result){
         log_tr("Tracker queue already exists");
@@ -46,30 +126,44 @@ int tracker_queue_ref(    struct request_queue* queue, tracker_queue_t** ptracke
         *ptracker_queue = tr_q;
         atomic_inc( &tr_q->atomic_ref_count );
 
+        mutex_unlock( &tracker_queue_index_lock );
         return find_result;
     }
 
     if (-ENODATA != find_result){
         log_tr_d( "Cannot to find tracker queue. errno=", find_result );
+        mutex_unlock( &tracker_queue_index_lock );
         return find_result;
     }
 
     log_tr("New tracker queue create" );
 
     tr_q = (tracker_queue_t*)container_sl_new(&tracker_queue_container);
-    if (NULL==tr_q)
+    if (NULL==tr_q){
+        mutex_unlock( &tracker_queue_index_lock );
         return -ENOMEM;
+    }
 
     atomic_set( &tr_q->atomic_ref_count, 0 );
-
+    tr_q->index = NULL;
+    tr_q->original_queue = queue;
     tr_q->original_make_request_fn = queue->make_request_fn;
-    queue->make_request_fn = tracking_make_request;
 
-    tr_q->original_queue = queue;
+    // tracking_make_request must be able to find the queue before it is called
+    find_result = _tracker_queue_set_publish( tr_q, NULL );
+    if (SUCCESS != find_result){
+        container_sl_free( &tr_q->content );
+        mutex_unlock( &tracker_queue_index_lock );
+        return find_result;
+    }
+
+    queue->make_request_fn = tracking_make_request;
 
     *ptracker_queue = tr_q;
     atomic_inc( &tr_q->atomic_ref_count );
 
+    mutex_unlock( &tracker_queue_index_lock );
+
     log_tr("New tracker queue was created");
 
     return SUCCESS;
@@ -77,6 +171,8 @@ int tracker_queue_ref(    struct request_queue* queue, tracker_queue_t** ptracke
 
 void tracker_queue_unref( tracker_queue_t* tracker_queue )
 {
+    mutex_lock( &tracker_queue_index_lock );
+
     if ( atomic_dec_and_test( &tracker_queue->atomic_ref_count ) ){
 
         if (NULL != tracker_queue->original_make_request_fn){
@@ -84,29 +180,216 @@ void tracker_queue_unref( tracker_queue_t* tracker_queue )
             tracker_queue->original_make_request_fn = NULL;
         }
 
+        if (SUCCESS != _tracker_queue_set_publish( NULL, tracker_queue ))
+            log_err( "CRITICAL! Failed to remove tracker queue from set" );
+
+        if (tracker_queue->index != NULL){
+            dbg_kfree( tracker_queue->index );
+            tracker_queue->index = NULL;
+        }
+
         container_sl_free( &tracker_queue->content );
 
         log_tr("Tracker queue freed");
     }else
         log_tr("Tracker queue is in use");
+
+    mutex_unlock( &tracker_queue_index_lock );
 }
 
 int tracker_queue_find( struct request_queue* queue, tracker_queue_t** ptracker_queue )
 {
     int result = -ENODATA;
-    content_sl_t* pContent = NULL;
-    tracker_queue_t* tr_q = NULL;
-    CONTAINER_SL_FOREACH_BEGIN( tracker_queue_container, pContent )
-    {
-        tr_q = (tracker_queue_t*)pContent;
-        if (tr_q->original_queue == queue){
-            *ptracker_queue = tr_q;
+    int lock_idx;
+    tracker_queue_set_t* set;
 
-            result = SUCCESS;    //don`t continue
-            break;
+    lock_idx = srcu_read_lock( &tracker_queue_srcu );
+    set = srcu_dereference( tracker_queue_set, &tracker_queue_srcu );
+    if (set != NULL){
+        size_t left = 0;
+        size_t right = set->count;
+
+        while (left < right){
+            size_t mid = left + ((right - left) >> 1);
+            tracker_queue_t* tr_q = set->queues[mid];
+
+            if (tr_q->original_queue == queue){
+                *ptracker_queue = tr_q;
+
+                result = SUCCESS;    //don`t continue
+                break;
+            }
+
+            if ((uintptr_t)tr_q->original_queue < (uintptr_t)queue)
+                left = mid + 1;
+            else
+                right = mid;
         }
-    }CONTAINER_SL_FOREACH_END( tracker_queue_container );
+    }
+    srcu_read_unlock( &tracker_queue_srcu, lock_idx );
 
     return result;
 }
 
+static void _tracker_queue_index_publish( tracker_queue_t* tracker_queue, tracker_queue_index_t* new_index )
+{
+    tracker_queue_index_t* old_index = tracker_queue->index;
+
+    rcu_assign_pointer( tracker_queue->index, new_index );
+
+    if (old_index != NULL){
+        synchronize_srcu( &tracker_queue_srcu );
+        dbg_kfree( old_index );
+    }
+}
+
+int tracker_queue_index_add( tracker_queue_t* tracker_queue, sector_t first, sector_t count, void* owner )
+{
+    tracker_queue_index_t* old_index;
+    tracker_queue_index_t* new_index;
+    size_t old_count;
+    size_t inx;
+    bool inserted = false;
+
+    mutex_lock( &tracker_queue_index_lock );
+
+    old_index = tracker_queue->index;
+    old_count = (old_index != NULL) ? old_index->count : 0;
+
+    new_index = dbg_kzalloc( sizeof( tracker_queue_index_t ) + (old_count + 1) * sizeof( tracker_queue_index_entry_t ), GFP_KERNEL );
+    if (new_index == NULL){
+        mutex_unlock( &tracker_queue_index_lock );
+        return -ENOMEM;
+    }
+
+    for (inx = 0; inx < old_count; ++inx){
+        if (!inserted && (first < old_index->entries[inx].first)){
+            new_index->entries[new_index->count].first = first;
+            new_index->entries[new_index->count].last = first + count;
+            new_index->entries[new_index->count].owner = owner;
+            ++new_index->count;
+            inserted = true;
+        }
+        // the owner removed in place is dropped, its interval may be overlapped by the new one
+        if (old_index->entries[inx].owner != NULL)
+            new_index->entries[new_index->count++] = old_index->entries[inx];
+    }
+    if (!inserted){
+        new_index->entries[new_index->count].first = first;
+        new_index->entries[new_index->count].last = first + count;
+        new_index->entries[new_index->count].owner = owner;
+        ++new_index->count;
+    }
+
+    _tracker_queue_index_publish( tracker_queue, new_index );
+
+    mutex_unlock( &tracker_queue_index_lock );
+    return SUCCESS;
+}
+
+void tracker_queue_index_remove( tracker_queue_t* tracker_queue, void* owner )
+{
+    tracker_queue_index_t* old_index;
+    tracker_queue_index_t* new_index = NULL;
+    size_t found_inx;
+    size_t inx;
+
+    mutex_lock( &tracker_queue_index_lock );
+
+    old_index = tracker_queue->index;
+    if (old_index == NULL){
+        mutex_unlock( &tracker_queue_index_lock );
+        return;
+    }
+
+    for (found_inx = 0; found_inx < old_index->count; ++found_inx)
+        if (old_index->entries[found_inx].owner == owner)
+            break;
+
+    if (found_inx == old_index->count){
+        mutex_unlock( &tracker_queue_index_lock );
+        return;
+    }
+
+    if (old_index->count > 1){
+        new_index = dbg_kzalloc( sizeof( tracker_queue_index_t ) + (old_index->count - 1) * sizeof( tracker_queue_index_entry_t ), GFP_KERNEL );
+        if (new_index == NULL){
+            log_err( "Failed to allocate tracker queue index. Owner removed in place" );
+
+            rcu_assign_pointer( old_index->entries[found_inx].owner, NULL );
+            synchronize_srcu( &tracker_queue_srcu );
+
+            mutex_unlock( &tracker_queue_index_lock );
+            return;
+        }
+
+        for (inx = 0; inx < old_index->count; ++inx)
+            if ((inx != found_inx) && (old_index->entries[inx].owner != NULL))
+                new_index->entries[new_index->count++] = old_index->entries[inx];
+    }
+
+    _tracker_queue_index_publish( tracker_queue, new_index );
+
+    mutex_unlock( &tracker_queue_index_lock );
+}
+
+// returns the entry with the biggest first sector that is less than 'sector' + 1
+static inline tracker_queue_index_entry_t* _tracker_queue_index_floor( tracker_queue_index_t* index, sector_t sector )
+{
+    size_t left = 0;
+    size_t right = index->count;
+
+    while (left < right){
+        size_t mid = left + ((right - left) >> 1);
+
+        if (index->entries[mid].first <= sector)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    if (left == 0)
+        return NULL;
+    return &index->entries[left - 1];
+}
+
+void* tracker_queue_index_find( tracker_queue_t* tracker_queue, sector_t sector )
+{
+    void* owner = NULL;
+    int lock_idx;
+    tracker_queue_index_t* index;
+
+    lock_idx = srcu_read_lock( &tracker_queue_srcu );
+    index = srcu_dereference( tracker_queue->index, &tracker_queue_srcu );
+    if (index != NULL){
+        tracker_queue_index_entry_t* entry = _tracker_queue_index_floor( index, sector );
+
+        if ((entry != NULL) && (sector < entry->last))
+            owner = srcu_dereference( entry->owner, &tracker_queue_srcu );
+    }
+    srcu_read_unlock( &tracker_queue_srcu, lock_idx );
+
+    return owner;
+}
+
+void* tracker_queue_index_find_intersection( tracker_queue_t* tracker_queue, sector_t first, sector_t last )
+{
+    void* owner = NULL;
+    int lock_idx;
+    tracker_queue_index_t* index;
+
+    if (first >= last)
+        return NULL;
+
+    lock_idx = srcu_read_lock( &tracker_queue_srcu );
+    index = srcu_dereference( tracker_queue->index, &tracker_queue_srcu );
+    if (index != NULL){
+        // intervals are not overlapped, so only the last one started before 'last' can intersect
+        tracker_queue_index_entry_t* entry = _tracker_queue_index_floor( index, last - 1 );
+
+        if ((entry != NULL) && (entry->last > first))
+            owner = srcu_dereference( entry->owner, &tracker_queue_srcu );
+    }
+    srcu_read_unlock( &tracker_queue_srcu, lock_idx );
+
+    return owner;
+}
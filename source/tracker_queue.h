@@ -1,6 +1,21 @@
 #pragma once
 #include "container_spinlocking.h"
 
+// sorted, non-overlapping sector intervals of the devices tracked on one queue
+typedef struct tracker_queue_index_entry_s
+{
+    sector_t first;  // first sector of the interval
+    sector_t last;   // sector next after the last one
+    void* owner;
+}tracker_queue_index_entry_t;
+
+// published by rcu_assign_pointer(), never changed after publication except the owner removed in place
+typedef struct tracker_queue_index_s
+{
+    size_t count;
+    tracker_queue_index_entry_t entries[0];
+}tracker_queue_index_t;
+
 typedef struct _tracker_queue_s
 {
     content_sl_t content;
@@ -10,6 +25,7 @@ typedef struct _tracker_queue_s
 
     atomic_t                atomic_ref_count;
 
+    tracker_queue_index_t*  index;
 }tracker_queue_t;
 
 int tracker_queue_init(void );
@@ -18,3 +34,11 @@ int tracker_queue_done(void );
 int tracker_queue_ref( struct request_queue* queue,    tracker_queue_t** ptracker_queue );
 void tracker_queue_unref( tracker_queue_t* ptracker_queue );
 int tracker_queue_find(    struct request_queue* queue, tracker_queue_t** ptracker_queue);
+
+int tracker_queue_read_lock( void );
+void tracker_queue_read_unlock( int lock_idx );
+
+int tracker_queue_index_add( tracker_queue_t* tracker_queue, sector_t first, sector_t count, void* owner );
+void tracker_queue_index_remove( tracker_queue_t* tracker_queue, void* owner );
+void* tracker_queue_index_find( tracker_queue_t* tracker_queue, sector_t sector );
+void* tracker_queue_index_find_intersection( tracker_queue_t* tracker_queue, sector_t first, sector_t last );
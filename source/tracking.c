@@ -7,6 +7,7 @@
 #include "blk_util.h"
 #include "blk_direct.h"
 #include "defer_io.h"
+#include "cbt_persist.h"
 
 #define SECTION "tracking  "
 #include "log_format.h"
@@ -31,8 +32,11 @@ blk_qc_t tracking_make_request( struct request_queue *q, struct bio *bio )
     tracker_queue_t* tracker_queue = NULL;
     snapdata_collector_t* collector = NULL;
     tracker_t* tracker = NULL;
+    int lock_idx;
 
     bio_get(bio);
+    // the tracker queue and the tracker are not freed until the bio is processed
+    lock_idx = tracker_queue_read_lock( );
 
     if (SUCCESS == tracker_queue_find(q, &tracker_queue)){
         //find tracker by queue
@@ -69,7 +73,8 @@ blk_qc_t tracking_make_request( struct request_queue *q, struct bio *bio )
                 if (tracker->is_unfreezable)
                     down_read(&tracker->unfreezable_lock);
 
-                if (atomic_read( &tracker->is_captured ))
+                if (atomic_read( &tracker->is_captured ) &&
+                    !defer_io_bypass_bio( tracker->defer_io, bio, sectStart, sectCount ))
                 {// do copy-on-write
                     int res = defer_io_redirect_bio( tracker->defer_io, bio, sectStart, sectCount, q, tracker_queue->original_make_request_fn, tracker );
                     if (SUCCESS == res)
@@ -82,10 +87,10 @@ blk_qc_t tracking_make_request( struct request_queue *q, struct bio *bio )
                 if (do_lowlevel){
                     bool cbt_locked = false;
 
-                    if (tracker && bio_data_dir( bio ) && bio_has_data( bio )){
+                    if (tracker && blk_bio_is_write( bio )){
                         cbt_locked = tracker_cbt_bitmap_lock( tracker );
                         if (cbt_locked)
-                            tracker_cbt_bitmap_set( tracker, sectStart, sectCount );
+                            tracker_cbt_bitmap_set( tracker, sectStart, sectCount, blk_bio_is_discard( bio ) );
                         //tracker_CbtBitmapUnlock( tracker );
                     }
                     //call low level block device
@@ -98,10 +103,10 @@ blk_qc_t tracking_make_request( struct request_queue *q, struct bio *bio )
             {
                 bool cbt_locked = false;
 
-                if (tracker && bio_data_dir( bio ) && bio_has_data( bio )){
+                if (tracker && blk_bio_is_write( bio )){
                     cbt_locked = tracker_cbt_bitmap_lock( tracker );
                     if (cbt_locked)
-                        tracker_cbt_bitmap_set( tracker, sectStart, sectCount );
+                        tracker_cbt_bitmap_set( tracker, sectStart, sectCount, blk_bio_is_discard( bio ) );
                 }
                 tracker_queue->original_make_request_fn( q, bio );
                 if (cbt_locked)
@@ -115,6 +120,7 @@ blk_qc_t tracking_make_request( struct request_queue *q, struct bio *bio )
     }else
         log_err("CRITICAL! Cannot find tracker queue");
 
+    tracker_queue_read_unlock( lock_idx );
     bio_put(bio);
 #if  LINUX_VERSION_CODE < KERNEL_VERSION(4,4,0)
 
@@ -128,7 +134,8 @@ blk_qc_t tracking_make_request( struct request_queue *q, struct bio *bio )
 }
 
 
-int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned long long snapshot_id)
+// cbt_entry_size is zero when the entry size of the CBT map should be kept
+int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned int cbt_entry_size, unsigned long long snapshot_id)
 {
     int result = SUCCESS;
     tracker_t* tracker = NULL;
@@ -143,7 +150,8 @@ int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned long
             tracker_snapshot_id_set(tracker, snapshot_id);
 
         if (NULL == tracker->cbt_map){
-            tracker_cbt_start(tracker, snapshot_id, cbt_block_size_degree, blk_dev_get_capacity(tracker->target_dev));
+            tracker_cbt_start(tracker, snapshot_id, cbt_block_size_degree, blk_dev_get_capacity(tracker->target_dev),
+                cbt_entry_size ? cbt_entry_size : CBT_ENTRY_SIZE_DEFAULT);
             result = -EALREADY;
         }
         else{
@@ -158,6 +166,13 @@ int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned long
                 log_warn( "Device resize detected. CBT fault" );
             }
 
+            if (cbt_entry_size == 0)
+                cbt_entry_size = cbt_map_entry_size( tracker->cbt_map );
+            else if (cbt_entry_size != cbt_map_entry_size( tracker->cbt_map )){
+                reset_needed = true;
+                log_warn_d( "CBT map entry size changed. CBT reset. New entry size ", cbt_entry_size );
+            }
+
             if (reset_needed)
             {
                 result = tracker_remove( tracker );
@@ -165,7 +180,7 @@ int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned long
                     log_err_d( "Failed to remove tracker. errno=", result );
                 }
                 else{
-                    result = tracker_create(snapshot_id, dev_id, cbt_block_size_degree, &tracker);
+                    result = tracker_create(snapshot_id, dev_id, cbt_block_size_degree, cbt_entry_size, &tracker);
                     if (SUCCESS != result){
                         log_err_d( "Failed to create tracker. errno=", result );
                     }
@@ -206,7 +221,8 @@ int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned long
                 }
             }
 
-            result = tracker_create(snapshot_id, dev_id, cbt_block_size_degree, &tracker);
+            result = tracker_create(snapshot_id, dev_id, cbt_block_size_degree,
+                cbt_entry_size ? cbt_entry_size : CBT_ENTRY_SIZE_DEFAULT, &tracker);
             if (SUCCESS != result)
                 log_err_d("Failed to create tracker. errno=", result);
         } while (false);
@@ -299,3 +315,167 @@ int tracking_read_cbt_bitmap( dev_t dev_id, unsigned int offset, size_t length,
 
     return result;
 }
+
+
+int tracking_cbt_info( dev_t dev_id, struct ioctl_tracking_cbt_info_s* p_info )
+{
+    int result = SUCCESS;
+    tracker_t* tracker = NULL;
+
+    result = tracker_find_by_dev_id( dev_id, &tracker );
+    if (SUCCESS != result){
+        log_err_format( "Unable to get CBT info for device [%d:%d]: device not found", MAJOR( dev_id ), MINOR( dev_id ) );
+        return result;
+    }
+    if (tracker->cbt_map == NULL){
+        log_err_format( "Unable to get CBT info for device [%d:%d]: CBT map is absent", MAJOR( dev_id ), MINOR( dev_id ) );
+        return -ENODATA;
+    }
+
+    p_info->cbt_entry_size = cbt_map_entry_size( tracker->cbt_map );
+    p_info->cbt_map_size = (unsigned int)cbt_map_size_in_bytes( tracker->cbt_map );
+    p_info->snap_number = (unsigned int)tracker->cbt_map->snap_number_previous;
+    veeam_uuid_copy( (veeam_uuid_t*)(p_info->generationId), &tracker->cbt_map->generationId );
+
+    return SUCCESS;
+}
+
+
+int tracking_cbt_persist( dev_t dev_id, dev_t storage_dev_id, struct block_range_s* ranges, unsigned int range_count )
+{
+    int result = SUCCESS;
+    tracker_t* tracker = NULL;
+
+    if (range_count == 0)
+        return cbt_persist_remove( dev_id );
+
+    result = cbt_persist_set( dev_id, storage_dev_id, ranges, range_count );
+    if (result != SUCCESS){
+        log_err_d( "Failed to set CBT storage. errno=", result );
+        return result;
+    }
+
+    //the map of the tracked device is stored from now on, the stored one is outdated already
+    if ((SUCCESS == tracker_find_by_dev_id( dev_id, &tracker )) && (tracker->cbt_map != NULL))
+        result = cbt_persist_attach( dev_id, tracker->cbt_map, tracker->device_capacity, false );
+
+    return result;
+}
+
+
+int tracking_cbt_mmap_info( dev_t dev_id, unsigned long long* p_offset, unsigned long long* p_length )
+{
+    int result = SUCCESS;
+    tracker_t* tracker = NULL;
+    unsigned long pgoff = ((unsigned long)dev_id) << CBT_MAP_MMAP_DEV_SHIFT;
+
+    if ((pgoff >> CBT_MAP_MMAP_DEV_SHIFT) != (unsigned long)dev_id){
+        log_err_format( "Unable to map CBT map for device [%d:%d]: device number is too large", MAJOR( dev_id ), MINOR( dev_id ) );
+        return -EOVERFLOW;
+    }
+
+    result = tracker_find_by_dev_id( dev_id, &tracker );
+    if (SUCCESS != result){
+        log_err_format( "Unable to map CBT map for device [%d:%d]: device not found", MAJOR( dev_id ), MINOR( dev_id ) );
+        return result;
+    }
+    if (tracker->cbt_map == NULL)
+        return -ENODATA;
+
+    *p_offset = ((unsigned long long)pgoff) << PAGE_SHIFT;
+    *p_length = ((unsigned long long)tracker->cbt_map->read_map->pg_cnt) << PAGE_SHIFT;
+    return SUCCESS;
+}
+
+int tracking_cbt_mmap( struct vm_area_struct* vma )
+{
+    int result = SUCCESS;
+    tracker_t* tracker = NULL;
+    dev_t dev_id = (dev_t)(vma->vm_pgoff >> CBT_MAP_MMAP_DEV_SHIFT);
+
+    result = tracker_find_by_dev_id( dev_id, &tracker );
+    if (SUCCESS != result){
+        log_err_format( "Unable to map CBT map for device [%d:%d]: device not found", MAJOR( dev_id ), MINOR( dev_id ) );
+        return result;
+    }
+    if (!atomic_read( &tracker->is_captured ) || (tracker->cbt_map == NULL)){
+        log_err_format( "Unable to map CBT map for device [%d:%d]: device is not captured by snapshot", MAJOR( dev_id ), MINOR( dev_id ) );
+        return -EPERM;
+    }
+
+    return cbt_map_mmap( tracker->cbt_map, vma );
+}
+
+
+int tracking_read_cbt_extents( dev_t dev_id, unsigned int base_snap_number, bool discarded, unsigned long long* p_cursor, struct block_range_s __user* user_extents, unsigned int* p_count )
+{
+    int result = SUCCESS;
+    tracker_t* tracker = NULL;
+    cbt_map_t* cbt_map;
+    range_t* extents = NULL;
+    struct block_range_s* ranges = NULL;
+    unsigned int capacity = min_t( unsigned int, *p_count, CBT_MAP_EXTENTS_PORTION );
+    unsigned int count = 0;
+    size_t cursor;
+    unsigned int inx;
+
+    result = tracker_find_by_dev_id( dev_id, &tracker );
+    if (SUCCESS != result){
+        log_err_format( "Unable to read CBT extents for device [%d:%d]: device not found", MAJOR( dev_id ), MINOR( dev_id ) );
+        return result;
+    }
+    if (!atomic_read( &tracker->is_captured ) || (tracker->cbt_map == NULL)){
+        log_err_format( "Unable to read CBT extents for device [%d:%d]: device is not captured by snapshot", MAJOR( dev_id ), MINOR( dev_id ) );
+        return -EPERM;
+    }
+    cbt_map = tracker->cbt_map;
+
+    if (capacity == 0)
+        return -EINVAL;
+    if (discarded && (cbt_map->discard_read == NULL)){
+        log_err_format( "Unable to read discarded extents for device [%d:%d]: discarded blocks are not recorded", MAJOR( dev_id ), MINOR( dev_id ) );
+        return -EOPNOTSUPP;
+    }
+
+    extents = dbg_kmalloc( capacity * sizeof( range_t ), GFP_KERNEL );
+    ranges = dbg_kmalloc( capacity * sizeof( struct block_range_s ), GFP_KERNEL );
+    do{
+        if ((extents == NULL) || (ranges == NULL)){
+            result = -ENOMEM;
+            break;
+        }
+
+        cursor = (size_t)(*p_cursor >> cbt_map->sect_in_block_degree);
+        result = cbt_map_read_extents( cbt_map, base_snap_number, discarded, &cursor, extents, capacity, &count );
+        if (result != SUCCESS)
+            break;
+
+        for (inx = 0; inx < count; ++inx){
+            sector_t ofs = ((sector_t)extents[inx].ofs) << cbt_map->sect_in_block_degree;
+            sector_t cnt = ((sector_t)extents[inx].cnt) << cbt_map->sect_in_block_degree;
+
+            //the last block can be incomplete
+            if ((ofs + cnt) > tracker->device_capacity)
+                cnt = tracker->device_capacity - ofs;
+
+            ranges[inx].ofs = ofs;
+            ranges[inx].cnt = cnt;
+        }
+
+        if (0 != copy_to_user( user_extents, ranges, count * sizeof( struct block_range_s ) )){
+            log_err( "Unable to read CBT extents: invalid user buffer" );
+            result = -ENODATA;
+            break;
+        }
+
+        *p_cursor = ((unsigned long long)cursor) << cbt_map->sect_in_block_degree;
+        *p_count = count;
+    } while (false);
+
+    if (ranges)
+        dbg_kfree( ranges );
+    if (extents)
+        dbg_kfree( extents );
+
+    return result;
+}
@@ -1,7 +1,12 @@
 #pragma once
 #include "veeamsnap_ioctl.h"
 
-int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned long long snapshot_id);
+int tracking_add(dev_t dev_id, unsigned int cbt_block_size_degree, unsigned int cbt_entry_size, unsigned long long snapshot_id);
 int tracking_remove(dev_t dev_id);
 int tracking_collect( int max_count, struct cbt_info_s* p_cbt_info, int* p_count );
 int tracking_read_cbt_bitmap( dev_t dev_id, unsigned int offset, size_t length, void __user * user_buff );
+int tracking_cbt_info( dev_t dev_id, struct ioctl_tracking_cbt_info_s* p_info );
+int tracking_cbt_persist( dev_t dev_id, dev_t storage_dev_id, struct block_range_s* ranges, unsigned int range_count );
+int tracking_cbt_mmap_info( dev_t dev_id, unsigned long long* p_offset, unsigned long long* p_length );
+int tracking_cbt_mmap( struct vm_area_struct* vma );
+int tracking_read_cbt_extents( dev_t dev_id, unsigned int base_snap_number, bool discarded, unsigned long long* p_cursor, struct block_range_s __user* user_extents, unsigned int* p_count );
@@ -86,6 +86,68 @@ struct ioctl_tracking_mark_dirty_blocks_s{
     };
 };
 #define IOCTL_TRACKING_MARK_DIRTY_BLOCKS _IOR(VEEAM_SNAP, 7, struct ioctl_tracking_mark_dirty_blocks_s)
+
+
+struct ioctl_tracking_read_cbt_extents_s{
+    struct ioctl_dev_id_s dev_id;
+    unsigned int base_snap_number;  // blocks changed after this snapshot are returned
+    unsigned long long cursor;      // in: sector to start from, out: sector to continue from. Not less than device capacity when done
+    unsigned int count;             // in: extents buffer capacity, out: extents count
+    union{
+        struct block_range_s* p_extents;
+        unsigned long long ull_extents;
+    };
+};
+#define IOCTL_TRACKING_READ_CBT_EXTENTS _IOW(VEEAM_SNAP, 8, struct ioctl_tracking_read_cbt_extents_s)
+
+
+#define CBT_ENTRY_SIZE_BYTE 1 // the CBT map is reset every 255 snapshots
+#define CBT_ENTRY_SIZE_WORD 2 // the CBT map is reset every 65535 snapshots, but is twice as large
+
+struct ioctl_tracking_add_ex_s{
+    struct ioctl_dev_id_s dev_id;
+    unsigned int cbt_entry_size;    // CBT_ENTRY_SIZE_BYTE or CBT_ENTRY_SIZE_WORD
+};
+#define IOCTL_TRACKING_ADD_EX _IOW(VEEAM_SNAP, 9, struct ioctl_tracking_add_ex_s)
+
+
+struct ioctl_tracking_cbt_info_s{
+    struct ioctl_dev_id_s dev_id;   // in
+    unsigned int cbt_entry_size;
+    unsigned int cbt_map_size;      // in bytes
+    unsigned int snap_number;       // not truncated to the byte, unlike cbt_info_s
+    unsigned char generationId[16];
+};
+#define IOCTL_TRACKING_CBT_INFO _IOW(VEEAM_SNAP, 10, struct ioctl_tracking_cbt_info_s)
+
+
+// The CBT map of the device is stored in the area on the module unload or on the clean reboot,
+// and is loaded when the device is added under tracking again. The area should be excluded from the backup.
+struct ioctl_tracking_cbt_persist_s{
+    struct ioctl_dev_id_s dev_id;
+    struct ioctl_dev_id_s storage_dev_id;
+    unsigned int range_count;       // zero to stop keeping the CBT map
+    union{
+        struct block_range_s* p_ranges;
+        unsigned long long ull_ranges;
+    };
+};
+#define IOCTL_TRACKING_CBT_PERSIST _IOW(VEEAM_SNAP, 11, struct ioctl_tracking_cbt_persist_s)
+
+
+// The CBT map of the captured device can be mapped read only by mmap() of the ctrl file
+// with the given offset. The mapping is valid until the next snapshot, after that it raises SIGBUS.
+struct ioctl_tracking_cbt_mmap_s{
+    struct ioctl_dev_id_s dev_id;   // in
+    unsigned long long offset;      // the offset for mmap()
+    unsigned long long length;      // the map size in bytes, rounded up to the page
+};
+#define IOCTL_TRACKING_CBT_MMAP _IOW(VEEAM_SNAP, 12, struct ioctl_tracking_cbt_mmap_s)
+
+
+// The changed extents, which were discarded or zeroed entirely before the snapshot and were not written after that.
+// The backup can skip reading them. Available when the module is loaded with cbt_discard_zero=1.
+#define IOCTL_TRACKING_READ_CBT_DISCARDED _IOW(VEEAM_SNAP, 13, struct ioctl_tracking_read_cbt_extents_s)
 //////////////////////////////////////////////////////////////////////////
 // snapshot
 
@@ -115,6 +177,24 @@ struct ioctl_range_s{
     unsigned long long right;
 };
 
+// The ranges in bytes, which are free in the filesystem of the snapshot.
+// Copy-on-write is not performed for the blocks fully covered by the ranges,
+// and the snapshot image returns zeros for them.
+struct ioctl_snapshot_cow_exclude_s{
+    struct ioctl_dev_id_s dev_id;
+    unsigned int range_count;
+    union{
+        struct ioctl_range_s* ranges;
+        unsigned long long ull_ranges;
+    };
+};
+#define IOCTL_SNAPSHOT_COW_EXCLUDE    _IOW(VEEAM_SNAP, 0x13, struct ioctl_snapshot_cow_exclude_s)
+
+// The ranges in bytes of the snapshot image, which were already read by the backup.
+// Copy-on-write is stopped for the blocks fully covered by the ranges,
+// so the data of the ranges read from the image again may be not consistent.
+#define IOCTL_SNAPSHOT_COW_CONSUMED    _IOW(VEEAM_SNAP, 0x14, struct ioctl_snapshot_cow_exclude_s)
+
 //////////////////////////////////////////////////////////////////////////
 // snapshotdata - not supported 
 /*
@@ -256,11 +336,31 @@ struct ioctl_collect_snapshotdata_location_complete_s{
 // debug and support
 #define IOCTL_PRINTSTATE _IO(VEEAM_SNAP, 0x80)
 
-#ifdef SNAPIMAGE_TRACER
 #define VEEAM_IMAGE   0x69730000  // 'iV' <-> "Vi"
 
 //////////////////////////////////////////////////////////////////////////
 // io control for snapshot image 
+
+// The plan of the backup: the sorted extents of the image in bytes are read at once.
+// The data of the extents is placed into the buffer one after another. The extents, which
+// are not fit in the buffer, are not read, so the plan is continued from completed_count.
+struct ioctl_image_read_plan_s{
+    unsigned int range_count;
+    union{
+        struct ioctl_range_s* ranges;
+        unsigned long long ull_ranges;
+    };
+    unsigned long long buffer_size;
+    union{
+        void* buffer;
+        unsigned long long ull_buffer;
+    };
+    unsigned int completed_count; // [out]
+    unsigned long long completed_size; // [out]
+};
+#define IOCTL_IMAGE_READ_PLAN _IOW(VEEAM_IMAGE, 0x82, struct ioctl_image_read_plan_s)
+
+#ifdef SNAPIMAGE_TRACER
 typedef struct trace_record_s
 {
     unsigned long long time;
@@ -16,6 +16,7 @@
 #include "snapshot.h"
 #include "tracker_queue.h"
 #include "tracker.h"
+#include "cbt_persist.h"
 #include "sparse_bitmap.h"
 
 //#include "btrfs_support.h"
@@ -30,6 +31,17 @@ static char* logdir = "/var/log/veeam";
 static int g_param_snapstore_block_size_pow = 14;
 static int g_param_change_tracking_block_size_pow = 18;
 static unsigned int g_param_fixflags = 0;
+static int g_param_cow_workers = 4;
+static int g_param_cow_pipeline_depth = 2;
+static int g_param_cbt_discard_zero = 0;
+static int g_param_cow_buffer_pool_mb = 16;
+static int g_param_snapimage_workers = 4;
+static int g_param_snapimage_inline_read = 1;
+static int g_param_snapimage_readahead_kb = 1024;
+static int g_param_snapimage_plan_depth = 16;
+static int g_param_throttle_read_weight = 1;
+static int g_param_throttle_cow_weight = 1;
+static int g_param_throttle_min_read_mbps = 8;
 
 int get_debuglogging( void )
 {
@@ -56,6 +68,61 @@ int get_change_tracking_block_size_pow(void)
     return g_param_change_tracking_block_size_pow;
 }
 
+int get_cow_workers(void)
+{
+    return g_param_cow_workers;
+}
+
+int get_cow_pipeline_depth(void)
+{
+    return g_param_cow_pipeline_depth;
+}
+
+int get_cbt_discard_zero(void)
+{
+    return g_param_cbt_discard_zero;
+}
+
+int get_cow_buffer_pool_mb(void)
+{
+    return g_param_cow_buffer_pool_mb;
+}
+
+int get_snapimage_workers(void)
+{
+    return g_param_snapimage_workers;
+}
+
+int get_snapimage_inline_read(void)
+{
+    return g_param_snapimage_inline_read;
+}
+
+int get_snapimage_readahead_kb(void)
+{
+    return g_param_snapimage_readahead_kb;
+}
+
+int get_snapimage_plan_depth(void)
+{
+    return g_param_snapimage_plan_depth;
+}
+
+int get_throttle_read_weight(void)
+{
+    return g_param_throttle_read_weight;
+}
+
+int get_throttle_cow_weight(void)
+{
+    return g_param_throttle_cow_weight;
+}
+
+int get_throttle_min_read_mbps(void)
+{
+    return g_param_throttle_min_read_mbps;
+}
+
 unsigned int get_fixflags(void)
 {
     return g_param_fixflags;
@@ -71,6 +138,7 @@ static struct file_operations ctrl_fops = {
     .open   = ctrl_open,
     .release= ctrl_release,
     .poll   = ctrl_poll,
+    .mmap   = ctrl_mmap,
     //.ioctl  = ctrl_ioctl,
     .unlocked_ioctl = ctrl_unlocked_ioctl
 };
@@ -113,6 +181,17 @@ int __init veeamsnap_init(void)
     log_tr_d( "debuglogging: ", g_param_debuglogging );
     log_tr_d("snapstore_block_size_pow: ", g_param_snapstore_block_size_pow);
     log_tr_d("change_tracking_block_size_pow: ", g_param_change_tracking_block_size_pow);
+    log_tr_d("cow_workers: ", g_param_cow_workers);
+    log_tr_d("cow_pipeline_depth: ", g_param_cow_pipeline_depth);
+    log_tr_d("cbt_discard_zero: ", g_param_cbt_discard_zero);
+    log_tr_d("cow_buffer_pool_mb: ", g_param_cow_buffer_pool_mb);
+    log_tr_d("snapimage_workers: ", g_param_snapimage_workers);
+    log_tr_d("snapimage_inline_read: ", g_param_snapimage_inline_read);
+    log_tr_d("snapimage_readahead_kb: ", g_param_snapimage_readahead_kb);
+    log_tr_d("snapimage_plan_depth: ", g_param_snapimage_plan_depth);
+    log_tr_d("throttle_read_weight: ", g_param_throttle_read_weight);
+    log_tr_d("throttle_cow_weight: ", g_param_throttle_cow_weight);
+    log_tr_d("throttle_min_read_mbps: ", g_param_throttle_min_read_mbps);
     log_tr_s( "logdir: ", logdir );
     log_tr_x("fixflags: ", g_param_fixflags);
 
@@ -134,6 +213,69 @@ int __init veeamsnap_init(void)
         log_tr_d("Limited change_tracking_block_size_pow: ", g_param_change_tracking_block_size_pow);
     }
 
+    if (g_param_cow_workers > DEFER_IO_WORKERS_MAX){
+        g_param_cow_workers = DEFER_IO_WORKERS_MAX;
+        log_tr_d("Limited cow_workers: ", g_param_cow_workers);
+    }
+    else if (g_param_cow_workers < 1){
+        g_param_cow_workers = 1;
+        log_tr_d("Limited cow_workers: ", g_param_cow_workers);
+    }
+
+    if (g_param_cow_buffer_pool_mb < 0){
+        g_param_cow_buffer_pool_mb = 0;
+        log_tr_d("Limited cow_buffer_pool_mb: ", g_param_cow_buffer_pool_mb);
+    }
+
+    if (g_param_snapimage_workers > SNAPIMAGE_WORKERS_MAX){
+        g_param_snapimage_workers = SNAPIMAGE_WORKERS_MAX;
+        log_tr_d("Limited snapimage_workers: ", g_param_snapimage_workers);
+    }
+    else if (g_param_snapimage_workers < 1){
+        g_param_snapimage_workers = 1;
+        log_tr_d("Limited snapimage_workers: ", g_param_snapimage_workers);
+    }
+
+    if (g_param_snapimage_readahead_kb > SNAPIMAGE_READAHEAD_KB_MAX){
+        g_param_snapimage_readahead_kb = SNAPIMAGE_READAHEAD_KB_MAX;
+        log_tr_d("Limited snapimage_readahead_kb: ", g_param_snapimage_readahead_kb);
+    }
+    else if (g_param_snapimage_readahead_kb < 0){
+        g_param_snapimage_readahead_kb = 0;
+        log_tr_d("Limited snapimage_readahead_kb: ", g_param_snapimage_readahead_kb);
+    }
+
+    if (g_param_snapimage_plan_depth > SNAPIMAGE_PLAN_DEPTH_MAX){
+        g_param_snapimage_plan_depth = SNAPIMAGE_PLAN_DEPTH_MAX;
+        log_tr_d("Limited snapimage_plan_depth: ", g_param_snapimage_plan_depth);
+    }
+    else if (g_param_snapimage_plan_depth < 1){
+        g_param_snapimage_plan_depth = 1;
+        log_tr_d("Limited snapimage_plan_depth: ", g_param_snapimage_plan_depth);
+    }
+
+    if (g_param_throttle_read_weight < 0){
+        g_param_throttle_read_weight = 0;
+        log_tr_d("Limited throttle_read_weight: ", g_param_throttle_read_weight);
+    }
+    if (g_param_throttle_cow_weight < 1){
+        g_param_throttle_cow_weight = 1;
+        log_tr_d("Limited throttle_cow_weight: ", g_param_throttle_cow_weight);
+    }
+    if (g_param_throttle_min_read_mbps < 0){
+        g_param_throttle_min_read_mbps = 0;
+        log_tr_d("Limited throttle_min_read_mbps: ", g_param_throttle_min_read_mbps);
+    }
+
+    if (g_param_cow_pipeline_depth > DEFER_IO_PIPELINE_DEPTH_MAX){
+        g_param_cow_pipeline_depth = DEFER_IO_PIPELINE_DEPTH_MAX;
+        log_tr_d("Limited cow_pipeline_depth: ", g_param_cow_pipeline_depth);
+    }
+    else if (g_param_cow_pipeline_depth < 1){
+        g_param_cow_pipeline_depth = 1;
+        log_tr_d("Limited cow_pipeline_depth: ", g_param_cow_pipeline_depth);
+    }
+
 #if defined(DISTRIB_NAME_RHEL) || defined(DISTRIB_NAME_CENTOS) 
     show_distrib("RHEL or CentOS");
 #endif
@@ -180,13 +322,19 @@ int __init veeamsnap_init(void)
         if ((result = blk_redirect_bioset_create( )) != SUCCESS)
             break;
 
-        blk_deferred_init( );
+        if ((result = blk_deferred_init( )) != SUCCESS)
+            break;
         if ((result = blk_deferred_bioset_create( )) != SUCCESS)
             break;
+        if ((result = defer_io_init( )) != SUCCESS)
+            break;
 
         if ((result = sparsebitmap_init( )) != SUCCESS)
             break;
 
+        if ((result = cbt_persist_init( )) != SUCCESS)
+            break;
+
         if ((result = tracker_init( )) != SUCCESS)
             break;
 
@@ -207,6 +355,10 @@ int __init veeamsnap_init(void)
         if ((result = snapimage_init( )) != SUCCESS)
             break;
 
+        // the last, so no failure after it leaves the notifier on the reboot chain
+        if ((result = cbt_persist_reboot_register( )) != SUCCESS)
+            break;
+
     }while(false);
 /*
 
@@ -238,6 +390,8 @@ void __exit veeamsnap_exit(void)
     //log_tr_d( "vmem_cnt=", atomic_read( &g_vmem_cnt ) );
 #endif
 
+    // the module text may be unloaded below even if some parts fail to stop
+    cbt_persist_reboot_unregister( );
 
     result = snapshot_Done( );
     if (SUCCESS == result){
@@ -252,12 +406,15 @@ void __exit veeamsnap_exit(void)
             result = tracker_queue_done( );
         }
 
+        cbt_persist_done( );
+
         snapimage_done( );
 
         sparsebitmap_done( );
 
 
 
+        defer_io_done( );
         blk_deferred_bioset_free( );
         blk_deferred_done( );
 
@@ -310,6 +467,39 @@ MODULE_PARM_DESC(snapstore_block_size_pow, "Snapstore block size binary pow. 20
 module_param_named(change_tracking_block_size_pow, g_param_change_tracking_block_size_pow, int, 0644);
 MODULE_PARM_DESC(change_tracking_block_size_pow, "Change-tracking block size binary pow. 18 for 256 KiB block size");
 
+module_param_named(cow_workers, g_param_cow_workers, int, 0644);
+MODULE_PARM_DESC(cow_workers, "Maximum number of copy-on-write threads for each device under snapshot");
+
+module_param_named(cow_pipeline_depth, g_param_cow_pipeline_depth, int, 0644);
+MODULE_PARM_DESC(cow_pipeline_depth, "Number of copy-on-write batches in process by each thread. 1 disables overlapping of reading and storing");
+
+module_param_named(cow_buffer_pool_mb, g_param_cow_buffer_pool_mb, int, 0644);
+MODULE_PARM_DESC(cow_buffer_pool_mb, "Limit of the preallocated copy-on-write buffers for each device under snapshot in MiB. 0 disables the pool");
+
+module_param_named(snapimage_workers, g_param_snapimage_workers, int, 0644);
+MODULE_PARM_DESC(snapimage_workers, "Maximum number of request processing threads for each snapshot image. Limited by the number of online CPUs");
+
+module_param_named(snapimage_inline_read, g_param_snapimage_inline_read, int, 0644);
+MODULE_PARM_DESC(snapimage_inline_read, "Process the snapshot image reads in the context of the caller, when they do not need to wait. 0 queues all the requests to the threads");
+
+module_param_named(snapimage_readahead_kb, g_param_snapimage_readahead_kb, int, 0644);
+MODULE_PARM_DESC(snapimage_readahead_kb, "Size of the readahead window for the sequential reader of the snapshot image, two windows are kept for each image. 0 disables the readahead");
+
+module_param_named(snapimage_plan_depth, g_param_snapimage_plan_depth, int, 0644);
+MODULE_PARM_DESC(snapimage_plan_depth, "Number of 1 MiB chunks, which are read at once by the read plan of the snapshot image");
+
+module_param_named(throttle_read_weight, g_param_throttle_read_weight, int, 0644);
+MODULE_PARM_DESC(throttle_read_weight, "Share of the snapshot image reads against the copy-on-write while the copy-on-write is queued. 0 leaves the minimum read bandwidth only");
+
+module_param_named(throttle_cow_weight, g_param_throttle_cow_weight, int, 0644);
+MODULE_PARM_DESC(throttle_cow_weight, "Share of the copy-on-write against the snapshot image reads");
+
+module_param_named(throttle_min_read_mbps, g_param_throttle_min_read_mbps, int, 0644);
+MODULE_PARM_DESC(throttle_min_read_mbps, "Snapshot image read bandwidth in MiB per second, which is guaranteed while the copy-on-write is queued");
+
+module_param_named(cbt_discard_zero, g_param_cbt_discard_zero, int, 0644);
+MODULE_PARM_DESC(cbt_discard_zero, "Record the discarded blocks in the CBT map, so the backup can skip reading them");
+
 module_param_named(fixflags, g_param_fixflags, uint, 0644);
 MODULE_PARM_DESC(fixflags, "Flags for known issues");
 